@@ -543,9 +543,13 @@ extern int mem_prealloc;
 #define TLB_NOTDIRTY    (1 << 4)
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
+/* Set if a PANDA memory watch covers the page.  Keeps accesses off the
+   TCG fast path; the softmmu helpers otherwise treat the page as RAM.  */
+#define TLB_WATCH       (1 << 6)
 
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
+#define RR_HASH_DIRTY_FLAG   0x04
 #define MIGRATION_DIRTY_FLAG 0x08
 
 /* read dirty bit (return 0 or 1) */
@@ -139,6 +139,7 @@ typedef struct icount_decr_u16 {
 struct kvm_run;
 struct KVMState;
 struct qemu_work_item;
+struct panda_mem_batch;
 
 typedef struct CPUBreakpoint {
     target_ulong pc;
@@ -221,8 +222,10 @@ typedef struct CPUWatchpoint {
     int kvm_vcpu_dirty;                                                 \
     /* record and replay */                                             \
     uint64_t rr_guest_instr_count;                                      \
+    int32_t rr_chain_budget;                                            \
     uint64_t rr_guest_pc;                                               \
-    uint64_t panda_guest_pc;
+    uint64_t panda_guest_pc;                                            \
+    struct panda_mem_batch *panda_mem_batch;
 
 // record/replay
 #ifndef GUEST_ICOUNT
@@ -51,11 +51,14 @@ bool bb_invalidate_done = false;
 #ifdef CONFIG_SOFTMMU
 // TRL 0810 record replay stuff 
 #include "rr_log.h"
+#include "main-loop.h"
 #endif
 
 #include <signal.h>
 
 #include "panda_plugin.h"
+#include "panda/panda_work.h"
+#include "rr_stats.h"
 
 #ifdef CONFIG_SOFTMMU
 //mz need this here because CPU_LOG_RR constant is not available in rr_log.[ch]
@@ -139,6 +142,8 @@ static TranslationBlock *tb_find_slow(CPUState *env,
                                       uint64_t flags)
 {
     panda_cb_list *plist;
+    panda_cb_list **pcb;
+    RR_phase old_phase;
     TranslationBlock *tb, **ptb1;
     unsigned int h;
     tb_page_addr_t phys_pc, phys_page1;
@@ -177,15 +182,19 @@ static TranslationBlock *tb_find_slow(CPUState *env,
  not_found:
    /* if no translated code available, then translate it now */
 
-    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_translate(env, pc);
+    old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_BLOCK_TRANSLATE, pcb, plist) {
+        RR_STATS_CB(plist, plist->entry.before_block_translate(env, pc));
     }
 
+    rr_stats_enter(RR_PHASE_TRANSLATE);
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
-    for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_translate(env, tb);
+    rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb, plist) {
+        RR_STATS_CB(plist, plist->entry.after_block_translate(env, tb));
     }
+    rr_stats_enter(old_phase);
 
  found:
     /* Move the last found TB to the head of the list */
@@ -264,6 +273,10 @@ void rr_quit_cpu_loop(void) {
 void rr_clear_rr_guest_instr_count(CPUState *cpu_state) {
   cpu_state->rr_guest_instr_count = 0;
 }
+
+void rr_set_rr_guest_instr_count(CPUState *cpu_state, uint64_t guest_instr_count) {
+  cpu_state->rr_guest_instr_count = guest_instr_count;
+}
 #endif
 
 
@@ -727,12 +740,29 @@ int cpu_exec(CPUState *env)
                         }
                     }
                 }
+                // No callback is running here, so dispatch tables that
+                // were replaced since the last block can go
+                panda_cb_tab_reclaim();
+                // Finished records from plugins' work queues
+                if (panda_work_queues) {
+                    panda_work_poll_all();
+                }
 
                 if(panda_flush_tb()) {
                     tb_flush(env);
                     tb_invalidated_flag = 1;
                 }
 
+                // Memory watches changed: refill every TLB so that
+                // TLB_WATCH marks exactly the watched pages
+                if (panda_flush_tlb()) {
+                    CPUState *penv;
+                    for (penv = first_cpu; penv != NULL;
+                            penv = penv->next_cpu) {
+                        tlb_flush(penv, 1);
+                    }
+                }
+
                 spin_lock(&tb_lock);
 
                 //bdg WARNING! This can cause an exception
@@ -754,14 +784,16 @@ int cpu_exec(CPUState *env)
                 // So we guard the callback execution with bb_invalidate_done, which
                 // will get cleared when we actually get to execute the basic block.
                 panda_cb_list *plist;
+                panda_cb_list **pcb;
                 bool panda_invalidate_tb = false;
                 if (unlikely(!bb_invalidate_done)) {
-                    for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-                            plist != NULL; plist = panda_cb_list_next(plist)) {
-                        panda_invalidate_tb |=
-                            plist->entry.before_block_exec_invalidate_opt(env, tb);
+                    rr_stats_enter(RR_PHASE_CALLBACKS);
+                    PANDA_CB_FOREACH_TB(PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, tb, pcb, plist) {
+                        RR_STATS_CB(plist, panda_invalidate_tb |=
+                            plist->entry.before_block_exec_invalidate_opt(env, tb));
                     }
                     bb_invalidate_done = true;
+                    rr_stats_enter(RR_PHASE_OTHER);
                 }
 
 #ifdef CONFIG_SOFTMMU
@@ -798,7 +830,8 @@ int cpu_exec(CPUState *env)
                 // (T0 & 3) contains info about which branch we took (why 2 bits?)
                 // tb is current translation block.  
 #ifdef CONFIG_SOFTMMU
-                if (rr_mode != RR_REPLAY){
+                // In replay, only TBs that check rr_chain_budget can be chained
+                if (rr_mode != RR_REPLAY || rr_replay_chain_tbs()){
 #endif
                     if ((panda_tb_chaining == true)){
                         if (next_tb != 0 && tb->page_addr[1] == -1) {
@@ -817,6 +850,18 @@ int cpu_exec(CPUState *env)
 
                 spin_unlock(&tb_lock);	       
 
+#ifdef CONFIG_SOFTMMU
+                // Hold here at a TB boundary until the main loop has
+                // written the checkpoint
+                if (rr_mode == RR_REPLAY && rr_checkpoint_due()) {
+                    if (!rr_checkpoint_requested) {
+                        rr_checkpoint_requested = 1;
+                        qemu_notify_event();
+                    }
+                    break;
+                }
+#endif
+
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
                    infinite loop and becomes env->current_tb. Avoid
@@ -851,6 +896,15 @@ int cpu_exec(CPUState *env)
                         rr_do_end_replay(1);
                     }
                 }
+
+                // State hashes, for finding where replay diverges
+                if ((rr_mode == RR_RECORD && rr_hash_due()) || rr_mode == RR_REPLAY) {
+                    rr_skipped_callsite_location = RR_CALLSITE_CPU_EXEC_DBG;
+                    rr_debug();
+                    if (rr_end_replay_requested) {
+                        break;
+                    }
+                }
 #endif
 
 #ifdef CONFIG_SOFTMMU
@@ -861,6 +915,10 @@ int cpu_exec(CPUState *env)
                         //mz setting program point just before call to gen_func()
 #ifdef CONFIG_SOFTMMU
                         rr_set_program_point();
+                        // chained TBs may run up to the next replay event
+                        if (rr_in_replay()) {
+                            env->rr_chain_budget = rr_get_chain_budget(tb);
+                        }
 #endif
                         //mz Actually jump into the generated code
                         /* execute the generated code */
@@ -870,13 +928,14 @@ int cpu_exec(CPUState *env)
                         bb_invalidate_done = false;
 
                         // PANDA instrumentation: before basic block exec
-                        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
-                                plist != NULL; plist = panda_cb_list_next(plist)) {
-                            plist->entry.before_block_exec(env, tb);
+                        rr_stats_enter(RR_PHASE_CALLBACKS);
+                        PANDA_CB_FOREACH_TB(PANDA_CB_BEFORE_BLOCK_EXEC, tb, pcb, plist) {
+                            RR_STATS_CB(plist, plist->entry.before_block_exec(env, tb));
                         }
 
+                        rr_stats_enter(RR_PHASE_EXEC);
 #if defined(CONFIG_LLVM)
-                        if(execute_llvm) {
+                        if(execute_llvm && panda_block_exec_llvm(env, tb)) {
                             assert(tb->llvm_tc_ptr);
                             next_tb = tcg_llvm_qemu_tb_exec(env, tb);
                         } else {
@@ -887,10 +946,25 @@ int cpu_exec(CPUState *env)
                         next_tb = tcg_qemu_tb_exec(env, tc_ptr);
 #endif
 
-                        for(plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-                            plist->entry.after_block_exec(env, tb, (TranslationBlock *)(next_tb & ~3));
+#ifdef CONFIG_SOFTMMU
+                        panda_mem_batch_flush(env);
+#endif
+                        rr_stats_enter(RR_PHASE_CALLBACKS);
+                        PANDA_CB_FOREACH_TB(PANDA_CB_AFTER_BLOCK_EXEC, tb, pcb, plist) {
+                            RR_STATS_CB(plist, plist->entry.after_block_exec(env, tb, (TranslationBlock *)(next_tb & ~3)));
                         }
+                        rr_stats_enter(RR_PHASE_OTHER);
 
+#ifdef CONFIG_SOFTMMU
+                        if ((next_tb & 3) == 2 && rr_replay_chain_tbs()) {
+                            /* Replay chaining budget ran out before this TB
+                               started; go back through the loop above so the
+                               next replay event is handled.  */
+                            tb = (TranslationBlock *)(long)(next_tb & ~3);
+                            cpu_pc_from_tb(env, tb);
+                            next_tb = 0;
+                        } else
+#endif
                         if ((next_tb & 3) == 2) {
                             /* Instruction counter expired.  */
                             int insns_left;
@@ -930,6 +1004,12 @@ int cpu_exec(CPUState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            // we may have jumped out of any phase
+            rr_stats_enter(RR_PHASE_OTHER);
+#ifdef CONFIG_SOFTMMU
+            // accesses made before the fault
+            panda_mem_batch_flush(env);
+#endif
         }
     } /* for(;;) */
 
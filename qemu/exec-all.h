@@ -99,6 +99,8 @@ int cpu_gen_code(CPUState *env, struct TranslationBlock *tb,
                  int *gen_code_size_ptr);
 int cpu_restore_state(struct TranslationBlock *tb,
                       CPUState *env, unsigned long searched_pc);
+target_ulong cpu_get_guest_pc(struct TranslationBlock *tb,
+                              CPUState *env, unsigned long searched_pc);
 void cpu_resume_from_signal(CPUState *env1, void *puc);
 void cpu_io_recompile(CPUState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUState *env, 
@@ -187,6 +189,9 @@ struct TranslationBlock {
     // record and replay - might just be able to use icount
     uint16_t num_guest_insns;
 
+    // plugins whose PANDA_CB_BLOCK_FILTER selected this TB (one bit each)
+    uint32_t panda_filter_mask;
+
 #ifdef CONFIG_LLVM
     /* pointer to LLVM translated code */
     struct TCGLLVMContext *tcg_llvm_context;
@@ -75,6 +75,7 @@
 #include "rr_log.h"
 #endif
 #include "panda_plugin.h"
+#include "panda/panda_vmem.h"
 
 #ifdef CONFIG_LLVM
 //#include "tcg-llvm.h"
@@ -722,6 +723,7 @@ void tb_free(TranslationBlock *tb)
 #if defined(CONFIG_LLVM)
         tcg_llvm_tb_free(tb);
 #endif
+        panda_tb_record_forget(tb);
 
         nb_tbs--;
     }
@@ -798,6 +800,9 @@ void tb_flush(CPUState *env1)
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
+    /* host code addresses are about to be reused */
+    panda_pc_cache_flush();
+    panda_tb_record_forget(NULL);
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
@@ -1075,6 +1080,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb->panda_filter_mask = 0;
+    if (panda_cb_tab[PANDA_CB_BLOCK_FILTER]) {
+        tb->panda_filter_mask = panda_tb_filter_mask(env, tb);
+    }
     return tb;
 }
 
@@ -1398,7 +1407,11 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
         return NULL;
 
 #if defined(CONFIG_LLVM)
-    if(execute_llvm) {
+    // With LLVM on, blocks can still run their TCG code (see
+    // PANDA_CB_BEFORE_BLOCK_EXEC_LLVM), so only search the LLVM code for
+    // addresses outside the TCG buffer
+    if(execute_llvm && (tc_ptr < (unsigned long)code_gen_buffer ||
+                        tc_ptr >= (unsigned long)code_gen_ptr)) {
         for(m=0; m<nb_tbs; m++) {
             tb = &tbs[m];
             if(tb->llvm_function) {
@@ -2136,6 +2149,7 @@ void tlb_flush(CPUState *env, int flush_global)
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
+    panda_vmem_tlb_flush(env, flush_global);
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -2178,6 +2192,7 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
     tlb_flush_jmp_cache(env, addr);
+    panda_vmem_tlb_flush_page(env, addr);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -2201,10 +2216,10 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
                                          unsigned long start, unsigned long length)
 {
     unsigned long addr;
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_WATCH)) == IO_MEM_RAM) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write = (tlb_entry->addr_write & TARGET_PAGE_MASK) | TLB_NOTDIRTY;
+            tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
 }
@@ -2310,7 +2325,7 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
     fprintf(logfile, "cpu_tlb_update_dirty:\n");
 #endif
 
-    if ((tlb_entry->addr_write & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+    if ((tlb_entry->addr_write & ~(TARGET_PAGE_MASK | TLB_WATCH)) == IO_MEM_RAM) {
         p = (void *)(unsigned long)((tlb_entry->addr_write & TARGET_PAGE_MASK)
             + tlb_entry->addend);
         ram_addr = qemu_ram_addr_from_host_nofail(p);
@@ -2333,8 +2348,8 @@ void cpu_tlb_update_dirty(CPUState *env)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY))
-        tlb_entry->addr_write = vaddr;
+    if ((tlb_entry->addr_write & ~TLB_WATCH) == (vaddr | TLB_NOTDIRTY))
+        tlb_entry->addr_write &= ~TLB_NOTDIRTY;
 }
 
 /* update the TLB corresponding to virtual page vaddr
@@ -2393,6 +2408,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUTLBEntry *te;
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
+    int watch;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -2452,12 +2468,22 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         }
     }
 
+    // PANDA memory watches: keep reads and/or writes to watched pages off
+    // the TCG fast path.  Instruction fetches are never watched.
+    watch = 0;
+    if (unlikely(panda_use_memwatch)) {
+        watch = panda_mem_watch_page(vaddr, paddr);
+    }
+
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
+        if (watch & PANDA_MEM_WATCH_READ) {
+            te->addr_read |= TLB_WATCH;
+        }
     } else {
         te->addr_read = -1;
     }
@@ -2478,6 +2504,9 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         } else {
             te->addr_write = address;
         }
+        if (watch & PANDA_MEM_WATCH_WRITE) {
+            te->addr_write |= TLB_WATCH;
+        }
     } else {
         te->addr_write = -1;
     }
@@ -4202,7 +4231,8 @@ static int cpu_physical_memory_rw_ex(target_phys_addr_t addr, uint8_t *buf,
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
                     panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_list **pcb;
+                    PANDA_CB_FOREACH(PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM, pcb, plist) {
                         plist->entry.replay_before_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
@@ -4271,7 +4301,8 @@ static int cpu_physical_memory_rw_ex(target_phys_addr_t addr, uint8_t *buf,
                 if (rr_mode == RR_REPLAY) {
                     // run all callbacks registered for cpu_physical_memory_rw ram case
                     panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM]; plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_list **pcb;
+                    PANDA_CB_FOREACH(PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM, pcb, plist) {
                         plist->entry.replay_before_cpu_physical_mem_rw_ram(cpu_single_env, is_write, buf, addr1, l);
                     }
                 }
@@ -4296,6 +4327,66 @@ int panda_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
     return cpu_physical_memory_rw_ex(addr, buf, len, is_write, true);
 }
 
+// Host address of a readable RAM or ROM page, NULL for I/O or unassigned
+static uint8_t *panda_phys_page_ptr(target_phys_addr_t page) {
+    PhysPageDesc *p = phys_page_find(page >> TARGET_PAGE_BITS);
+    ram_addr_t pd;
+
+    if (!p)
+        return NULL;
+    pd = p->phys_offset;
+    if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd & IO_MEM_ROMD))
+        return NULL;
+    return qemu_safe_ram_ptr(pd & TARGET_PAGE_MASK);
+}
+
+// Length of the longest prefix of [addr, addr+len) that is either all
+// RAM, contiguous in host memory, or all hole.  *host is set to the host
+// address of addr, or NULL for a hole.
+static target_phys_addr_t panda_phys_run(target_phys_addr_t addr,
+                                         target_phys_addr_t len,
+                                         const uint8_t **host) {
+    target_phys_addr_t page = addr & TARGET_PAGE_MASK;
+    target_phys_addr_t run = (page + TARGET_PAGE_SIZE) - addr;
+    uint8_t *p = panda_phys_page_ptr(page);
+    uint8_t *next;
+
+    *host = p ? p + (addr & ~TARGET_PAGE_MASK) : NULL;
+    while (run < len) {
+        page += TARGET_PAGE_SIZE;
+        next = panda_phys_page_ptr(page);
+        if (p ? next != p + TARGET_PAGE_SIZE : next != NULL)
+            break;
+        p = next;
+        run += TARGET_PAGE_SIZE;
+    }
+    return run < len ? run : len;
+}
+
+const uint8_t *panda_phys_ptr(target_phys_addr_t addr,
+                              target_phys_addr_t *len) {
+    const uint8_t *host;
+
+    if (*len == 0)
+        return NULL;
+    *len = panda_phys_run(addr, *len, &host);
+    return host;
+}
+
+int panda_phys_ranges(target_phys_addr_t addr, target_phys_addr_t len,
+                      panda_phys_range *ranges, int max) {
+    int n = 0;
+
+    while (len > 0 && n < max) {
+        ranges[n].addr = addr;
+        ranges[n].len = panda_phys_run(addr, len, &ranges[n].host);
+        addr += ranges[n].len;
+        len -= ranges[n].len;
+        n++;
+    }
+    return n;
+}
+
 /* used for ROM loading : can write in RAM and ROM */
 void cpu_physical_memory_write_rom(target_phys_addr_t addr,
                                    const uint8_t *buf, int len)
@@ -33,6 +33,42 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
     }
 }
 
+// Record and replay: when TBs are chained during replay, every TB starts by
+// taking its length out of env->rr_chain_budget.  If that would go negative,
+// the next replay event comes before the end of this TB, so we leave through
+// exit_tb(tb + 2) without executing anything and let cpu_exec() deal with it.
+static TCGArg *rr_chain_arg;
+static int rr_chain_label = -1;
+
+static inline void gen_rr_chain_start(int check)
+{
+    TCGv_i32 budget;
+
+    rr_chain_label = -1;
+    if (!check)
+        return;
+
+    rr_chain_label = gen_new_label();
+    budget = tcg_temp_local_new_i32();
+    tcg_gen_ld_i32(budget, cpu_env, offsetof(CPUState, rr_chain_budget));
+    /* Same trick as gen_icount_start to fill in the length later.  */
+    rr_chain_arg = gen_opparam_ptr + 1;
+    tcg_gen_subi_i32(budget, budget, 0xdeadbeef);
+
+    tcg_gen_brcondi_i32(TCG_COND_LT, budget, 0, rr_chain_label);
+    tcg_gen_st_i32(budget, cpu_env, offsetof(CPUState, rr_chain_budget));
+    tcg_temp_free_i32(budget);
+}
+
+static inline void gen_rr_chain_end(TranslationBlock *tb)
+{
+    if (rr_chain_label >= 0) {
+        *rr_chain_arg = tb->num_guest_insns;
+        gen_set_label(rr_chain_label);
+        tcg_gen_exit_tb((tcg_target_long)tb + 2);
+    }
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
@@ -1326,6 +1326,9 @@ show dynamic compiler info
 show NUMA information
 @item info kvm
 show KVM information
+@item info replay
+show the progress of the current replay: instruction count and speed,
+nondet log entries read, and time spent in each plugin's callbacks
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
@@ -1409,6 +1412,14 @@ ETEXI
         .mhandler.cmd = hmp_begin_replay,
     },
 
+    {
+        .name       = "begin_replay_at",
+        .args_type  = "file_name:s,instr_count:l",
+        .params     = "file_name instr_count",
+        .help       = "begin replay from the nearest checkpoint at or before instr_count",
+        .mhandler.cmd = hmp_begin_replay_at,
+    },
+
 
     {
         .name       = "end_record",
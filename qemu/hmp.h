@@ -42,8 +42,10 @@ void hmp_cpu(Monitor *mon, const QDict *qdict);
 void hmp_begin_record(Monitor *mon, const QDict *qdict);
 void hmp_begin_record_from(Monitor *mon, const QDict *qdict);
 void hmp_begin_replay(Monitor *mon, const QDict *qdict);
+void hmp_begin_replay_at(Monitor *mon, const QDict *qdict);
 void hmp_end_record(Monitor *mon, const QDict *qdict);
 void hmp_end_replay(Monitor *mon, const QDict *qdict);
+void hmp_info_replay(Monitor *mon);
 
 // PANDA plugin interface
 void hmp_panda_load_plugin(Monitor *mon, const QDict *qdict);
@@ -4621,8 +4621,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     void *p;
 
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_USER_BEFORE_SYSCALL]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_list **pcb;
+    PANDA_CB_FOREACH(PANDA_CB_USER_BEFORE_SYSCALL, pcb, plist) {
         plist->entry.user_before_syscall(cpu_env, fcntl_flags_tbl,
                                          num, arg1, arg2, arg3, arg4,
                                          arg5, arg6, arg7, arg8);
@@ -8173,8 +8173,7 @@ fail:
     if(do_strace)
         print_syscall_ret(num, ret);
 
-    for(plist = panda_cbs[PANDA_CB_USER_AFTER_SYSCALL]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_USER_AFTER_SYSCALL, pcb, plist) {
         plist->entry.user_after_syscall(cpu_env, fcntl_flags_tbl,num, arg1,
                                         arg2, arg3, arg4, arg5, arg6, arg7,
                                         arg8, p, ret);
@@ -10,6 +10,7 @@
 #include "qemu-common.h"
 #include "cpu-common.h"
 #include "config.h"
+#include "panda_plugin.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,15 +33,23 @@ static uint64_t
 connection_read_memory (uint64_t user_paddr, void *buf, uint64_t user_len)
 {
     target_phys_addr_t paddr = (target_phys_addr_t) user_paddr;
-    target_phys_addr_t len = (target_phys_addr_t) user_len;
-    void *guestmem = cpu_physical_memory_map(paddr, &len, 0);
-    if (!guestmem){
-        return 0;
+    target_phys_addr_t done = 0;
+    target_phys_addr_t len;
+    const uint8_t *guestmem;
+
+    // Copy straight from guest RAM.  Reads stop at the first MMIO hole
+    // rather than going to the device, which would perturb a replay.
+    while (done < user_len) {
+        len = user_len - done;
+        guestmem = panda_phys_ptr(paddr + done, &len);
+        if (!guestmem){
+            break;
+        }
+        memcpy((uint8_t *)buf + done, guestmem, len);
+        done += len;
     }
-    memcpy(buf, guestmem, len);
-    cpu_physical_memory_unmap(guestmem, len, 0, len);
 
-    return len;
+    return done;
 }
 
 static uint64_t
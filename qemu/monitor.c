@@ -2749,6 +2749,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show KVM information",
         .mhandler.info = hmp_info_kvm,
     },
+    {
+        .name       = "replay",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the current replay",
+        .mhandler.info = hmp_info_replay,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -9,6 +9,15 @@ extern "C" {
 target_ulong panda_current_pc(CPUState *env) {
     target_ulong pc, cs_base;
     int flags;
+    // In a memory callback the guest pc only points at the start of the
+    // TB.  Precise and lazy pc have already stored the pc of the access;
+    // otherwise find it from the host return address now.
+    if (panda_mem_retaddr != NULL) {
+        if (panda_update_pc || panda_lazy_pc) {
+            return env->panda_guest_pc;
+        }
+        return panda_pc_from_host(env, panda_mem_retaddr);
+    }
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
     return pc;
 }
@@ -0,0 +1,242 @@
+#include "panda_plugin.h"
+#include "panda_common.h"
+#include "panda_vmem.h"
+
+#define PANDA_VMEM_CACHE_BITS 10
+#define PANDA_VMEM_CACHE_SIZE (1 << PANDA_VMEM_CACHE_BITS)
+#define PANDA_VMEM_ASID_BITS 8
+#define PANDA_VMEM_ASID_SIZE (1 << PANDA_VMEM_ASID_BITS)
+
+typedef struct panda_vmem_entry {
+    target_ulong asid;
+    target_ulong vpage;
+    target_phys_addr_t ppage;
+    uint64_t epoch;         // panda_vmem_clock when filled, 0 if empty
+} panda_vmem_entry;
+
+struct panda_vmem_reader {
+    panda_vmem_entry cache[PANDA_VMEM_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#ifdef CONFIG_SOFTMMU
+// Every flush takes a new number from panda_vmem_clock.  A translation is
+// good as long as it was made after the last global flush and after the
+// last flush of its ASID.  ASID flush times live in a small hash table;
+// when a slot is taken over by another ASID, the old one's time is kept
+// in 'evicted' and any ASID that isn't in its slot is treated as flushed
+// then.  That is never too late, so the worst case is an extra page walk.
+static uint64_t panda_vmem_clock = 1;
+static uint64_t panda_vmem_global_epoch = 1;
+
+static struct {
+    target_ulong asid;
+    uint64_t epoch;
+    uint64_t evicted;
+} panda_vmem_asids[PANDA_VMEM_ASID_SIZE];
+
+static inline unsigned panda_vmem_asid_slot(target_ulong asid) {
+    return ((asid >> 12) ^ (asid >> (12 + PANDA_VMEM_ASID_BITS)))
+        & (PANDA_VMEM_ASID_SIZE - 1);
+}
+
+static inline uint64_t panda_vmem_asid_epoch(target_ulong asid) {
+    unsigned i = panda_vmem_asid_slot(asid);
+    if (panda_vmem_asids[i].asid == asid) {
+        return panda_vmem_asids[i].epoch;
+    }
+    return panda_vmem_asids[i].evicted;
+}
+
+void panda_vmem_tlb_flush(CPUState *env, int flush_global) {
+#if defined(TARGET_I386)
+    // A non-global flush on x86 only comes from a CR3 write, and the TLB
+    // isn't tagged, so only translations made in the new ASID can have
+    // gone stale while it wasn't loaded.
+    if (!flush_global) {
+        target_ulong asid = panda_current_asid(env);
+        unsigned i = panda_vmem_asid_slot(asid);
+
+        if (panda_vmem_asids[i].asid != asid) {
+            if (panda_vmem_asids[i].epoch > panda_vmem_asids[i].evicted) {
+                panda_vmem_asids[i].evicted = panda_vmem_asids[i].epoch;
+            }
+            panda_vmem_asids[i].asid = asid;
+        }
+        panda_vmem_asids[i].epoch = ++panda_vmem_clock;
+        return;
+    }
+#endif
+    panda_vmem_global_epoch = ++panda_vmem_clock;
+}
+
+void panda_vmem_tlb_flush_page(CPUState *env, target_ulong addr) {
+    // Global pages can be flushed from any ASID, so this has to be global
+    // too.  It's rare enough next to reads that it doesn't matter.
+    panda_vmem_global_epoch = ++panda_vmem_clock;
+}
+
+static target_phys_addr_t panda_vmem_translate(panda_vmem_reader *r,
+                                               CPUState *env,
+                                               target_ulong asid,
+                                               target_ulong vpage) {
+    panda_vmem_entry *e = &r->cache[((vpage >> TARGET_PAGE_BITS) ^ (asid >> 12))
+                                    & (PANDA_VMEM_CACHE_SIZE - 1)];
+    target_phys_addr_t ppage;
+
+    if (e->vpage == vpage && e->asid == asid
+        && e->epoch >= panda_vmem_global_epoch
+        && e->epoch >= panda_vmem_asid_epoch(asid)) {
+        r->hits++;
+        return e->ppage;
+    }
+    r->misses++;
+    ppage = cpu_get_phys_page_debug(env, vpage);
+    if (ppage == -1) {
+        return -1;
+    }
+    e->asid = asid;
+    e->vpage = vpage;
+    e->ppage = ppage;
+    e->epoch = panda_vmem_clock;
+    return ppage;
+}
+#endif
+
+panda_vmem_reader *panda_vmem_reader_new(void) {
+    return g_malloc0(sizeof(panda_vmem_reader));
+}
+
+void panda_vmem_reader_free(panda_vmem_reader *r) {
+    g_free(r);
+}
+
+void panda_vmem_reader_stats(panda_vmem_reader *r, uint64_t *hits,
+                             uint64_t *misses) {
+    *hits = r->hits;
+    *misses = r->misses;
+}
+
+target_phys_addr_t panda_vmem_virt_to_phys(panda_vmem_reader *r, CPUState *env,
+                                           target_ulong addr) {
+#ifdef CONFIG_SOFTMMU
+    target_phys_addr_t ppage;
+    ppage = panda_vmem_translate(r, env, panda_current_asid(env),
+                                 addr & TARGET_PAGE_MASK);
+    if (ppage == -1) {
+        return -1;
+    }
+    return ppage + (addr & ~TARGET_PAGE_MASK);
+#else
+    return addr;
+#endif
+}
+
+int panda_vmem_read(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                    void *buf, int len) {
+#ifdef CONFIG_SOFTMMU
+    target_ulong asid = panda_current_asid(env);
+    uint8_t *p = buf;
+    target_ulong page;
+    target_phys_addr_t phys_addr;
+    int l;
+
+    while (len > 0) {
+        page = addr & TARGET_PAGE_MASK;
+        phys_addr = panda_vmem_translate(r, env, asid, page);
+        if (phys_addr == -1)
+            return -1;
+        l = (page + TARGET_PAGE_SIZE) - addr;
+        if (l > len)
+            l = len;
+        phys_addr += (addr & ~TARGET_PAGE_MASK);
+        if (panda_physical_memory_rw(phys_addr, p, l, 0) < 0)
+            return -1;
+        len -= l;
+        p += l;
+        addr += l;
+    }
+    return 0;
+#else
+    return panda_virtual_memory_rw(env, addr, buf, len, 0);
+#endif
+}
+
+int panda_vmem_read_u32(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                        uint32_t *val) {
+    return panda_vmem_read(r, env, addr, val, sizeof(*val));
+}
+
+int panda_vmem_read_ptr(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                        target_ulong *val) {
+    return panda_vmem_read(r, env, addr, val, sizeof(*val));
+}
+
+int panda_vmem_read_ptr_chain(panda_vmem_reader *r, CPUState *env,
+                              target_ulong addr, const target_long *offsets,
+                              int n, target_ulong *val) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (panda_vmem_read_ptr(r, env, addr + offsets[i], &addr) == -1)
+            return -1;
+    }
+    *val = addr;
+    return 0;
+}
+
+int panda_vmem_read_cstr(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                         char *buf, int maxlen) {
+    int n = 0;
+    int l;
+    char *nul;
+
+    if (maxlen <= 0)
+        return -1;
+    // Read up to the end of each page at a time, so a string that ends
+    // just before an unmapped page can still be read.
+    while (n < maxlen - 1) {
+        l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+        if (l > maxlen - 1 - n)
+            l = maxlen - 1 - n;
+        if (panda_vmem_read(r, env, addr, buf + n, l) == -1) {
+            buf[n] = '\0';
+            return -1;
+        }
+        nul = memchr(buf + n, '\0', l);
+        if (nul)
+            return nul - buf;
+        n += l;
+        addr += l;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+int panda_vmem_read_utf16(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                          int len, char *buf, int maxlen) {
+    uint8_t chunk[256];
+    int n = 0;
+    int l, i;
+
+    if (maxlen <= 0)
+        return -1;
+    len &= ~1;
+    if (len > 2 * (maxlen - 1))
+        len = 2 * (maxlen - 1);
+    while (len > 0) {
+        l = len < (int)sizeof(chunk) ? len : (int)sizeof(chunk);
+        if (panda_vmem_read(r, env, addr, chunk, l) == -1) {
+            buf[n] = '\0';
+            return -1;
+        }
+        for (i = 0; i < l; i += 2) {
+            buf[n++] = chunk[i];
+        }
+        len -= l;
+        addr += l;
+    }
+    buf[n] = '\0';
+    return n;
+}
@@ -0,0 +1,65 @@
+#ifndef __PANDA_VMEM_H_
+#define __PANDA_VMEM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "cpu.h"
+
+/* Cached guest virtual memory reads for introspection code.
+
+   panda_virtual_memory_rw() walks the guest page tables for every page of
+   every call.  A panda_vmem_reader remembers the translations it has done,
+   tagged with the ASID they were done in, so pointer chasing through
+   kernel structures mostly costs a lookup per read.  Cached translations
+   are dropped when the guest would drop them from its own TLB: when the
+   ASID is loaded again (CR3 write), and on any global or single page TLB
+   flush.  Failed translations are never cached.
+
+   Each plugin should make its own reader.  All functions return -1 if
+   some part of the range isn't mapped, like panda_virtual_memory_rw(). */
+
+typedef struct panda_vmem_reader panda_vmem_reader;
+
+panda_vmem_reader *panda_vmem_reader_new(void);
+void panda_vmem_reader_free(panda_vmem_reader *r);
+
+// Read len bytes at guest virtual address addr in the current ASID
+int panda_vmem_read(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                    void *buf, int len);
+target_phys_addr_t panda_vmem_virt_to_phys(panda_vmem_reader *r, CPUState *env,
+                                           target_ulong addr);
+
+int panda_vmem_read_u32(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                        uint32_t *val);
+// Read a guest pointer (sizeof(target_ulong) bytes)
+int panda_vmem_read_ptr(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                        target_ulong *val);
+// Pointer chasing: for each offset, addr = *(addr + offsets[i]).  The final
+// value is stored in *val.  Stops with -1 at the first bad read.
+int panda_vmem_read_ptr_chain(panda_vmem_reader *r, CPUState *env,
+                              target_ulong addr, const target_long *offsets,
+                              int n, target_ulong *val);
+// Read a NUL terminated string of at most maxlen-1 characters.  buf is
+// always terminated; returns the string length.
+int panda_vmem_read_cstr(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                         char *buf, int maxlen);
+// Read len bytes of UTF-16LE text and store the low byte of each character
+// in buf, truncated to maxlen-1 characters and terminated.  Returns the
+// number of characters stored.
+int panda_vmem_read_utf16(panda_vmem_reader *r, CPUState *env, target_ulong addr,
+                          int len, char *buf, int maxlen);
+
+void panda_vmem_reader_stats(panda_vmem_reader *r, uint64_t *hits,
+                             uint64_t *misses);
+
+// Called by tlb_flush() and tlb_flush_page()
+void panda_vmem_tlb_flush(CPUState *env, int flush_global);
+void panda_vmem_tlb_flush_page(CPUState *env, target_ulong addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
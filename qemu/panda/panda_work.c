@@ -0,0 +1,246 @@
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "panda_work.h"
+
+// The ring is indexed by sequence number: records [retire, tail) are in
+// use, [head, tail) are waiting for a worker.  Only the vCPU thread moves
+// tail and retire; workers claim records by moving head with a CAS, so
+// neither side takes a lock on the fast path.  The lock and conditions are
+// only used to sleep: workers when there is nothing to do, the vCPU thread
+// when the ring is full or it is draining.  Each side publishes that it is
+// about to sleep, then checks again, and the other side checks for
+// sleepers after publishing its own progress, with a full barrier in
+// between on both sides, so no wakeup is lost.
+
+enum {
+    PANDA_WORK_FREE,
+    PANDA_WORK_POSTED,
+    PANDA_WORK_DONE,
+};
+
+typedef struct panda_work_worker {
+    panda_work_queue *q;
+    unsigned idx;
+    QemuThread thread;
+} panda_work_worker;
+
+struct panda_work_queue {
+    char *name;
+    size_t rec_size;
+    unsigned long mask;             // capacity - 1
+    unsigned nthreads;
+    panda_work_fn work;
+    panda_work_done_fn done;
+    void *opaque;
+    uint8_t *recs;
+    volatile int *state;
+    volatile unsigned long tail;    // next record to post
+    volatile unsigned long head;    // next record for a worker
+    unsigned long retire;           // next record to run done() on
+    QemuMutex lock;
+    QemuCond work_ready;
+    QemuCond work_done;
+    volatile int sleepers;
+    volatile int producer_waiting;
+    bool quit;
+    unsigned running;
+    panda_work_worker *workers;
+    panda_work_queue *next;
+    // stats
+    unsigned long long posted;
+    unsigned long long stalls;
+};
+
+panda_work_queue *panda_work_queues = NULL;
+
+static inline void *panda_work_rec(panda_work_queue *q, unsigned long seq) {
+    return q->recs + (seq & q->mask) * q->rec_size;
+}
+
+static void *panda_work_thread(void *opaque) {
+    panda_work_worker *w = (panda_work_worker *) opaque;
+    panda_work_queue *q = w->q;
+    unsigned long h;
+
+    while (true) {
+        h = q->head;
+        if (h != q->tail) {
+            // the CAS is a full barrier, so the record is visible
+            if (!__sync_bool_compare_and_swap(&q->head, h, h + 1)) {
+                continue;
+            }
+            q->work(panda_work_rec(q, h), q->opaque, w->idx);
+            __sync_synchronize();
+            q->state[h & q->mask] = PANDA_WORK_DONE;
+            __sync_synchronize();
+            if (q->producer_waiting) {
+                qemu_mutex_lock(&q->lock);
+                qemu_cond_signal(&q->work_done);
+                qemu_mutex_unlock(&q->lock);
+            }
+            continue;
+        }
+        qemu_mutex_lock(&q->lock);
+        q->sleepers++;
+        __sync_synchronize();
+        while (q->head == q->tail && !q->quit) {
+            qemu_cond_wait(&q->work_ready, &q->lock);
+        }
+        q->sleepers--;
+        if (q->head == q->tail && q->quit) {
+            q->running--;
+            qemu_cond_broadcast(&q->work_done);
+            qemu_mutex_unlock(&q->lock);
+            break;
+        }
+        qemu_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+panda_work_queue *panda_work_queue_new(const char *name, size_t rec_size,
+                                       unsigned capacity, unsigned nthreads,
+                                       panda_work_fn work,
+                                       panda_work_done_fn done, void *opaque) {
+    panda_work_queue *q = g_new0(panda_work_queue, 1);
+    unsigned long cap = 1;
+    unsigned i;
+
+    while (cap < capacity) cap <<= 1;
+    q->name = g_strdup(name);
+    q->rec_size = rec_size;
+    q->mask = cap - 1;
+    q->nthreads = nthreads;
+    q->work = work;
+    q->done = done;
+    q->opaque = opaque;
+    q->recs = g_malloc0(cap * rec_size);
+    q->state = g_new0(int, cap);
+    qemu_mutex_init(&q->lock);
+    qemu_cond_init(&q->work_ready);
+    qemu_cond_init(&q->work_done);
+    q->running = nthreads;
+    q->workers = g_new0(panda_work_worker, nthreads > 0 ? nthreads : 1);
+    for (i = 0; i < nthreads; i++) {
+        q->workers[i].q = q;
+        q->workers[i].idx = i;
+        qemu_thread_create(&q->workers[i].thread, panda_work_thread,
+                           &q->workers[i]);
+    }
+    q->next = panda_work_queues;
+    panda_work_queues = q;
+    return q;
+}
+
+// Sleep until the oldest record in the ring is done
+static void panda_work_wait(panda_work_queue *q) {
+    volatile int *state = &q->state[q->retire & q->mask];
+
+    qemu_mutex_lock(&q->lock);
+    q->producer_waiting = 1;
+    __sync_synchronize();
+    while (*state != PANDA_WORK_DONE) {
+        qemu_cond_wait(&q->work_done, &q->lock);
+    }
+    q->producer_waiting = 0;
+    qemu_mutex_unlock(&q->lock);
+}
+
+void panda_work_poll(panda_work_queue *q) {
+    unsigned long slot;
+
+    while (q->retire != q->tail) {
+        slot = q->retire & q->mask;
+        if (q->state[slot] != PANDA_WORK_DONE) {
+            break;
+        }
+        __sync_synchronize();
+        if (q->done) {
+            q->done(panda_work_rec(q, q->retire), q->opaque);
+        }
+        q->state[slot] = PANDA_WORK_FREE;
+        q->retire++;
+    }
+}
+
+void panda_work_post(panda_work_queue *q, const void *rec) {
+    unsigned long slot;
+
+    q->posted++;
+    if (q->nthreads == 0) {
+        memcpy(q->recs, rec, q->rec_size);
+        q->work(q->recs, q->opaque, 0);
+        if (q->done) {
+            q->done(q->recs, q->opaque);
+        }
+        return;
+    }
+    while (q->tail - q->retire > q->mask) {
+        panda_work_poll(q);
+        if (q->tail - q->retire > q->mask) {
+            q->stalls++;
+            panda_work_wait(q);
+        }
+    }
+    slot = q->tail & q->mask;
+    memcpy(panda_work_rec(q, q->tail), rec, q->rec_size);
+    q->state[slot] = PANDA_WORK_POSTED;
+    __sync_synchronize();
+    q->tail++;
+    __sync_synchronize();
+    if (q->sleepers) {
+        qemu_mutex_lock(&q->lock);
+        qemu_cond_signal(&q->work_ready);
+        qemu_mutex_unlock(&q->lock);
+    }
+}
+
+void panda_work_drain(panda_work_queue *q) {
+    while (q->retire != q->tail) {
+        panda_work_poll(q);
+        if (q->retire != q->tail) {
+            panda_work_wait(q);
+        }
+    }
+}
+
+void panda_work_poll_all(void) {
+    panda_work_queue *q;
+
+    for (q = panda_work_queues; q != NULL; q = q->next) {
+        if (q->retire != q->tail) {
+            panda_work_poll(q);
+        }
+    }
+}
+
+void panda_work_print_stats(panda_work_queue *q) {
+    printf("panda_work %s: %llu records, %u threads, %llu stalls\n",
+           q->name, q->posted, q->nthreads, q->stalls);
+}
+
+void panda_work_queue_free(panda_work_queue *q) {
+    panda_work_queue **pq;
+
+    if (q == NULL) return;
+    panda_work_drain(q);
+    qemu_mutex_lock(&q->lock);
+    q->quit = true;
+    qemu_cond_broadcast(&q->work_ready);
+    while (q->running > 0) {
+        qemu_cond_wait(&q->work_done, &q->lock);
+    }
+    qemu_mutex_unlock(&q->lock);
+
+    for (pq = &panda_work_queues; *pq != NULL; pq = &(*pq)->next) {
+        if (*pq == q) {
+            *pq = q->next;
+            break;
+        }
+    }
+    g_free(q->workers);
+    g_free((void *) q->state);
+    g_free(q->recs);
+    g_free(q->name);
+    g_free(q);
+}
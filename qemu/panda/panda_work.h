@@ -0,0 +1,60 @@
+#ifndef __PANDA_WORK_H_
+#define __PANDA_WORK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Work queues for moving expensive analysis off the vCPU thread.
+
+   A plugin makes a queue with a fixed record size and a number of worker
+   threads, then posts records to it from its callbacks.  post() copies the
+   record into a ring slot and returns; a worker runs work() on it, and then
+   done() is called on the vCPU thread, in the order the records were
+   posted.  Anything that has to be ordered with respect to the replay
+   (printing results, pandalog_write_entry_at, updating plugin state)
+   belongs in done().  work() should only look at its record and at data
+   that doesn't change while the queue is running; 'worker' is the index of
+   the thread running it (0 .. nthreads-1), for per-thread scratch space.
+
+   Records are posted by the vCPU thread only, and done() callbacks are run
+   from cpu_exec() between blocks, from post() when the ring is full, and
+   from panda_work_drain().  Free the queue in uninit_plugin; that runs any
+   work still queued.
+
+   With nthreads == 0 no threads are started and post() does the work
+   right away, which is handy for checking that results don't change. */
+
+typedef struct panda_work_queue panda_work_queue;
+
+typedef void (*panda_work_fn)(void *rec, void *opaque, unsigned worker);
+typedef void (*panda_work_done_fn)(void *rec, void *opaque);
+
+panda_work_queue *panda_work_queue_new(const char *name, size_t rec_size,
+                                       unsigned capacity, unsigned nthreads,
+                                       panda_work_fn work,
+                                       panda_work_done_fn done, void *opaque);
+void panda_work_queue_free(panda_work_queue *q);
+// How many records were posted and how often post() had to wait for a
+// free slot, for plugins that want to report it
+void panda_work_print_stats(panda_work_queue *q);
+
+void panda_work_post(panda_work_queue *q, const void *rec);
+// Run done() for every record that has finished, in order
+void panda_work_poll(panda_work_queue *q);
+// Wait for everything posted so far and run its done()
+void panda_work_drain(panda_work_queue *q);
+
+// Called by cpu_exec() between blocks
+void panda_work_poll_all(void);
+extern panda_work_queue *panda_work_queues;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
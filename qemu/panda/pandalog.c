@@ -54,13 +54,17 @@ void pandalog_write_entry(Panda__LogEntry *entry) {
     // NOTE: any other fields will already have been filled in 
     // by the plugin that made this call.  
     if (panda_in_main_loop) {
-        entry->pc = panda_current_pc(cpu_single_env);
-        entry->instr = rr_get_guest_instr_count ();
+        pandalog_write_entry_at(entry, panda_current_pc(cpu_single_env),
+                                rr_get_guest_instr_count());
     }
     else {        
-        entry->pc = -1;
-        entry->instr = -1;
+        pandalog_write_entry_at(entry, -1, -1);
     }
+}
+
+void pandalog_write_entry_at(Panda__LogEntry *entry, uint64_t pc, uint64_t instr) {
+    entry->pc = pc;
+    entry->instr = instr;
     size_t n = panda__log_entry__get_packed_size(entry);   
     resize_pandalog(n);
     panda__log_entry__pack(entry, pandalog_buf);
@@ -15,6 +15,10 @@ int  pandalog_close(void);
 // b/c those will get added by this fn
 void pandalog_write_entry(Panda__LogEntry *entry);
 
+// same, but with the pc and instruction count of an earlier point, e.g.
+// for results that come back from a panda_work queue
+void pandalog_write_entry_at(Panda__LogEntry *entry, uint64_t pc, uint64_t instr);
+
 // read this element from pandalog.
 // allocates memory, which caller will free
 Panda__LogEntry *pandalog_read_entry(void);
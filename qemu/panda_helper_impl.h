@@ -11,12 +11,22 @@
  * See the COPYING file in the top-level directory. 
  * 
 PANDAENDCOMMENT */
+#include "rr_stats.h"
+
 void helper_panda_insn_exec(target_ulong pc) {
     // PANDA instrumentation: before basic block 
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.insn_exec(env, pc);
+    panda_cb_list **pcb;
+    RR_phase old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_INSN_EXEC, pcb, plist) {
+        RR_STATS_CB(plist, plist->entry.insn_exec(env, pc));
     }
+    rr_stats_enter(old_phase);
+}
+
+void helper_panda_inline_call(void *fn, void *opaque, target_ulong pc) {
+    // PANDA instrumentation: panda_inline_call_if
+    ((panda_inline_fn) fn)(env, pc, opaque);
 }
 
 
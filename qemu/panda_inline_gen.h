@@ -0,0 +1,76 @@
+/* PANDA inline instrumentation: generate the ops that insn_translate
+   callbacks asked for with panda_inline_*() in front of the instruction at
+   pc.  Included by target translate.c files after helper.h, since it uses
+   cpu_env and the gen_helper wrappers. */
+
+static void panda_gen_inline(target_ulong pc)
+{
+    int i;
+
+    panda_inline_used = true;
+    for (i = 0; i < panda_inline_nops; i++) {
+        panda_inline_op *op = &panda_inline_ops[i];
+        TCGv_ptr base = tcg_const_ptr((tcg_target_long)op->ptr);
+
+        switch (op->kind) {
+        case PANDA_INLINE_COUNT: {
+            TCGv_i64 t = tcg_temp_new_i64();
+            tcg_gen_ld_i64(t, base, 0);
+            tcg_gen_addi_i64(t, t, 1);
+            tcg_gen_st_i64(t, base, 0);
+            tcg_temp_free_i64(t);
+            break;
+        }
+        case PANDA_INLINE_STORE: {
+            TCGv_i32 t = tcg_const_i32(op->val);
+            tcg_gen_st_i32(t, base, 0);
+            tcg_temp_free_i32(t);
+            break;
+        }
+        case PANDA_INLINE_RING: {
+            // buf[idx & mask] = {pc, env field}; idx++
+            panda_inline_ring *ring = (panda_inline_ring *)op->ptr;
+            TCGv_i32 idx = tcg_temp_new_i32();
+            TCGv_i32 off = tcg_temp_new_i32();
+            TCGv_ptr ent = tcg_temp_new_ptr();
+            TCGv t = tcg_temp_new();
+            tcg_gen_ld_i32(idx, base, offsetof(panda_inline_ring, idx));
+            tcg_gen_andi_i32(off, idx, ring->mask);
+            tcg_gen_muli_i32(off, off, sizeof(panda_inline_ring_entry));
+            tcg_gen_ext_i32_ptr(ent, off);
+            tcg_gen_addi_ptr(ent, ent, (tcg_target_long)ring->buf);
+            tcg_gen_movi_tl(t, pc);
+            tcg_gen_st_tl(t, ent, offsetof(panda_inline_ring_entry, pc));
+            tcg_gen_ld_tl(t, cpu_env, op->env_offset);
+            tcg_gen_st_tl(t, ent, offsetof(panda_inline_ring_entry, val));
+            tcg_gen_addi_i32(idx, idx, 1);
+            tcg_gen_st_i32(idx, base, offsetof(panda_inline_ring, idx));
+            tcg_temp_free(t);
+            tcg_temp_free_ptr(ent);
+            tcg_temp_free_i32(off);
+            tcg_temp_free_i32(idx);
+            break;
+        }
+        case PANDA_INLINE_CALL_IF: {
+            int skip = gen_new_label();
+            TCGv_i32 t = tcg_temp_new_i32();
+            TCGv_ptr fn, opaque;
+            TCGv tpc;
+            tcg_gen_ld_i32(t, base, 0);
+            tcg_gen_brcondi_i32(TCG_COND_EQ, t, 0, skip);
+            tcg_temp_free_i32(t);
+            fn = tcg_const_ptr((tcg_target_long)op->fn);
+            opaque = tcg_const_ptr((tcg_target_long)op->opaque);
+            tpc = tcg_const_tl(pc);
+            gen_helper_panda_inline_call(fn, opaque, tpc);
+            tcg_temp_free(tpc);
+            tcg_temp_free_ptr(opaque);
+            tcg_temp_free_ptr(fn);
+            gen_set_label(skip);
+            break;
+        }
+        }
+        tcg_temp_free_ptr(base);
+    }
+    panda_inline_nops = 0;
+}
@@ -18,6 +18,9 @@ PANDAENDCOMMENT */
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "error.h"
+#include "rr_stats.h"
+#include "rr_log.h"
+#include "panda/panda_common.h"
 
 #include <libgen.h>
 
@@ -35,6 +38,10 @@ PANDAENDCOMMENT */
 
 // Array of pointers to PANDA callback lists, one per callback type
 panda_cb_list *panda_cbs[PANDA_CB_LAST];
+// Flat copies of the lists above, holding only enabled callbacks
+panda_cb_list **panda_cb_tab[PANDA_CB_LAST];
+// Replaced tables that may still be walked further up the stack
+static GSList *panda_cb_tab_retired = NULL;
 
 // Storage for command line options
 char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
@@ -52,7 +59,10 @@ char *panda_plugins_loaded[MAX_PANDA_PLUGINS];
 
 bool panda_please_flush_tb = false;
 bool panda_update_pc = false;
+bool panda_lazy_pc = false;
 bool panda_use_memcb = false;
+bool panda_use_memwatch = false;
+bool panda_please_flush_tlb = false;
 bool panda_tb_chaining = true;
 
 
@@ -150,6 +160,11 @@ void panda_do_unload_plugin(int plugin_idx){
     panda_unregister_callbacks(plugin);
     panda_delete_plugin(plugin_idx);
     dlclose(plugin);
+    // Inline ops may point into the plugin
+    if (panda_inline_used) {
+        panda_inline_used = false;
+        panda_do_flush_tb();
+    }
 }
 
 void panda_unload_plugin(void* plugin) {
@@ -187,23 +202,136 @@ void * panda_get_plugin_by_name(const char *plugin_name) {
     return NULL;
 }
 
+// Rebuild panda_cb_tab[type] from panda_cbs[type].  A callback may register
+// or disable callbacks while its own table is being walked, so the old table
+// is kept until panda_cb_tab_reclaim() runs from the cpu loop.
+static void panda_cb_tab_rebuild(int type) {
+    panda_cb_list *plist;
+    panda_cb_list **tab = NULL;
+    int n = 0;
+
+    for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->enabled) n++;
+    }
+    if (n > 0) {
+        tab = g_new(panda_cb_list *, n + 1);
+        n = 0;
+        for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (plist->enabled) tab[n++] = plist;
+        }
+        tab[n] = NULL;
+    }
+    if (panda_cb_tab[type] != NULL) {
+        panda_cb_tab_retired = g_slist_prepend(panda_cb_tab_retired,
+                                               panda_cb_tab[type]);
+    }
+    panda_cb_tab[type] = tab;
+}
+
+void panda_cb_tab_reclaim(void) {
+    GSList *l;
+    if (panda_cb_tab_retired == NULL) return;
+    for (l = panda_cb_tab_retired; l != NULL; l = l->next) {
+        g_free(l->data);
+    }
+    g_slist_free(panda_cb_tab_retired);
+    panda_cb_tab_retired = NULL;
+}
+
+// Plugins with a PANDA_CB_BLOCK_FILTER, by their bit in
+// TranslationBlock.panda_filter_mask
+#define PANDA_MAX_TB_FILTERS 32
+static void *panda_tb_filter_owners[PANDA_MAX_TB_FILTERS];
+
+static uint32_t panda_tb_filter_bit(void *plugin) {
+    int i;
+    for (i = 0; i < PANDA_MAX_TB_FILTERS; i++) {
+        if (panda_tb_filter_owners[i] == plugin) return 1u << i;
+    }
+    return 0;
+}
+
+// Give plugin a filter bit and tag all its callbacks with it.  TBs already
+// translated don't have the bit, so they have to go.
+static void panda_add_tb_filter(void *plugin) {
+    int i, type;
+    for (i = 0; i < PANDA_MAX_TB_FILTERS; i++) {
+        if (panda_tb_filter_owners[i] == NULL) break;
+    }
+    if (i == PANDA_MAX_TB_FILTERS) {
+        fprintf(stderr, "PANDA: too many block filters, every block will be "
+                "instrumented\n");
+        return;
+    }
+    panda_tb_filter_owners[i] = plugin;
+    for (type = 0; type < PANDA_CB_LAST; type++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (plist->owner == plugin) plist->tb_filter = 1u << i;
+        }
+    }
+    panda_do_flush_tb();
+}
+
+// The bit may be reused, so TBs carrying it have to go too
+static void panda_remove_tb_filter(void *plugin) {
+    int i;
+    for (i = 0; i < PANDA_MAX_TB_FILTERS; i++) {
+        if (panda_tb_filter_owners[i] == plugin) {
+            panda_tb_filter_owners[i] = NULL;
+            panda_do_flush_tb();
+        }
+    }
+}
+
+uint32_t panda_tb_filter_mask(CPUState *env, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    panda_cb_list **pcb;
+    uint32_t mask = 0;
+    RR_phase old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_BLOCK_FILTER, pcb, plist) {
+        bool want;
+        RR_STATS_CB(plist, want = plist->entry.block_filter(env, tb));
+        if (want) mask |= plist->tb_filter;
+    }
+    rr_stats_enter(old_phase);
+    return mask;
+}
+
 void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     panda_cb_list *new_list = g_new0(panda_cb_list,1);
+    if (type == PANDA_CB_BLOCK_FILTER && !panda_tb_filter_bit(plugin)) {
+        panda_add_tb_filter(plugin);
+    }
     new_list->entry = cb;
     new_list->owner = plugin;
     new_list->prev = NULL;
     new_list->next = NULL;
     new_list->enabled = true;
+    new_list->tb_filter = panda_tb_filter_bit(plugin);
     if(panda_cbs[type] != NULL) {
         new_list->next = panda_cbs[type];
         panda_cbs[type]->prev = new_list;
     }
     panda_cbs[type] = new_list;
+    panda_cb_tab_rebuild(type);
 }
 
+#ifdef CONFIG_SOFTMMU
+static void panda_unregister_mem_watches(void *plugin);
+static void panda_enable_mem_watches(void *plugin, bool enabled);
+static void panda_mem_watch_cost(void *plugin, uint64_t *ticks,
+                                 uint64_t *calls);
+static void panda_reset_mem_watch_cost(void);
+#endif
+
 void panda_unregister_callbacks(void *plugin) {
     // Remove callbacks
     int i;
+#ifdef CONFIG_SOFTMMU
+    panda_unregister_mem_watches(plugin);
+#endif
+    panda_remove_tb_filter(plugin);
     for (i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
         plist = panda_cbs[i];
@@ -213,12 +341,10 @@ void panda_unregister_callbacks(void *plugin) {
                 // Unlink
                 if (plist->prev)
                     plist->prev->next = plist->next;
+                else
+                    panda_cbs[i] = plist->next;
                 if (plist->next)
                     plist->next->prev = plist->prev;
-                if (!plist->prev && !plist->next){
-                    // List is now empty
-                    panda_cbs[i] = NULL;
-                }
                 // Advance the pointer
                 plist = plist->next;
                 // Free the entry we just unlinked
@@ -228,11 +354,19 @@ void panda_unregister_callbacks(void *plugin) {
                 plist = plist->next;
             }
         }
+        panda_cb_tab_rebuild(i);
     }
 }
 
 void panda_enable_plugin(void *plugin) {
     int i;
+#ifdef CONFIG_SOFTMMU
+    panda_enable_mem_watches(plugin, true);
+#endif
+    // TBs translated while the plugin's filter was off don't have its bit
+    if (panda_tb_filter_bit(plugin)) {
+        panda_do_flush_tb();
+    }
     for (i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
         plist = panda_cbs[i];
@@ -242,11 +376,15 @@ void panda_enable_plugin(void *plugin) {
             }
             plist = plist->next;
         }
+        panda_cb_tab_rebuild(i);
     }
 }
 
 void panda_disable_plugin(void *plugin) {
     int i;
+#ifdef CONFIG_SOFTMMU
+    panda_enable_mem_watches(plugin, false);
+#endif
     for (i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
         plist = panda_cbs[i];
@@ -256,6 +394,45 @@ void panda_disable_plugin(void *plugin) {
             }
             plist = plist->next;
         }
+        panda_cb_tab_rebuild(i);
+    }
+}
+
+// Sum of the time and calls charged to the callbacks of plugin number idx,
+// over all types.  Returns its name, or NULL if there's no such plugin.
+const char *panda_plugin_cb_cost(int idx, uint64_t *ticks, uint64_t *calls) {
+    int i;
+    if (idx < 0 || idx >= nb_panda_plugins) {
+        return NULL;
+    }
+    *ticks = 0;
+    *calls = 0;
+#ifdef CONFIG_SOFTMMU
+    panda_mem_watch_cost(panda_plugins[idx].plugin, ticks, calls);
+#endif
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            if (plist->owner == panda_plugins[idx].plugin) {
+                *ticks += plist->ticks;
+                *calls += plist->calls;
+            }
+        }
+    }
+    return panda_plugins[idx].name;
+}
+
+void panda_reset_cb_cost(void) {
+    int i;
+#ifdef CONFIG_SOFTMMU
+    panda_reset_mem_watch_cost();
+#endif
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            plist->ticks = 0;
+            plist->calls = 0;
+        }
     }
 }
 
@@ -273,6 +450,50 @@ panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
     }
 }
 
+static const char *panda_cb_type_names[PANDA_CB_LAST] = {
+    [PANDA_CB_BEFORE_BLOCK_TRANSLATE] = "before_block_translate",
+    [PANDA_CB_AFTER_BLOCK_TRANSLATE] = "after_block_translate",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] = "before_block_exec_invalidate_opt",
+    [PANDA_CB_BEFORE_BLOCK_EXEC] = "before_block_exec",
+    [PANDA_CB_AFTER_BLOCK_EXEC] = "after_block_exec",
+    [PANDA_CB_INSN_TRANSLATE] = "insn_translate",
+    [PANDA_CB_INSN_EXEC] = "insn_exec",
+    [PANDA_CB_VIRT_MEM_READ] = "virt_mem_read",
+    [PANDA_CB_VIRT_MEM_WRITE] = "virt_mem_write",
+    [PANDA_CB_PHYS_MEM_READ] = "phys_mem_read",
+    [PANDA_CB_PHYS_MEM_WRITE] = "phys_mem_write",
+    [PANDA_CB_HD_READ] = "hd_read",
+    [PANDA_CB_HD_WRITE] = "hd_write",
+    [PANDA_CB_GUEST_HYPERCALL] = "guest_hypercall",
+    [PANDA_CB_MONITOR] = "monitor",
+    [PANDA_CB_CPU_RESTORE_STATE] = "cpu_restore_state",
+    [PANDA_CB_BEFORE_REPLAY_LOADVM] = "before_replay_loadvm",
+#ifndef CONFIG_SOFTMMU
+    [PANDA_CB_USER_BEFORE_SYSCALL] = "user_before_syscall",
+    [PANDA_CB_USER_AFTER_SYSCALL] = "user_after_syscall",
+#endif
+#ifdef CONFIG_PANDA_VMI
+    [PANDA_CB_VMI_AFTER_FORK] = "vmi_after_fork",
+    [PANDA_CB_VMI_AFTER_EXEC] = "vmi_after_exec",
+    [PANDA_CB_VMI_AFTER_CLONE] = "vmi_after_clone",
+#endif
+    [PANDA_CB_VMI_PGD_CHANGED] = "vmi_pgd_changed",
+    [PANDA_CB_REPLAY_HD_TRANSFER] = "replay_hd_transfer",
+    [PANDA_CB_REPLAY_NET_TRANSFER] = "replay_net_transfer",
+    [PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM] = "replay_before_cpu_physical_mem_rw_ram",
+    [PANDA_CB_REPLAY_HANDLE_PACKET] = "replay_handle_packet",
+    [PANDA_CB_MEM_BATCH] = "mem_batch",
+    [PANDA_CB_BLOCK_FILTER] = "block_filter",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_LLVM] = "before_block_exec_llvm",
+};
+
+const char *panda_cb_type_name(panda_cb_type type) {
+    if (type < 0 || type >= PANDA_CB_LAST || !panda_cb_type_names[type]) {
+        return "unknown";
+    }
+    return panda_cb_type_names[type];
+}
+
 bool panda_flush_tb(void) {
     if(panda_please_flush_tb) {
         panda_please_flush_tb = false;
@@ -293,6 +514,278 @@ void panda_disable_precise_pc(void) {
     panda_update_pc = false;
 }
 
+// Lazy precise pc: instead of storing the guest pc before every
+// instruction, the instrumented memory helpers work out the pc of the
+// access from their return address into the translated code, the same way
+// cpu_restore_state() does, and put it in env->panda_guest_pc before the
+// memory callbacks run.  Answers are cached per call site until the next
+// tb_flush, which is the only time translated code is thrown away.
+// Code run by the LLVM JIT can't be searched, so with LLVM the pc is still
+// stored eagerly.
+#define PANDA_PC_CACHE_BITS 12
+#define PANDA_PC_CACHE_SIZE (1 << PANDA_PC_CACHE_BITS)
+
+typedef struct panda_pc_cache_entry {
+    unsigned long host_pc;
+    target_ulong guest_pc;
+} panda_pc_cache_entry;
+
+static panda_pc_cache_entry panda_pc_cache[PANDA_PC_CACHE_SIZE];
+
+void panda_enable_lazy_pc(void) {
+    panda_lazy_pc = true;
+#ifdef CONFIG_LLVM
+    if (generate_llvm) {
+        panda_enable_precise_pc();
+    }
+#endif
+    // Whether the pc is stored during replay depends on this
+    panda_do_flush_tb();
+}
+
+void panda_disable_lazy_pc(void) {
+    panda_lazy_pc = false;
+    panda_do_flush_tb();
+}
+
+target_ulong panda_pc_from_host(CPUState *env, void *retaddr) {
+    unsigned long host_pc = (unsigned long)retaddr;
+    panda_pc_cache_entry *e = &panda_pc_cache[
+        (host_pc ^ (host_pc >> PANDA_PC_CACHE_BITS)) & (PANDA_PC_CACHE_SIZE - 1)];
+    TranslationBlock *tb;
+    target_ulong pc;
+
+    if (e->host_pc == host_pc) {
+        return e->guest_pc;
+    }
+    tb = tb_find_pc(host_pc);
+    if (tb == NULL) {
+        return env->panda_guest_pc;
+    }
+    pc = cpu_get_guest_pc(tb, env, host_pc);
+    if (pc == (target_ulong)-1) {
+        return env->panda_guest_pc;
+    }
+    e->host_pc = host_pc;
+    e->guest_pc = pc;
+    return pc;
+}
+
+void panda_pc_cache_flush(void) {
+    memset(panda_pc_cache, 0, sizeof(panda_pc_cache));
+}
+
+// Return address of the memory access whose callbacks are running, NULL
+// outside them.  panda_current_pc() works out the pc from it when asked, so
+// plugins that only need the pc now and then needn't pay for it on every
+// access.
+void *panda_mem_retaddr = NULL;
+
+// Restarting an instruction from a memory callback.  Reading RAM changes
+// nothing, and a write callback runs before the store, so the instruction
+// can be abandoned just as for a page fault: put the guest state back to
+// the start of the instruction and go back to the cpu loop, which runs it
+// again.  The instrumented memory helpers check panda_restart_pending after
+// the callbacks, while they still know their return address.
+bool panda_restart_pending = false;
+
+void panda_restart_insn(CPUState *env) {
+    panda_restart_pending = true;
+}
+
+void panda_do_restart_insn(CPUState *env, void *retaddr) {
+    unsigned long host_pc = (unsigned long)retaddr;
+    TranslationBlock *tb;
+
+    panda_restart_pending = false;
+    // Accesses from helpers aren't in translated code, but helpers that
+    // can fault sync the guest state before they're called (cf. tlb_fill)
+    tb = tb_find_pc(host_pc);
+    if (tb) {
+        cpu_restore_state(tb, env, host_pc);
+    }
+#ifdef CONFIG_SOFTMMU
+    // the instruction was counted when it started, and will be again
+    if (rr_mode != RR_OFF) {
+        env->rr_guest_instr_count--;
+    }
+#endif
+    env->exception_index = -1;
+    cpu_loop_exit(env);
+}
+
+bool panda_block_exec_llvm(CPUState *env, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    panda_cb_list **pcb;
+    bool llvm = false;
+
+    if (!panda_cb_tab[PANDA_CB_BEFORE_BLOCK_EXEC_LLVM]) {
+        return true;
+    }
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_BLOCK_EXEC_LLVM, pcb, plist) {
+        RR_STATS_CB(plist, llvm |= plist->entry.before_block_exec_llvm(env, tb));
+    }
+    return llvm;
+}
+
+// Inline instrumentation requested by insn_translate callbacks for the
+// instruction being translated; panda_gen_inline() turns them into TCG ops
+// and empties the list.
+panda_inline_op panda_inline_ops[PANDA_INLINE_MAX];
+int panda_inline_nops = 0;
+bool panda_inline_used = false;
+
+static panda_inline_op *panda_inline_add(panda_inline_kind kind) {
+    panda_inline_op *op;
+    if (panda_inline_nops == PANDA_INLINE_MAX) {
+        fprintf(stderr, "PANDA: more than %d inline ops for one instruction, "
+                "dropping\n", PANDA_INLINE_MAX);
+        return NULL;
+    }
+    op = &panda_inline_ops[panda_inline_nops++];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    return op;
+}
+
+void panda_inline_count(uint64_t *counter) {
+    panda_inline_op *op = panda_inline_add(PANDA_INLINE_COUNT);
+    if (op) {
+        op->ptr = counter;
+    }
+}
+
+void panda_inline_store(uint32_t *ptr, uint32_t val) {
+    panda_inline_op *op = panda_inline_add(PANDA_INLINE_STORE);
+    if (op) {
+        op->ptr = ptr;
+        op->val = val;
+    }
+}
+
+void panda_inline_ring_record(panda_inline_ring *ring, size_t env_offset) {
+    panda_inline_op *op = panda_inline_add(PANDA_INLINE_RING);
+    if (op) {
+        op->ptr = ring;
+        op->env_offset = env_offset;
+    }
+}
+
+void panda_inline_call_if(uint32_t *cond, panda_inline_fn fn, void *opaque) {
+    panda_inline_op *op = panda_inline_add(PANDA_INLINE_CALL_IF);
+    if (op) {
+        op->ptr = cond;
+        op->fn = fn;
+        op->opaque = opaque;
+    }
+}
+
+panda_inline_ring *panda_inline_ring_new(unsigned size) {
+    panda_inline_ring *ring = g_new0(panda_inline_ring, 1);
+    unsigned n = 1;
+    while (n < size) n <<= 1;
+    ring->buf = g_new0(panda_inline_ring_entry, n);
+    ring->mask = n - 1;
+    return ring;
+}
+
+void panda_inline_ring_free(panda_inline_ring *ring) {
+    if (ring == NULL) return;
+    g_free(ring->buf);
+    g_free(ring);
+}
+
+// What the insn_translate callbacks asked for in each TB.  Searching a TB
+// for a pc (search_pc) translates it again, and the code has to come out
+// the same as the first time.  Running the callbacks again would also have
+// them see the instruction translated twice, so their answers are kept
+// here instead.  Only instructions that got instrumentation have an entry.
+typedef struct panda_insn_record {
+    target_ulong pc;
+    bool exec_cb;
+    guint first_op;
+    int nops;
+} panda_insn_record;
+
+typedef struct panda_tb_record {
+    GArray *insns;  // panda_insn_record, in translation order
+    GArray *ops;    // panda_inline_op
+} panda_tb_record;
+
+static GHashTable *panda_tb_records = NULL;
+
+static void panda_tb_record_free(gpointer data) {
+    panda_tb_record *rec = (panda_tb_record *)data;
+    g_array_free(rec->insns, TRUE);
+    g_array_free(rec->ops, TRUE);
+    g_free(rec);
+}
+
+bool panda_insn_translate(CPUState *env, TranslationBlock *tb, target_ulong pc,
+                          bool search_pc) {
+    panda_cb_list *plist;
+    panda_cb_list **pcb;
+    panda_tb_record *rec = NULL;
+    panda_insn_record insn;
+    bool exec_cb = false;
+    RR_phase old_phase;
+    guint i;
+
+    if (panda_tb_records != NULL) {
+        rec = (panda_tb_record *)g_hash_table_lookup(panda_tb_records, tb);
+    }
+    if (search_pc) {
+        for (i = 0; rec != NULL && i < rec->insns->len; i++) {
+            insn = g_array_index(rec->insns, panda_insn_record, i);
+            if (insn.pc == pc) {
+                memcpy(panda_inline_ops,
+                       &g_array_index(rec->ops, panda_inline_op, insn.first_op),
+                       insn.nops * sizeof(panda_inline_op));
+                panda_inline_nops = insn.nops;
+                return insn.exec_cb;
+            }
+        }
+        return false;
+    }
+
+    old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_INSN_TRANSLATE, pcb, plist) {
+        RR_STATS_CB(plist, exec_cb |= plist->entry.insn_translate(env, pc));
+    }
+    rr_stats_enter(old_phase);
+    if (!exec_cb && panda_inline_nops == 0) {
+        return false;
+    }
+
+    if (panda_tb_records == NULL) {
+        panda_tb_records = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                 NULL, panda_tb_record_free);
+    }
+    if (rec == NULL) {
+        rec = g_new(panda_tb_record, 1);
+        rec->insns = g_array_new(FALSE, FALSE, sizeof(panda_insn_record));
+        rec->ops = g_array_new(FALSE, FALSE, sizeof(panda_inline_op));
+        g_hash_table_insert(panda_tb_records, tb, rec);
+    }
+    insn.pc = pc;
+    insn.exec_cb = exec_cb;
+    insn.first_op = rec->ops->len;
+    insn.nops = panda_inline_nops;
+    g_array_append_vals(rec->ops, panda_inline_ops, panda_inline_nops);
+    g_array_append_val(rec->insns, insn);
+    return exec_cb;
+}
+
+void panda_tb_record_forget(TranslationBlock *tb) {
+    if (panda_tb_records == NULL) return;
+    if (tb == NULL) {
+        g_hash_table_remove_all(panda_tb_records);
+    }
+    else {
+        g_hash_table_remove(panda_tb_records, tb);
+    }
+}
+
 void panda_enable_memcb(void) {
     panda_use_memcb = true;
 }
@@ -301,6 +794,18 @@ void panda_disable_memcb(void) {
     panda_use_memcb = false;
 }
 
+bool panda_flush_tlb(void) {
+    if(panda_please_flush_tlb) {
+        panda_please_flush_tlb = false;
+        return true;
+    }
+    else return false;
+}
+
+void panda_do_flush_tlb(void) {
+    panda_please_flush_tlb = true;
+}
+
 void panda_enable_tb_chaining(void){
     panda_tb_chaining = true;
 }
@@ -312,6 +817,9 @@ void panda_disable_tb_chaining(void){
 #ifdef CONFIG_LLVM
 void panda_enable_llvm(void){
     panda_do_flush_tb();
+    if (panda_lazy_pc) {
+        panda_enable_precise_pc();
+    }
     execute_llvm = 1;
     generate_llvm = 1;
     tcg_llvm_ctx = tcg_llvm_initialize();
@@ -337,21 +845,320 @@ void panda_disable_llvm_helpers(void){
 
 #endif
 
+#ifdef CONFIG_SOFTMMU
+// Memory watches, kept in a singly linked list in registration order.
+// TLB entries for pages that intersect an address range get TLB_WATCH (see
+// tlb_set_page), which sends accesses to them through the instrumented
+// softmmu helpers.  The asid and pc filters can't be applied to TLB
+// entries (global pages stay in the TLB across address space switches), so
+// they are checked here, per access.
+typedef struct panda_mem_watch_entry panda_mem_watch_entry;
+struct panda_mem_watch_entry {
+    int id;
+    void *owner;
+    panda_cb_type type;
+    panda_cb cb;
+    panda_mem_watch watch;      // watch.pcs is our own sorted copy
+    bool enabled;
+    uint64_t ticks;
+    uint64_t calls;
+    panda_mem_watch_entry *next;
+};
+
+static panda_mem_watch_entry *panda_mem_watches = NULL;
+static int panda_mem_watch_next_id = 0;
+
+static int panda_mem_watch_flags(panda_cb_type type) {
+    switch (type) {
+        case PANDA_CB_VIRT_MEM_READ:
+        case PANDA_CB_PHYS_MEM_READ:
+            return PANDA_MEM_WATCH_READ;
+        case PANDA_CB_VIRT_MEM_WRITE:
+        case PANDA_CB_PHYS_MEM_WRITE:
+            return PANDA_MEM_WATCH_WRITE;
+        default:
+            return 0;
+    }
+}
+
+// Does [a, a+size) intersect the watched range?  Written so that ranges
+// reaching the top of the address space don't overflow.
+static inline bool panda_mem_watch_covers(const panda_mem_watch *watch,
+                                          uint64_t a, uint64_t size) {
+    return watch->len == 0 || a - watch->start < watch->len ||
+        watch->start - a < size;
+}
+
+static int panda_mem_watch_cmp_pc(const void *a, const void *b) {
+    target_ulong pa = *(const target_ulong *)a;
+    target_ulong pb = *(const target_ulong *)b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+// The instrumented helpers are only used by code translated while
+// panda_use_memwatch is set, so turning it on or off needs a tb flush
+static void panda_mem_watches_changed(void) {
+    bool use = panda_mem_watches != NULL;
+    if (use != panda_use_memwatch) {
+        panda_use_memwatch = use;
+        panda_do_flush_tb();
+    }
+    panda_do_flush_tlb();
+}
+
+int panda_register_mem_watch(void *plugin, panda_cb_type type, panda_cb cb,
+                             const panda_mem_watch *watch) {
+    panda_mem_watch_entry *w, **tail;
+
+    if (panda_mem_watch_flags(type) == 0) {
+        return -1;
+    }
+    w = g_new0(panda_mem_watch_entry, 1);
+    w->id = panda_mem_watch_next_id++;
+    w->owner = plugin;
+    w->type = type;
+    w->cb = cb;
+    w->watch = *watch;
+    w->enabled = true;
+    if (watch->num_pcs > 0) {
+        w->watch.pcs = g_memdup(watch->pcs,
+                                watch->num_pcs * sizeof(target_ulong));
+        qsort((target_ulong *)w->watch.pcs, watch->num_pcs,
+              sizeof(target_ulong), panda_mem_watch_cmp_pc);
+        if (!panda_update_pc) {
+            panda_enable_precise_pc();
+            panda_do_flush_tb();
+        }
+    }
+    else {
+        w->watch.num_pcs = 0;
+        w->watch.pcs = NULL;
+    }
+    for (tail = &panda_mem_watches; *tail != NULL; tail = &(*tail)->next);
+    *tail = w;
+    panda_mem_watches_changed();
+    return w->id;
+}
+
+static void panda_free_mem_watch(panda_mem_watch_entry *w) {
+    g_free((target_ulong *)w->watch.pcs);
+    g_free(w);
+}
+
+void panda_unregister_mem_watch(int id) {
+    panda_mem_watch_entry **pw;
+    for (pw = &panda_mem_watches; *pw != NULL; pw = &(*pw)->next) {
+        if ((*pw)->id == id) {
+            panda_mem_watch_entry *w = *pw;
+            *pw = w->next;
+            panda_free_mem_watch(w);
+            panda_mem_watches_changed();
+            return;
+        }
+    }
+}
+
+static void panda_unregister_mem_watches(void *plugin) {
+    panda_mem_watch_entry **pw = &panda_mem_watches;
+    bool changed = false;
+    while (*pw != NULL) {
+        if ((*pw)->owner == plugin) {
+            panda_mem_watch_entry *w = *pw;
+            *pw = w->next;
+            panda_free_mem_watch(w);
+            changed = true;
+        }
+        else {
+            pw = &(*pw)->next;
+        }
+    }
+    if (changed) {
+        panda_mem_watches_changed();
+    }
+}
+
+// Disabled watches still mark their pages; they just aren't called
+static void panda_enable_mem_watches(void *plugin, bool enabled) {
+    panda_mem_watch_entry *w;
+    for (w = panda_mem_watches; w != NULL; w = w->next) {
+        if (w->owner == plugin) {
+            w->enabled = enabled;
+        }
+    }
+}
+
+static void panda_mem_watch_cost(void *plugin, uint64_t *ticks,
+                                 uint64_t *calls) {
+    panda_mem_watch_entry *w;
+    for (w = panda_mem_watches; w != NULL; w = w->next) {
+        if (w->owner == plugin) {
+            *ticks += w->ticks;
+            *calls += w->calls;
+        }
+    }
+}
+
+static void panda_reset_mem_watch_cost(void) {
+    panda_mem_watch_entry *w;
+    for (w = panda_mem_watches; w != NULL; w = w->next) {
+        w->ticks = 0;
+        w->calls = 0;
+    }
+}
+
+int panda_mem_watch_page(target_ulong vaddr, target_phys_addr_t paddr) {
+    panda_mem_watch_entry *w;
+    int flags = 0;
+    for (w = panda_mem_watches; w != NULL; w = w->next) {
+        uint64_t page = w->watch.phys ? paddr : vaddr;
+        if (panda_mem_watch_covers(&w->watch, page & TARGET_PAGE_MASK,
+                                   TARGET_PAGE_SIZE)) {
+            flags |= panda_mem_watch_flags(w->type);
+        }
+    }
+    return flags;
+}
+
+void panda_mem_watch_access(CPUState *env, bool is_write, target_ulong addr,
+                            target_ulong size, void *buf) {
+    panda_mem_watch_entry *w;
+    int flag = is_write ? PANDA_MEM_WATCH_WRITE : PANDA_MEM_WATCH_READ;
+    target_phys_addr_t paddr = 0;
+    bool have_paddr = false;
+    target_ulong asid = 0;
+    bool have_asid = false;
+    RR_phase old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+
+    for (w = panda_mem_watches; w != NULL; w = w->next) {
+        bool phys_cb;
+        uint64_t a;
+
+        if (!w->enabled || panda_mem_watch_flags(w->type) != flag) {
+            continue;
+        }
+        phys_cb = w->type == PANDA_CB_PHYS_MEM_READ ||
+            w->type == PANDA_CB_PHYS_MEM_WRITE;
+        if ((w->watch.phys || phys_cb) && !have_paddr) {
+            paddr = cpu_get_phys_addr(env, addr);
+            have_paddr = true;
+        }
+        if ((w->watch.phys || phys_cb) && paddr == -1) {
+            continue;
+        }
+        a = w->watch.phys ? paddr : addr;
+        if (!panda_mem_watch_covers(&w->watch, a, size)) {
+            continue;
+        }
+        if (w->watch.match_asid) {
+            if (!have_asid) {
+                asid = panda_current_asid(env);
+                have_asid = true;
+            }
+            if (asid != w->watch.asid) {
+                continue;
+            }
+        }
+        if (w->watch.num_pcs > 0 &&
+            !bsearch(&env->panda_guest_pc, w->watch.pcs, w->watch.num_pcs,
+                     sizeof(target_ulong), panda_mem_watch_cmp_pc)) {
+            continue;
+        }
+        switch (w->type) {
+            case PANDA_CB_VIRT_MEM_READ:
+                RR_STATS_CB(w, w->cb.virt_mem_read(env, env->panda_guest_pc,
+                    addr, size, buf));
+                break;
+            case PANDA_CB_VIRT_MEM_WRITE:
+                RR_STATS_CB(w, w->cb.virt_mem_write(env, env->panda_guest_pc,
+                    addr, size, buf));
+                break;
+            case PANDA_CB_PHYS_MEM_READ:
+                RR_STATS_CB(w, w->cb.phys_mem_read(env, env->panda_guest_pc,
+                    paddr, size, buf));
+                break;
+            case PANDA_CB_PHYS_MEM_WRITE:
+                RR_STATS_CB(w, w->cb.phys_mem_write(env, env->panda_guest_pc,
+                    paddr, size, buf));
+                break;
+            default:
+                break;
+        }
+    }
+    rr_stats_enter(old_phase);
+}
+
+bool panda_mem_batch_want_paddr = false;
+
+void panda_enable_mem_batch_paddr(void) {
+    panda_mem_batch_want_paddr = true;
+}
+
+void panda_disable_mem_batch_paddr(void) {
+    panda_mem_batch_want_paddr = false;
+}
+
+panda_mem_batch *panda_mem_batch_get(CPUState *env) {
+    if (env->panda_mem_batch == NULL) {
+        env->panda_mem_batch = g_new0(panda_mem_batch, 1);
+    }
+    else if (env->panda_mem_batch->n == PANDA_MEM_BATCH_SIZE) {
+        panda_mem_batch_flush(env);
+    }
+    return env->panda_mem_batch;
+}
+
+target_phys_addr_t panda_mem_batch_paddr(CPUState *env, panda_mem_batch *b,
+                                         target_ulong addr) {
+    target_phys_addr_t paddr = cpu_get_phys_addr(env, addr);
+    if (paddr == -1) {
+        return paddr;
+    }
+    b->have_page = true;
+    b->vpage = addr & TARGET_PAGE_MASK;
+    b->ppage = paddr & TARGET_PAGE_MASK;
+    return paddr;
+}
+
+// Hand the buffered accesses to the PANDA_CB_MEM_BATCH callbacks.  Also
+// forgets the cached page, since the guest may change its page tables or
+// address space once it's back in the cpu loop.
+void panda_mem_batch_flush(CPUState *env) {
+    panda_mem_batch *b = env->panda_mem_batch;
+    panda_cb_list *plist;
+    panda_cb_list **pcb;
+    RR_phase old_phase;
+
+    if (b == NULL || b->n == 0) {
+        return;
+    }
+    old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+    PANDA_CB_FOREACH(PANDA_CB_MEM_BATCH, pcb, plist) {
+        RR_STATS_CB(plist, plist->entry.mem_batch(env, b->accesses, b->n));
+    }
+    rr_stats_enter(old_phase);
+    b->n = 0;
+    b->have_page = false;
+}
+#endif
+
 void panda_memsavep(FILE *f) {
 #ifdef CONFIG_SOFTMMU
     if (!f) return;
-    uint8_t mem_buf[TARGET_PAGE_SIZE];
     uint8_t zero_buf[TARGET_PAGE_SIZE];
     memset(zero_buf, 0, TARGET_PAGE_SIZE);
-    int res;
-    ram_addr_t addr;
-    for (addr = 0; addr < ram_size; addr += TARGET_PAGE_SIZE) {
-        res = panda_physical_memory_rw(addr, mem_buf, TARGET_PAGE_SIZE, 0);
-        if (res == -1) { // I/O. Just fill page with zeroes.
-            fwrite(zero_buf, TARGET_PAGE_SIZE, 1, f);
+    const uint8_t *host;
+    target_phys_addr_t addr, len, n;
+    // Write RAM straight out of guest memory, a contiguous run at a time
+    for (addr = 0; addr < ram_size; addr += len) {
+        len = ram_size - addr;
+        host = panda_phys_ptr(addr, &len);
+        if (host) {
+            fwrite(host, len, 1, f);
         }
-        else {
-            fwrite(mem_buf, TARGET_PAGE_SIZE, 1, f);
+        else { // I/O. Just fill it with zeroes.
+            for (n = 0; n < len; n += TARGET_PAGE_SIZE) {
+                fwrite(zero_buf, MIN(TARGET_PAGE_SIZE, len - n), 1, f);
+            }
         }
     }
 #endif
@@ -573,20 +1380,45 @@ void hmp_panda_unload_plugin(Monitor *mon, const QDict *qdict) {
     qmp_unload_plugin(index, &err);
 }
 
+// Under each plugin, list the host cycles and calls spent in its callbacks
+// of each type.  These are only counted while callbacks are being timed
+// (-replay-stats or -replay-telemetry).
 void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
     Error *err;
-    int i;
+    int i, type;
     monitor_printf(mon, "idx\t%-20s\taddr\n", "name");
     for (i = 0; i < nb_panda_plugins; i++) {
+        uint64_t ticks = 0, calls = 0;
         monitor_printf(mon, "%d\t%-20s\t%p\n", i, panda_plugins[i].name, panda_plugins[i].plugin);
+        for (type = 0; type < PANDA_CB_LAST; type++) {
+            panda_cb_list *plist;
+            ticks = calls = 0;
+            for (plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+                if (plist->owner == panda_plugins[i].plugin) {
+                    ticks += plist->ticks;
+                    calls += plist->calls;
+                }
+            }
+            if (calls > 0) {
+                monitor_printf(mon, "\t  %-32s %12" PRIu64 " calls %16" PRIu64 " cycles\n",
+                               panda_cb_type_name(type), calls, ticks);
+            }
+        }
+        ticks = calls = 0;
+        panda_mem_watch_cost(panda_plugins[i].plugin, &ticks, &calls);
+        if (calls > 0) {
+            monitor_printf(mon, "\t  %-32s %12" PRIu64 " calls %16" PRIu64 " cycles\n",
+                           "mem_watch", calls, ticks);
+        }
     }
     qmp_list_plugins(&err);
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
     panda_cb_list *plist;
+    panda_cb_list **pcb;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_MONITOR, pcb, plist) {
         plist->entry.monitor(mon, cmd);
     }
 }
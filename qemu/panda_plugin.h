@@ -57,9 +57,23 @@ typedef enum panda_cb_type {
     PANDA_CB_REPLAY_NET_TRANSFER,   // in replay, transfers within network card (currently only E1000)
     PANDA_CB_REPLAY_BEFORE_CPU_PHYSICAL_MEM_RW_RAM,  // in replay, just before RAM case of cpu_physical_mem_rw
     PANDA_CB_REPLAY_HANDLE_PACKET,    // in replay, packet in / out
+    PANDA_CB_MEM_BATCH,         // Batches of memory accesses, at block exit
+    PANDA_CB_BLOCK_FILTER,      // After translation: should this plugin's block exec callbacks see the block?
+    PANDA_CB_BEFORE_BLOCK_EXEC_LLVM,    // With LLVM on, before each basic block: run its LLVM or TCG code?
     PANDA_CB_LAST
 } panda_cb_type;
 
+// One memory access, as delivered to PANDA_CB_MEM_BATCH callbacks
+typedef struct panda_mem_access {
+    target_ulong pc;            // guest pc doing the access
+    target_ulong vaddr;
+    target_phys_addr_t paddr;   // -1 if vaddr isn't mapped, or if no plugin
+                                // called panda_enable_mem_batch_paddr()
+    uint64_t value;             // value read, or value about to be written
+    uint8_t size;               // in bytes
+    bool is_write;
+} panda_mem_access;
+
 // Union of all possible callback function types
 typedef union panda_cb {
     /* Callback ID: PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT
@@ -139,6 +153,31 @@ typedef union panda_cb {
     */
     int (*after_block_translate)(CPUState *env, TranslationBlock *tb);
 
+    /* Callback ID: PANDA_CB_BLOCK_FILTER
+
+       block_filter: called once for each basic block, after it is
+        translated, to decide whether the plugin's block exec callbacks
+        (PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, PANDA_CB_BEFORE_BLOCK_EXEC
+        and PANDA_CB_AFTER_BLOCK_EXEC) should run for it
+
+       Arguments:
+        CPUState *env: the current CPU state
+        TranslationBlock *tb: the TB we just translated
+
+       Return value:
+        true if the plugin's block exec callbacks should be called for this
+        TB, false otherwise
+
+       Notes:
+        The block exec callbacks of a plugin that doesn't register a block
+        filter see every TB.  The answer is recorded on the TB, so it can
+        only depend on things that don't change while the TB is cached (pc,
+        size, and so on).  Like PANDA_CB_INSN_TRANSLATE, this lets a plugin
+        that only cares about a few blocks avoid paying for the rest.
+         
+    */
+    bool (*block_filter)(CPUState *env, TranslationBlock *tb);
+
     /* Callback ID: PANDA_CB_INSN_TRANSLATE
 
        insn_translate: called before the translation of each instruction
@@ -177,6 +216,7 @@ typedef union panda_cb {
         helper function just before the instruction itself is generated.
         This is fairly expensive, which is why it's only enabled via
         the PANDA_CB_INSN_TRANSLATE callback.
+        For counters, flags and register logs, see panda_inline_*() below.
     
     */
     int (*insn_exec)(CPUState *env, target_ulong pc);
@@ -504,6 +544,50 @@ typedef union panda_cb {
  */
   int (*replay_net_transfer)(CPUState *env, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes);
 
+/* Callback ID:     PANDA_CB_MEM_BATCH
+
+       mem_batch: called with the memory accesses made since the last call,
+       in order.  Accesses are collected by the instrumented memory helpers
+       and handed over when execution returns to the cpu loop after a block
+       (or chain of blocks), or when the buffer fills up.  Much cheaper than
+       the per-access memory callbacks for plugins that only aggregate.
+       Needs panda_enable_memcb(), and panda_enable_mem_batch_paddr() for
+       physical addresses.
+
+       Arguments:
+        CPUState *env:              the current CPU state
+        panda_mem_access *accesses: the accesses; only valid during the call
+        int n:                      number of accesses
+
+       Return value:
+        unused
+*/
+    int (*mem_batch)(CPUState *env, panda_mem_access *accesses, int n);
+
+/* Callback ID:     PANDA_CB_BEFORE_BLOCK_EXEC_LLVM
+
+       before_block_exec_llvm: called while the LLVM JIT is in use, just
+       before each basic block runs, to choose between the block's LLVM code
+       and its ordinary TCG code
+
+       Arguments:
+        CPUState *env:          the current CPU state
+        TranslationBlock *tb:   the TB we are about to execute
+
+       Return value:
+        true if the block needs its LLVM code this time, false if the TCG
+        code will do
+
+       Notes:
+        The LLVM code runs if any plugin returns true, and always if no
+        plugin registers this callback.  Every TB has both kinds of code
+        when LLVM is on, so a plugin that instruments the LLVM code (like
+        taint2) can let blocks that don't need it run at TCG speed.  Only
+        useful with TB chaining turned off, since chained blocks don't
+        come back to the cpu loop.
+*/
+    bool (*before_block_exec_llvm)(CPUState *env, TranslationBlock *tb);
+
 } panda_cb;
 
 // Doubly linked list that stores a callback, along with its owner
@@ -514,10 +598,42 @@ struct _panda_cb_list {
     panda_cb_list *next;
     panda_cb_list *prev;
     bool enabled;
+    // time spent in this callback (host cycles) and number of calls, kept
+    // only while replay stats are being gathered
+    uint64_t ticks;
+    uint64_t calls;
+    // the owner's bit in TranslationBlock.panda_filter_mask if it has a
+    // block filter, 0 otherwise
+    uint32_t tb_filter;
 };
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist);
+
+// Enabled callbacks of each type, as a NULL-terminated array in list order.
+// Rebuilt whenever callbacks are registered, removed, enabled or disabled,
+// and NULL when a type has none, so hook sites that aren't in use cost a
+// single load.  Walk it with PANDA_CB_FOREACH(type, pcb, plist), where pcb
+// is a panda_cb_list ** cursor and plist the current entry.
+extern panda_cb_list **panda_cb_tab[PANDA_CB_LAST];
+
+#define PANDA_CB_FOREACH(type, pcb, plist)                              \
+    for ((pcb) = panda_cb_tab[type];                                    \
+         (pcb) != NULL && ((plist) = *(pcb)) != NULL; (pcb)++)
+
+// PANDA_CB_FOREACH for the block exec callbacks, which skips plugins whose
+// block filter didn't select tb
+#define PANDA_CB_FOREACH_TB(type, tb, pcb, plist)                       \
+    PANDA_CB_FOREACH(type, pcb, plist)                                  \
+        if ((plist)->tb_filter & ~(tb)->panda_filter_mask) {} else
+
+// Run the block filters on a new TB; used by tb_gen_code
+uint32_t panda_tb_filter_mask(CPUState *env, TranslationBlock *tb);
+
+void panda_cb_tab_reclaim(void);
+const char *panda_cb_type_name(panda_cb_type type);
 void panda_enable_plugin(void *plugin);
 void panda_disable_plugin(void *plugin);
+const char *panda_plugin_cb_cost(int idx, uint64_t *ticks, uint64_t *calls);
+void panda_reset_cb_cost(void);
 
 // Structure to store metadata about a plugin
 typedef struct panda_plugin {
@@ -539,6 +655,26 @@ void   panda_unload_plugins(void);
 #ifdef CONFIG_SOFTMMU
 int panda_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf, int len, int is_write);
 target_phys_addr_t panda_virt_to_phys(CPUState *env, target_ulong addr);
+
+// Zero-copy access to guest RAM.  A range of physical memory is split into
+// runs that are either RAM (or ROM) contiguous in host memory, with 'host'
+// pointing at it, or holes (MMIO or unassigned) with 'host' NULL.  The
+// pointers are read-only: writing through them skips dirty tracking and TB
+// invalidation.  They stay valid until the guest's memory map changes, so
+// don't keep them past the callback that got them.
+typedef struct panda_phys_range {
+    target_phys_addr_t addr;
+    const uint8_t *host;
+    target_phys_addr_t len;
+} panda_phys_range;
+
+// Host pointer for addr, or NULL if it's in a hole.  *len is shrunk to the
+// length of the run starting at addr, so holes can be skipped too.
+const uint8_t *panda_phys_ptr(target_phys_addr_t addr, target_phys_addr_t *len);
+// Fill in at most max runs covering [addr, addr+len) and return how many
+// were used.  If that's max, continue from the end of the last one.
+int panda_phys_ranges(target_phys_addr_t addr, target_phys_addr_t len,
+                      panda_phys_range *ranges, int max);
 #endif
 
 // is_write == 1 means this is a write to the virtual memory addr of the contents of buf.
@@ -550,8 +686,16 @@ bool panda_flush_tb(void);
 void panda_do_flush_tb(void);
 void panda_enable_precise_pc(void);
 void panda_disable_precise_pc(void);
+void panda_enable_lazy_pc(void);
+void panda_disable_lazy_pc(void);
+target_ulong panda_pc_from_host(CPUState *env, void *retaddr);
+void panda_pc_cache_flush(void);
 void panda_enable_memcb(void);
 void panda_disable_memcb(void);
+void panda_enable_mem_batch_paddr(void);
+void panda_disable_mem_batch_paddr(void);
+bool panda_flush_tlb(void);
+void panda_do_flush_tlb(void);
 void panda_enable_llvm(void);
 void panda_disable_llvm(void);
 void panda_enable_llvm_helpers(void);
@@ -560,8 +704,22 @@ void panda_enable_tb_chaining(void);
 void panda_disable_tb_chaining(void);
 void panda_memsavep(FILE *f);
 
+// Called from a memory callback: once the callbacks return, abandon the
+// instruction making the access and run it again from the start, the way
+// it would be after a page fault.  A read has already happened by then and
+// a write hasn't yet.  The restart isn't counted as an instruction in
+// replay.
+void panda_restart_insn(CPUState *env);
+void QEMU_NORETURN panda_do_restart_insn(CPUState *env, void *retaddr);
+// Whether tb should run its LLVM code; used by cpu_exec
+bool panda_block_exec_llvm(CPUState *env, TranslationBlock *tb);
+
+extern bool panda_restart_pending;
 extern bool panda_update_pc;
+extern bool panda_lazy_pc;
+extern void *panda_mem_retaddr;
 extern bool panda_use_memcb;
+extern bool panda_use_memwatch;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
 extern bool panda_plugins_to_unload[MAX_PANDA_PLUGINS];
 extern bool panda_plugin_to_unload;
@@ -570,6 +728,152 @@ extern bool panda_tb_chaining;
 extern char panda_argv[MAX_PANDA_PLUGIN_ARGS][256];
 extern int panda_argc;
 
+#ifdef CONFIG_SOFTMMU
+// Memory watches: a cheaper alternative to panda_enable_memcb() for plugins
+// that only care about some of memory.  Only accesses to TLB pages that
+// overlap a watched range leave the TCG fast path; everything else runs at
+// full speed.  The callback gets the same arguments as the corresponding
+// PANDA_CB_{VIRT,PHYS}_MEM_{READ,WRITE} callback, but is not added to
+// panda_cbs[] and is only called for accesses that match the watch.
+typedef struct panda_mem_watch {
+    uint64_t start;             // first address watched
+    uint64_t len;               // 0 means every address
+    bool phys;                  // start/len are physical addresses
+    bool match_asid;            // only accesses made in asid
+    target_ulong asid;          // as returned by panda_current_asid()
+    int num_pcs;                // if nonzero, only accesses by code at one
+    const target_ulong *pcs;    // of these pcs (turns on precise pc)
+} panda_mem_watch;
+
+#define PANDA_MEM_WATCH_READ  1
+#define PANDA_MEM_WATCH_WRITE 2
+
+// type is one of PANDA_CB_{VIRT,PHYS}_MEM_{READ,WRITE}; the watch is
+// copied.  Returns an id for panda_unregister_mem_watch, or -1 if type
+// isn't a memory callback.  Watches are removed along with the plugin's
+// other callbacks when it is unloaded.
+int panda_register_mem_watch(void *plugin, panda_cb_type type, panda_cb cb,
+                             const panda_mem_watch *watch);
+void panda_unregister_mem_watch(int id);
+
+// Per-CPU buffer of accesses for PANDA_CB_MEM_BATCH (env->panda_mem_batch).
+// Physical addresses cost a page walk, so they're only looked up when a
+// plugin asked for them; then the last page translated is cached until the
+// next flush, so most accesses don't pay for cpu_get_phys_addr().
+extern bool panda_mem_batch_want_paddr;
+#define PANDA_MEM_BATCH_SIZE 1024
+
+typedef struct panda_mem_batch {
+    int n;
+    bool have_page;
+    target_ulong vpage;
+    target_phys_addr_t ppage;
+    panda_mem_access accesses[PANDA_MEM_BATCH_SIZE];
+} panda_mem_batch;
+
+panda_mem_batch *panda_mem_batch_get(CPUState *env);
+target_phys_addr_t panda_mem_batch_paddr(CPUState *env, panda_mem_batch *b,
+                                         target_ulong addr);
+void panda_mem_batch_flush(CPUState *env);
+
+// Used by the instrumented softmmu helpers
+static inline void panda_mem_batch_add(CPUState *env, bool is_write,
+                                       target_ulong addr, int size,
+                                       uint64_t value) {
+    panda_mem_batch *b = env->panda_mem_batch;
+    panda_mem_access *a;
+
+    if (unlikely(b == NULL || b->n == PANDA_MEM_BATCH_SIZE)) {
+        b = panda_mem_batch_get(env);
+    }
+    a = &b->accesses[b->n++];
+    a->pc = env->panda_guest_pc;
+    a->vaddr = addr;
+    if (!panda_mem_batch_want_paddr) {
+        a->paddr = -1;
+    }
+    else if (likely(b->have_page && (addr & TARGET_PAGE_MASK) == b->vpage)) {
+        a->paddr = b->ppage | (addr & ~TARGET_PAGE_MASK);
+    }
+    else {
+        a->paddr = panda_mem_batch_paddr(env, b, addr);
+    }
+    a->value = value;
+    a->size = size;
+    a->is_write = is_write;
+}
+
+// Used by tlb_set_page: which watch types cover this page
+int panda_mem_watch_page(target_ulong vaddr, target_phys_addr_t paddr);
+// Used by the instrumented softmmu helpers: run the matching watches
+void panda_mem_watch_access(CPUState *env, bool is_write, target_ulong addr,
+                            target_ulong size, void *buf);
+#endif
+
+// Inline instrumentation: cheap alternatives to PANDA_CB_INSN_EXEC.  Call
+// these from an insn_translate callback and the ops are generated in front
+// of that instruction as TCG ops, with no helper call or callback walk
+// (only panda_inline_call_if calls out, and only when *cond is set).
+// Pointers must stay valid until the plugin is unloaded; TBs are flushed
+// then if any inline ops were generated.
+typedef void (*panda_inline_fn)(CPUState *env, target_ulong pc, void *opaque);
+
+typedef struct panda_inline_ring_entry {
+    target_ulong pc;
+    target_ulong val;
+} panda_inline_ring_entry;
+
+typedef struct panda_inline_ring {
+    panda_inline_ring_entry *buf;
+    uint32_t mask;                  // size - 1; size is a power of 2
+    uint32_t idx;                   // bumped on every record; wraps
+} panda_inline_ring;
+
+panda_inline_ring *panda_inline_ring_new(unsigned size);
+void panda_inline_ring_free(panda_inline_ring *ring);
+
+// (*counter)++
+void panda_inline_count(uint64_t *counter);
+// *ptr = val
+void panda_inline_store(uint32_t *ptr, uint32_t val);
+// Append {pc, the target_ulong at env_offset in CPUState} to ring, e.g.
+// offsetof(CPUState, regs[R_EAX])
+void panda_inline_ring_record(panda_inline_ring *ring, size_t env_offset);
+// if (*cond) fn(env, pc, opaque)
+void panda_inline_call_if(uint32_t *cond, panda_inline_fn fn, void *opaque);
+
+// Used by translate.c (panda_inline_gen.h)
+#define PANDA_INLINE_MAX 32
+
+typedef enum {
+    PANDA_INLINE_COUNT,
+    PANDA_INLINE_STORE,
+    PANDA_INLINE_RING,
+    PANDA_INLINE_CALL_IF,
+} panda_inline_kind;
+
+typedef struct panda_inline_op {
+    panda_inline_kind kind;
+    void *ptr;
+    uint32_t val;
+    size_t env_offset;
+    panda_inline_fn fn;
+    void *opaque;
+} panda_inline_op;
+
+extern panda_inline_op panda_inline_ops[PANDA_INLINE_MAX];
+extern int panda_inline_nops;
+extern bool panda_inline_used;
+
+// Run the insn_translate callbacks for the instruction at pc in tb and
+// return whether any of them wants insn_exec; inline requests are left in
+// panda_inline_ops.  With search_pc, tb is being translated again and the
+// answers from its first translation are given back instead.
+bool panda_insn_translate(CPUState *env, TranslationBlock *tb, target_ulong pc,
+                          bool search_pc);
+// Drop what was kept for tb, or for every TB if tb is NULL
+void panda_tb_record_forget(TranslationBlock *tb);
+
 // Struct for holding a parsed key/value pair from
 // a -panda-arg plugin:key=value style argument.
 typedef struct panda_arg {
@@ -27,6 +27,7 @@ extern "C" {
 #include "panda_plugin.h"
 #include "panda_plugin_plugin.h"
 #include "pandalog.h"
+#include "panda_vmem.h"
 
 #include "callstack_instr.h"
 
@@ -102,6 +103,8 @@ std::map<stackid, std::vector<target_ulong>> function_stacks;
 // EIP -> instr_type
 std::map<target_ulong, instr_type> call_cache;
 int last_ret_size = 0;
+// Cached reads for disas_block and the EBP fallback
+panda_vmem_reader *vmem;
 
 static inline bool in_kernelspace(CPUState *env) {
 #if defined(TARGET_I386)
@@ -201,7 +204,7 @@ static stackid get_stackid(CPUState *env, target_ulong addr) {
 
 instr_type disas_block(CPUState* env, target_ulong pc, int size) {
     unsigned char *buf = (unsigned char *) malloc(size);
-    int err = panda_virtual_memory_rw(env, pc, buf, size, 0);
+    int err = panda_vmem_read(vmem, env, pc, buf, size);
     if (err == -1) printf("Couldn't read TB memory!\n");
     instr_type res = INSTR_UNKNOWN;
 
@@ -407,7 +410,7 @@ void get_prog_point(CPUState *env, prog_point *p) {
 #ifdef TARGET_I386
         // fall back to EBP on x86
         int word_size = (env->hflags & HF_LMA_MASK) ? 8 : 4;
-        panda_virtual_memory_rw(env, env->regs[R_EBP]+word_size, (uint8_t *)&p->caller, word_size, 0);
+        panda_vmem_read(vmem, env, env->regs[R_EBP]+word_size, &p->caller, word_size);
 #endif
     }
 
@@ -424,6 +427,8 @@ bool init_plugin(void *self) {
     panda_enable_memcb();
     panda_enable_precise_pc();
 
+    vmem = panda_vmem_reader_new();
+
     pcb.after_block_translate = after_block_translate;
     panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
     pcb.after_block_exec = after_block_exec;
@@ -435,4 +440,5 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    panda_vmem_reader_free(vmem);
 }
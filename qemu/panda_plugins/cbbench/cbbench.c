@@ -0,0 +1,203 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+// Microbenchmark for the PANDA hook points.  Each run turns on one hook
+// (an empty callback, inline instrumentation, or a mode like memcb or
+// precise pc with no callback at all) and counts the events it sees.  Run
+// the same replay under each mode and compare against mode=none to get the
+// slowdown and the cost per event; testing/cbbench.bash does that.
+
+#include "config.h"
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "rr_log.h"
+
+#include "panda_plugin.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+int before_block_exec(CPUState *env, TranslationBlock *tb);
+int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next_tb);
+bool insn_translate(CPUState *env, target_ulong pc);
+bool inline_translate(CPUState *env, target_ulong pc);
+void inline_call(CPUState *env, target_ulong pc, void *opaque);
+int insn_exec(CPUState *env, target_ulong pc);
+int virt_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
+                  target_ulong size, void *buf);
+int virt_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
+                   target_ulong size, void *buf);
+int mem_batch(CPUState *env, panda_mem_access *accesses, int n);
+
+static const char *mode;
+static uint64_t events;
+static int64_t start_ns;
+
+// For mode inline
+static panda_inline_ring *ring;
+static uint32_t call_flag;      // never set, so inline_call never runs
+
+#if defined(TARGET_I386)
+#define RING_REG offsetof(CPUState, regs[R_EAX])
+#elif defined(TARGET_ARM)
+#define RING_REG offsetof(CPUState, regs[0])
+#else
+#define RING_REG offsetof(CPUState, mem_io_vaddr)
+#endif
+
+// The callbacks do as little as possible, so what's measured is the cost
+// of getting to them
+int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    events++;
+    return 0;
+}
+
+int after_block_exec(CPUState *env, TranslationBlock *tb, TranslationBlock *next_tb) {
+    events++;
+    return 0;
+}
+
+bool insn_translate(CPUState *env, target_ulong pc) {
+    return true;
+}
+
+// One of each inline op in front of every instruction; events is bumped by
+// the generated code itself.  call_if is measured on its usual path, with
+// the flag clear.
+bool inline_translate(CPUState *env, target_ulong pc) {
+    panda_inline_count(&events);
+    panda_inline_ring_record(ring, RING_REG);
+    panda_inline_call_if(&call_flag, inline_call, NULL);
+    return false;
+}
+
+void inline_call(CPUState *env, target_ulong pc, void *opaque) {
+    events++;
+}
+
+int insn_exec(CPUState *env, target_ulong pc) {
+    events++;
+    return 0;
+}
+
+int virt_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
+                  target_ulong size, void *buf) {
+    events++;
+    return 0;
+}
+
+int virt_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
+                   target_ulong size, void *buf) {
+    events++;
+    return 0;
+}
+
+int mem_batch(CPUState *env, panda_mem_access *accesses, int n) {
+    events += n;
+    return 0;
+}
+
+bool init_plugin(void *self) {
+    panda_cb pcb;
+
+    panda_arg_list *args = panda_get_args("cbbench");
+    mode = panda_parse_string(args, "mode", "none");
+
+    if (!strcmp(mode, "none")) {
+        // baseline: plugin loaded, nothing turned on
+    }
+    else if (!strcmp(mode, "bbe")) {
+        pcb.before_block_exec = before_block_exec;
+        panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    }
+    else if (!strcmp(mode, "abe")) {
+        pcb.after_block_exec = after_block_exec;
+        panda_register_callback(self, PANDA_CB_AFTER_BLOCK_EXEC, pcb);
+    }
+    else if (!strcmp(mode, "insn")) {
+        pcb.insn_translate = insn_translate;
+        panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
+        pcb.insn_exec = insn_exec;
+        panda_register_callback(self, PANDA_CB_INSN_EXEC, pcb);
+    }
+    else if (!strcmp(mode, "inline")) {
+        ring = panda_inline_ring_new(4096);
+        pcb.insn_translate = inline_translate;
+        panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
+    }
+    else if (!strcmp(mode, "memcb")) {
+        // the slow path memory helpers, with no one listening
+        panda_enable_memcb();
+    }
+    else if (!strcmp(mode, "memread")) {
+        panda_enable_memcb();
+        pcb.virt_mem_read = virt_mem_read;
+        panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    }
+    else if (!strcmp(mode, "memwrite")) {
+        panda_enable_memcb();
+        pcb.virt_mem_write = virt_mem_write;
+        panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    }
+    else if (!strcmp(mode, "membatch")) {
+        panda_enable_memcb();
+        pcb.mem_batch = mem_batch;
+        panda_register_callback(self, PANDA_CB_MEM_BATCH, pcb);
+    }
+    else if (!strcmp(mode, "precise_pc")) {
+        panda_enable_precise_pc();
+    }
+    else if (!strcmp(mode, "lazy_pc")) {
+        // only does anything alongside memory callbacks, so compare
+        // against memread
+        panda_enable_memcb();
+        panda_enable_lazy_pc();
+        pcb.virt_mem_read = virt_mem_read;
+        panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    }
+    else if (!strcmp(mode, "llvm")) {
+#ifdef CONFIG_LLVM
+        panda_enable_llvm();
+#else
+        printf("cbbench: PANDA was built without LLVM\n");
+        return false;
+#endif
+    }
+    else {
+        printf("cbbench: unknown mode %s\n", mode);
+        return false;
+    }
+
+    printf("cbbench: mode %s\n", mode);
+    start_ns = get_clock();
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    double secs = (get_clock() - start_ns) / 1e9;
+    uint64_t instrs = rr_get_guest_instr_count();
+
+    // Modes with no callback cost something per instruction
+    if (events == 0) {
+        events = instrs;
+    }
+    printf("cbbench: mode=%s events=%" PRIu64 " instructions=%" PRIu64
+           " seconds=%.6f\n", mode, events, instrs, secs);
+
+    if (ring) {
+        panda_inline_ring_free(ring);
+    }
+}
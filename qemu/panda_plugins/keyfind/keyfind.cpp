@@ -24,10 +24,13 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "panda_work.h"
 
 }
 
 #include "keyfind.h"
+#include <openssl/crypto.h>
+#include <pthread.h>
 #include <unordered_set>
 #include <vector>
 #include <set>
@@ -71,9 +74,6 @@ void read_hex_string(std::string in, unsigned char *out)
 }
 
 // Globals
-StringInfo g_keydata;
-StringInfo g_master_secret;
-StringInfo g_out;
 StringInfo g_client_random;
 StringInfo g_server_random;
 StringInfo g_version;
@@ -99,15 +99,71 @@ struct key_buf {
 std::set<prog_point> matches;
 std::map<prog_point,key_buf> key_tracker;
 
+// Candidate keys are checked on a panda_work queue.  Each worker has its
+// own scratch buffers; everything else check_key reads is fixed after
+// init_plugin.
+struct key_check {
+    prog_point p;
+    uint8_t key[MASTER_SECRET_SIZE];
+    bool match;
+#ifdef DEBUG
+    // what check_key printed, for key_check_done to print in order
+    std::string *debug;
+#endif
+};
+
+struct key_scratch {
+    StringInfo master_secret;
+    StringInfo keydata;
+    StringInfo out;
+};
+
+std::vector<key_scratch> scratch;
+panda_work_queue *key_queue;
+
+// OpenSSL before 1.1 only locks its shared state (engine and error tables,
+// ...) if it is given callbacks to do it with
+static pthread_mutex_t *ssl_locks;
+
+static void ssl_lock_cb(int mode, int n, const char *file, int line) {
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&ssl_locks[n]);
+    else
+        pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long ssl_thread_id_cb(void) {
+    return (unsigned long)pthread_self();
+}
+
+static void ssl_locks_init(void) {
+    ssl_locks = (pthread_mutex_t *)malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+    for (int i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_init(&ssl_locks[i], NULL);
+    CRYPTO_set_id_callback(ssl_thread_id_cb);
+    CRYPTO_set_locking_callback(ssl_lock_cb);
+}
+
+static void ssl_locks_free(void) {
+    if (!ssl_locks) return;
+    CRYPTO_set_locking_callback(NULL);
+    CRYPTO_set_id_callback(NULL);
+    for (int i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_destroy(&ssl_locks[i]);
+    free(ssl_locks);
+    ssl_locks = NULL;
+}
+
 bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo *server_random,
                StringInfo *enc_msg, StringInfo *version, StringInfo *content_type,
-               const EVP_MD *md, const EVP_CIPHER *ciph)
+               const EVP_MD *md, const EVP_CIPHER *ciph,
+               StringInfo *keydata, StringInfo *out)
 {
     // Generate the session keys
     if (version->data[0] == 0x03 && version->data[1] == 0x03) {
-        tls12_prf(EVP_sha256(), master_secret, "key expansion", server_random, client_random, &g_keydata);
+        tls12_prf(EVP_sha256(), master_secret, "key expansion", server_random, client_random, keydata);
     } else {
-        tls_prf(master_secret, "key expansion", server_random, client_random, &g_keydata);
+        tls_prf(master_secret, "key expansion", server_random, client_random, keydata);
     }
     
     // Divvy up the key block
@@ -118,7 +174,7 @@ bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo
     unsigned char *client_enc_iv;
     //unsigned char *server_enc_iv;
 
-    unsigned char *keyblock_ptr = g_keydata.data;
+    unsigned char *keyblock_ptr = keydata->data;
     // Client MAC
     client_mac_key = keyblock_ptr;
     keyblock_ptr += EVP_MD_size(md);
@@ -147,11 +203,11 @@ bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo
     EVP_CIPHER_CTX_set_padding(&ctx, 1);
     res = EVP_DecryptInit_ex(&ctx, ciph, NULL, client_enc_key, client_enc_iv);
     CHECK(res, "EVP_DecryptInit");
-    res = EVP_DecryptUpdate(&ctx, g_out.data, &tmp_len, enc_msg->data, enc_msg->data_len);
+    res = EVP_DecryptUpdate(&ctx, out->data, &tmp_len, enc_msg->data, enc_msg->data_len);
     CHECK(res, "EVP_DecryptUpdate");
     dec_data_len += tmp_len;
     tmp_len = enc_msg->data_len - dec_data_len;
-    EVP_DecryptFinal_ex(&ctx, g_out.data+dec_data_len, &tmp_len); 
+    EVP_DecryptFinal_ex(&ctx, out->data+dec_data_len, &tmp_len); 
     CHECK(res, "EVP_DecryptFinal");
     dec_data_len += tmp_len;
     EVP_CIPHER_CTX_cleanup(&ctx);
@@ -159,12 +215,12 @@ bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo
     // For some reason there's always one byte of extra padding?
     // This only applies to block ciphers, of course.
     if (EVP_CIPHER_block_size(ciph) != 1) dec_data_len--;
-    g_out.data_len = dec_data_len;
-    ssl_print_string("decrypted data", &g_out);
+    out->data_len = dec_data_len;
+    ssl_print_string("decrypted data", out);
     
     unsigned short msg_len = dec_data_len - EVP_MD_size(md);
-    unsigned char *msg = g_out.data;
-    unsigned char *mac = g_out.data + msg_len;
+    unsigned char *msg = out->data;
+    unsigned char *mac = out->data + msg_len;
 
     // TLS 1.1 and 1.2 provide an IV in the decrypted data. Skip it.
     if (version->data[0] == 0x03 && version->data[1] > 0x01) {
@@ -199,6 +255,43 @@ bool check_key(StringInfo *master_secret, StringInfo *client_random, StringInfo
         return false;
 }
 
+// Runs on a worker thread
+static void key_check_work(void *rec, void *opaque, unsigned worker) {
+    key_check *kc = (key_check *)rec;
+    key_scratch *s = &scratch[worker];
+
+    memcpy(s->master_secret.data, kc->key, MASTER_SECRET_SIZE);
+#ifdef DEBUG
+    kc->debug = new std::string;
+    ssl_debug_out = kc->debug;
+#endif
+    kc->match = check_key(&s->master_secret, &g_client_random, &g_server_random,
+                          &g_enc_msg, &g_version, &g_content_type, g_md, g_ciph,
+                          &s->keydata, &s->out);
+#ifdef DEBUG
+    ssl_debug_out = NULL;
+#endif
+}
+
+// Runs on the vCPU thread, in the order the candidates were posted
+static void key_check_done(void *rec, void *opaque) {
+    key_check *kc = (key_check *)rec;
+
+#ifdef DEBUG
+    fputs(kc->debug->c_str(), stderr);
+    delete kc->debug;
+#endif
+    if (unlikely(kc->match)) {
+        fprintf(stderr, "MAC match found at " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
+            kc->p.caller, kc->p.pc, kc->p.cr3);
+        fprintf(stderr, "Key: ");
+        for(int j = 0; j < MASTER_SECRET_SIZE; j++)
+            fprintf(stderr, "%02x", kc->key[j]);
+        fprintf(stderr, "\n");
+        matches.insert(kc->p);
+    }
+}
+
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf) {
     prog_point p = {};
@@ -225,25 +318,16 @@ int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
         }
         if (likely(k->filled)) {
             // Copy it out of the ring buffer
+            key_check kc;
             int key_bytes_left = sizeof(k->key) - k->start;
             int key_bytes_right = k->start;
-            memcpy(g_master_secret.data, k->key+k->start, key_bytes_left);
+            kc.p = p;
+            memcpy(kc.key, k->key+k->start, key_bytes_left);
             if(key_bytes_right) {
-                memcpy(g_master_secret.data+key_bytes_left, k->key, key_bytes_right);
-            }
-
-            bool match = check_key(&g_master_secret, &g_client_random, &g_server_random,
-                           &g_enc_msg, &g_version, &g_content_type, g_md, g_ciph);
-
-            if (unlikely(match)) {
-                fprintf(stderr, "MAC match found at " TARGET_FMT_lx " " TARGET_FMT_lx " " TARGET_FMT_lx "\n",
-                    p.caller, p.pc, p.cr3);
-                fprintf(stderr, "Key: ");
-                for(int j = 0; j < MASTER_SECRET_SIZE; j++)
-                    fprintf(stderr, "%02x", g_master_secret.data[j]);
-                fprintf(stderr, "\n");
-                matches.insert(p);
+                memcpy(kc.key+key_bytes_left, k->key, key_bytes_right);
             }
+            kc.match = false;
+            panda_work_post(key_queue, &kc);
         }
     }
  
@@ -458,15 +542,25 @@ bool init_plugin(void *self) {
     if (!found_cipher) { fprintf(stderr, "Cipher not found in config file, aborting.\n"); return false; }
     if (!found_mac) { fprintf(stderr, "MAC not found in config file, aborting.\n"); return false; }
 
-    // Global data. Init it once here so we don't have to
+    // Per-worker scratch data. Init it once here so we don't have to
     // re-alloc each time.
-    ssl_data_alloc(&g_master_secret, MASTER_SECRET_SIZE);
+    panda_arg_list *args = panda_get_args("keyfind");
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = panda_parse_uint64(args, "threads", ncpus > 1 ? ncpus - 1 : 0);
+    panda_free_args(args);
     int needed = 0;
     needed = EVP_MD_size(g_md)*2 + \
              EVP_CIPHER_key_length(g_ciph)*2 + \
              EVP_CIPHER_iv_length(g_ciph)*2;
-    ssl_data_alloc(&g_keydata, needed);
-    ssl_data_alloc(&g_out, g_enc_msg.data_len);
+    scratch.resize(nthreads > 0 ? nthreads : 1);
+    for (unsigned i = 0; i < scratch.size(); i++) {
+        ssl_data_alloc(&scratch[i].master_secret, MASTER_SECRET_SIZE);
+        ssl_data_alloc(&scratch[i].keydata, needed);
+        ssl_data_alloc(&scratch[i].out, g_enc_msg.data_len);
+    }
+    if (nthreads > 0) ssl_locks_init();
+    key_queue = panda_work_queue_new("keyfind", sizeof(key_check), 4096, nthreads,
+                                     key_check_work, key_check_done, NULL);
 
     if (!have_candidates) {
         panda_enable_memcb();
@@ -486,6 +580,10 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    // Check whatever candidates are still queued
+    panda_work_print_stats(key_queue);
+    panda_work_queue_free(key_queue);
+    ssl_locks_free();
     printf("%d / %d blocks instrumented.\n", instrumented, total);
     FILE *mem_report = fopen("key_matches.txt", "w");
     if(!mem_report) {
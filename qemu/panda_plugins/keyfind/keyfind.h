@@ -53,6 +53,12 @@ typedef struct _StringInfo {
     unsigned int data_len;
 } StringInfo;
 
+#ifdef DEBUG
+// When set, ssl_print_data appends to it instead of printing, so that a
+// thread can hand its output to another to print
+extern __thread std::string *ssl_debug_out;
+#endif
+
 void ssl_print_data(const char* name, const unsigned char* data, size_t len);
 
 void ssl_print_string(const char* name, const StringInfo* data);
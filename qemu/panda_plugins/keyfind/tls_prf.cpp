@@ -35,18 +35,31 @@ PANDAENDCOMMENT */
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#ifdef DEBUG
+__thread std::string *ssl_debug_out = NULL;
+#endif
+
 void
 ssl_print_data(const char* name, const unsigned char* data, size_t len)
 {
 #ifdef DEBUG
+    std::string s;
+    char tmp[16];
     size_t i;
-    fprintf(stderr,"%s[%d]:\n",name, (int) len);
+    s += name;
+    snprintf(tmp, sizeof(tmp), "[%d]:\n", (int) len);
+    s += tmp;
     for (i=0; i< len; i++) {
         if ((i > 0) && (i%16 == 0))
-            fprintf(stderr,"\n");
-        fprintf(stderr,"%.2x ",data[i]&255);
+            s += "\n";
+        snprintf(tmp, sizeof(tmp), "%.2x ", data[i]&255);
+        s += tmp;
     }
-    fprintf(stderr,"\n");
+    s += "\n";
+    if (ssl_debug_out)
+        *ssl_debug_out += s;
+    else
+        fputs(s.c_str(), stderr);
 #endif
 }
 
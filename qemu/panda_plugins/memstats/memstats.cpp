@@ -41,26 +41,26 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+int mem_batch_callback(CPUState *env, panda_mem_access *accesses, int n);
 
 }
 
 uint64_t bytes_read, bytes_written;
 uint64_t num_reads, num_writes;
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    bytes_written += size;
-    num_writes++;
-
-    return 1;
-}
-
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    bytes_read += size;
-    num_reads++;
+// Only counts, so take the accesses in batches rather than one callback
+// per load and store
+int mem_batch_callback(CPUState *env, panda_mem_access *accesses, int n) {
+    for (int i = 0; i < n; i++) {
+        if (accesses[i].is_write) {
+            bytes_written += accesses[i].size;
+            num_writes++;
+        }
+        else {
+            bytes_read += accesses[i].size;
+            num_reads++;
+        }
+    }
     return 1;
 }
 
@@ -72,10 +72,8 @@ bool init_plugin(void *self) {
     // Enable memory logging
     panda_enable_memcb();
 
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    pcb.mem_batch = mem_batch_callback;
+    panda_register_callback(self, PANDA_CB_MEM_BATCH, pcb);
 
     return true;
 }
@@ -161,7 +161,7 @@ bool init_plugin(void *self) {
     }
 
     // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
+    panda_enable_lazy_pc();
     // Enable memory logging
     panda_enable_memcb();
 
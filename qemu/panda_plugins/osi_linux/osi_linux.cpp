@@ -13,6 +13,7 @@ extern "C" {
 
 #include "panda_plugin.h"
 #include "panda_plugin_plugin.h"
+#include "panda_vmem.h"
 #include "../osi/osi_types.h"
 #include "../osi/os_intro.h"
 
@@ -44,6 +45,7 @@ void on_free_osimodules(OsiModules *ms);
 
 struct kernelinfo ki;
 int panda_memory_errors;
+panda_vmem_reader *vmem;
 
 /**
  * @brief Turns on/off standalone testing mode.
@@ -362,6 +364,9 @@ bool init_plugin(void *self) {
     g_free(kconf_file);
     g_free(kconf_group);
 
+    // Walking the task list reads the same few kernel pages over and over
+    vmem = panda_vmem_reader_new();
+
 #if (OSI_LINUX_TEST)
     panda_register_callback(self, PANDA_CB_VMI_PGD_CHANGED, pcb);
 #else
@@ -388,7 +393,7 @@ error:
  */
 void uninit_plugin(void *self) {
 #if defined(TARGET_I386) || defined(TARGET_ARM)
-    // Nothing to do...
+    panda_vmem_reader_free(vmem);
 #endif
     return;
 }
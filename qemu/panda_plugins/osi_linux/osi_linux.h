@@ -98,6 +98,7 @@
 
 extern struct kernelinfo ki;
 extern int panda_memory_errors;
+extern panda_vmem_reader *vmem;
 
 /**
  * @brief IMPLEMENT_OFFSET_GET is a macro for generating uniform
@@ -106,7 +107,7 @@ extern int panda_memory_errors;
 #define IMPLEMENT_OFFSET_GET(_name, _paramName, _retType, _offset, _errorRetValue)                        \
 static inline _retType _name(CPUState* env, PTR _paramName) {                                             \
   _retType _t;                                                                                            \
-  if (-1 == panda_virtual_memory_rw(env, _paramName + _offset, (uint8_t *)&_t, sizeof(_retType), 0)) { \
+  if (-1 == panda_vmem_read(vmem, env, _paramName + _offset, (uint8_t *)&_t, sizeof(_retType))) {         \
     panda_memory_errors++;                                                                                \
     return (_errorRetValue);                                                                              \
   }                                                                                                       \
@@ -121,11 +122,11 @@ static inline _retType _name(CPUState* env, PTR _paramName) {
 static inline _retType2 _name(CPUState* env, PTR _paramName) {                                                \
   _retType1 _t1;                                                                                              \
   _retType2 _t2;                                                                                              \
-  if (-1 == panda_virtual_memory_rw(env, _paramName + _offset1, (uint8_t *)&_t1, sizeof(_retType1), 0)) {  \
+  if (-1 == panda_vmem_read(vmem, env, _paramName + _offset1, (uint8_t *)&_t1, sizeof(_retType1))) {          \
     panda_memory_errors++;                                                                                    \
     return (_errorRetValue);                                                                                  \
   }                                                                                                           \
-  if (-1 == panda_virtual_memory_rw(env, _t1 + _offset2, (uint8_t *)&_t2, sizeof(_retType2), 0)) {         \
+  if (-1 == panda_vmem_read(vmem, env, _t1 + _offset2, (uint8_t *)&_t2, sizeof(_retType2))) {                 \
     panda_memory_errors++;                                                                                    \
     return (_errorRetValue);                                                                                  \
   }                                                                                                           \
@@ -311,7 +312,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry, char *name, int
     dentry_current = dentry;
 
     // read d_name qstr
-    err = panda_virtual_memory_rw(env, dentry_current + ki.fs.d_name_offset, d_name, _SIZEOF_QSTR, 0);
+    err = panda_vmem_read(vmem, env, dentry_current + ki.fs.d_name_offset, d_name, _SIZEOF_QSTR);
     if (-1 == err) goto error;
 
     // read component
@@ -320,7 +321,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry, char *name, int
       pcomp_capacity = pcomp_length;
       pcomp = (char *)g_realloc(pcomp, pcomp_capacity * sizeof(char));
     }
-    err = panda_virtual_memory_rw(env, *(PTR *)(d_name + 2*sizeof(target_uint)), (uint8_t *)pcomp, pcomp_length*sizeof(char), 0);
+    err = panda_vmem_read(vmem, env, *(PTR *)(d_name + 2*sizeof(target_uint)), (uint8_t *)pcomp, pcomp_length*sizeof(char));
     if (-1 == err) goto error;
 
     // copy component
@@ -331,7 +332,7 @@ static inline char *read_dentry_name(CPUState *env, PTR dentry, char *name, int
     pcomps[pcomps_idx++] = g_strdup(pcomp);
 
     // read the parent dentry
-    err = panda_virtual_memory_rw(env, dentry_current + ki.fs.d_parent_offset, (uint8_t *)&dentry, sizeof(PTR), 0);
+    err = panda_vmem_read(vmem, env, dentry_current + ki.fs.d_parent_offset, (uint8_t *)&dentry, sizeof(PTR));
     if (-1 == err) goto error;
   } while (recurse && (dentry != dentry_current));
 
@@ -379,7 +380,7 @@ error:
 static inline char *get_name(CPUState *env, PTR task_struct, char *name) {
   if (name == NULL) { name = (char *)g_malloc0(ki.task.comm_size * sizeof(char)); }
   else { name = (char *)g_realloc(name, ki.task.comm_size * sizeof(char)); }
-  if (-1 == panda_virtual_memory_rw(env, task_struct + ki.task.comm_offset, (uint8_t *)name, ki.task.comm_size * sizeof(char), 0)) {
+  if (-1 == panda_vmem_read(vmem, env, task_struct + ki.task.comm_offset, (uint8_t *)name, ki.task.comm_size * sizeof(char))) {
     panda_memory_errors++;
     strncpy(name, "N/A", ki.task.comm_size*sizeof(char));
   }
@@ -35,14 +35,22 @@ bool init_plugin(void *);
 void uninit_plugin(void *);
 
 int before_block_exec(CPUState *env, TranslationBlock *tb);
+bool block_filter(CPUState *env, TranslationBlock *tb);
 
 }
 
 static target_ulong blockpc = 0;
 
+// Only the block at blockpc needs before_block_exec. The filter is just an
+// optimization (it can run out of bits and let every block through), so
+// before_block_exec still checks the pc itself.
+bool block_filter(CPUState *env, TranslationBlock *tb) {
+    return tb->pc == blockpc;
+}
+
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    target_ulong callers[64];
     if (tb->pc == blockpc) {
+        target_ulong callers[64];
         printf("Func stack @ 0x" TARGET_FMT_lx ": ", blockpc);
         int n = get_functions(callers, 64, env);
         for (int i = n - 1; i >= 0; i--) {
@@ -59,6 +67,8 @@ bool init_plugin(void *self) {
 
     panda_cb pcb = { .before_block_exec = before_block_exec };
     panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    pcb.block_filter = block_filter;
+    panda_register_callback(self, PANDA_CB_BLOCK_FILTER, pcb);
 
     panda_arg_list *args = panda_get_args("printstack");
     blockpc = panda_parse_ulong(args, "pc", 0);
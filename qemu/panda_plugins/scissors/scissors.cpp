@@ -0,0 +1,462 @@
+/* Scissors plugin for making smaller replays.
+ *
+ * Use -panda-arg scissors:start and -panda-arg scissors:end
+ * to control beginning and end of new replay. Output goes to
+ * a new replay named "scissors" by default (-panda-arg scissors:name
+ * to change)
+ *
+ * To cut several pieces out in one pass, put one "start end" pair per line
+ * in a file and pass it with -panda-arg scissors:windows=<file>. The
+ * windows must not overlap; window i is written to <name>-<i>.
+ *
+ * If the recording has replay checkpoints (see -replay-checkpoint), the
+ * replay starts from the one nearest the first window instead of from the
+ * beginning.
+ */
+
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+
+#include "config.h"
+#include "qemu-common.h"
+
+#include "panda_plugin.h"
+#include "panda_common.h"
+
+#include "rr_log.h"
+#include "monitor.h"
+#include "sysemu.h"
+#include "qemu-timer.h"
+
+}
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <zlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+extern "C" {
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+int before_block_exec(CPUState *env, TranslationBlock *tb);
+
+extern RR_log *rr_nondet_log;
+
+}
+
+struct Window {
+    uint64_t start;
+    uint64_t end;
+    bool operator<(const Window &other) const { return start < other.start; }
+};
+
+static std::vector<Window> windows;
+static size_t cur_window = 0;
+static std::string base_name;
+
+static uint64_t actual_start_count;
+
+static std::string nondet_name;
+static std::string snp_name;
+
+static FILE *newlog = NULL;
+
+static RR_log_entry entry;
+static std::vector<uint8_t> payload;
+
+static bool snipping = false;
+static bool done = false;
+
+// Our own reader for the original nondet log, independent of the one the
+// replay is using. For a v2 log, chunks are decompressed into chunk_buf.
+static FILE *oldlog = NULL;
+static uint64_t next_chunk;
+static std::vector<uint8_t> chunk_buf;
+static std::vector<uint8_t> zbuf;
+static size_t chunk_pos;
+
+static void sassert(bool condition) {
+    if (!condition) {
+        printf("Assertion failure @ count %" PRIu64 "!\n", entry.header.prog_point.guest_instr_count);
+        rr_do_end_replay(true);
+    }
+}
+
+static bool load_chunk(void) {
+    if (next_chunk >= rr_nondet_log->num_chunks) return false;
+    RR_log_chunk_info *info = &rr_nondet_log->chunks[next_chunk++];
+    zbuf.resize(info->compressed_size);
+    chunk_buf.resize(info->uncompressed_size);
+    sassert(fseeko(oldlog, info->offset + sizeof(RR_log_chunk_header), SEEK_SET) == 0);
+    sassert(fread(&zbuf[0], 1, zbuf.size(), oldlog) == zbuf.size());
+    uLongf len = chunk_buf.size();
+    sassert(uncompress(&chunk_buf[0], &len, &zbuf[0], zbuf.size()) == Z_OK);
+    sassert(len == chunk_buf.size());
+    chunk_pos = 0;
+    return true;
+}
+
+static bool log_read(void *ptr, size_t size) {
+    if (rr_nondet_log->version == 1) {
+        return fread(ptr, 1, size, oldlog) == size;
+    }
+    uint8_t *dst = (uint8_t *) ptr;
+    while (size > 0) {
+        if (chunk_pos == chunk_buf.size() && !load_chunk()) return false;
+        size_t n = std::min(size, chunk_buf.size() - chunk_pos);
+        memcpy(dst, &chunk_buf[chunk_pos], n);
+        chunk_pos += n;
+        dst += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Read a field of the current entry, and copy it to out unless out is NULL.
+static void xfer(void *buf, size_t size, FILE *out) {
+    sassert(log_read(buf, size));
+    if (out) {
+        sassert(fwrite(buf, size, 1, out) == 1);
+    }
+}
+
+// Read the next entry of the original log and append it to out (NULL to
+// just skip it), with its instruction count made relative to the start of
+// the cut. Returns false, without copying anything, at the end of the log or
+// at the first entry at or after instruction `until`.
+static bool copy_entry(FILE *out, uint64_t until) {
+    // Code copied from rr_log.c.
+    RR_log_entry *item = &entry;
+
+    //mz XXX we assume that the log is not trucated - should probably fix this.
+    if (!log_read(&(item->header.prog_point), sizeof(RR_prog_point))) {
+        return false;
+    }
+    if (item->header.prog_point.guest_instr_count >= until) {
+        // We don't want to copy this one.
+        return false;
+    }
+
+    //mz this is more compact, as it doesn't include extra padding.
+    sassert(log_read(&(item->header.kind), sizeof(item->header.kind)));
+    sassert(log_read(&(item->header.callsite_loc), sizeof(item->header.callsite_loc)));
+    if (item->header.kind == RR_LAST) {
+        //ph We don't copy RR_LAST here; write out afterwards.
+        return false;
+    }
+    if (item->header.kind == RR_DEBUG) {
+        // State hashes are dropped: the first one in the cut would cover
+        // RAM writes from before it started, so it couldn't match.
+        RR_state_hash *hash = &item->variant.state_hash;
+        xfer(hash, sizeof(*hash), NULL);
+        payload.resize(hash->num_pages * sizeof(RR_page_hash));
+        if (!payload.empty()) {
+            xfer(&payload[0], payload.size(), NULL);
+        }
+        return true;
+    }
+    if (out) {
+        //ph Fix up instruction count
+        RR_prog_point prog_point = item->header.prog_point;
+        prog_point.guest_instr_count -= actual_start_count;
+        sassert(fwrite(&prog_point, sizeof(RR_prog_point), 1, out) == 1);
+        sassert(fwrite(&(item->header.kind), sizeof(item->header.kind), 1, out) == 1);
+        sassert(fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, out) == 1);
+    }
+
+    //mz read the rest of the item
+    switch (item->header.kind) {
+        case RR_INPUT_1:
+            xfer(&(item->variant.input_1), sizeof(item->variant.input_1), out);
+            break;
+        case RR_INPUT_2:
+            xfer(&(item->variant.input_2), sizeof(item->variant.input_2), out);
+            break;
+        case RR_INPUT_4:
+            xfer(&(item->variant.input_4), sizeof(item->variant.input_4), out);
+            break;
+        case RR_INPUT_8:
+            xfer(&(item->variant.input_8), sizeof(item->variant.input_8), out);
+            break;
+        case RR_INTERRUPT_REQUEST:
+            xfer(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), out);
+            break;
+        case RR_EXIT_REQUEST:
+            xfer(&(item->variant.exit_request), sizeof(item->variant.exit_request), out);
+            break;
+        case RR_SKIPPED_CALL:
+            {
+                RR_skipped_call_args *args = &item->variant.call_args;
+                //mz read kind first!
+                xfer(&(args->kind), sizeof(args->kind), out);
+                switch(args->kind) {
+                    case RR_CALL_CPU_MEM_RW:
+                        xfer(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), out);
+                        payload.resize(args->variant.cpu_mem_rw_args.len);
+                        break;
+                    case RR_CALL_CPU_MEM_UNMAP:
+                        xfer(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), out);
+                        payload.resize(args->variant.cpu_mem_unmap.len);
+                        break;
+                    case RR_CALL_CPU_REG_MEM_REGION:
+                        xfer(&(args->variant.cpu_mem_reg_region_args),
+                             sizeof(args->variant.cpu_mem_reg_region_args), out);
+                        payload.clear();
+                        break;
+                    case RR_CALL_HD_TRANSFER:
+                        xfer(&(args->variant.hd_transfer_args), sizeof(args->variant.hd_transfer_args), out);
+                        payload.clear();
+                        break;
+                    case RR_CALL_NET_TRANSFER:
+                        xfer(&(args->variant.net_transfer_args), sizeof(args->variant.net_transfer_args), out);
+                        payload.clear();
+                        break;
+                    case RR_CALL_HANDLE_PACKET:
+                        xfer(&(args->variant.handle_packet_args), sizeof(args->variant.handle_packet_args), out);
+                        payload.resize(args->variant.handle_packet_args.size);
+                        break;
+                    default:
+                        //mz unimplemented
+                        sassert(0);
+                }
+                if (!payload.empty()) {
+                    xfer(&payload[0], payload.size(), out);
+                }
+            }
+            break;
+        default:
+            //mz unimplemented
+            sassert(0);
+    }
+
+    return true;
+}
+
+// Size of an entry in a v1 log, as written by rr_write_item.
+static size_t entry_size(RR_log_entry *item) {
+    size_t size = sizeof(RR_prog_point) + sizeof(item->header.kind) + sizeof(item->header.callsite_loc);
+    switch (item->header.kind) {
+        case RR_INPUT_1: return size + sizeof(item->variant.input_1);
+        case RR_INPUT_2: return size + sizeof(item->variant.input_2);
+        case RR_INPUT_4: return size + sizeof(item->variant.input_4);
+        case RR_INPUT_8: return size + sizeof(item->variant.input_8);
+        case RR_INTERRUPT_REQUEST: return size + sizeof(item->variant.interrupt_request);
+        case RR_EXIT_REQUEST: return size + sizeof(item->variant.exit_request);
+        case RR_DEBUG:
+            return size + sizeof(item->variant.state_hash) +
+                item->variant.state_hash.num_pages * sizeof(RR_page_hash);
+        case RR_SKIPPED_CALL:
+            {
+                RR_skipped_call_args *args = &item->variant.call_args;
+                size += sizeof(args->kind);
+                switch (args->kind) {
+                    case RR_CALL_CPU_MEM_RW:
+                        return size + sizeof(args->variant.cpu_mem_rw_args) + args->variant.cpu_mem_rw_args.len;
+                    case RR_CALL_CPU_MEM_UNMAP:
+                        return size + sizeof(args->variant.cpu_mem_unmap) + args->variant.cpu_mem_unmap.len;
+                    case RR_CALL_CPU_REG_MEM_REGION:
+                        return size + sizeof(args->variant.cpu_mem_reg_region_args);
+                    case RR_CALL_HD_TRANSFER:
+                        return size + sizeof(args->variant.hd_transfer_args);
+                    case RR_CALL_NET_TRANSFER:
+                        return size + sizeof(args->variant.net_transfer_args);
+                    case RR_CALL_HANDLE_PACKET:
+                        return size + sizeof(args->variant.handle_packet_args) + args->variant.handle_packet_args.size;
+                    default:
+                        sassert(0);
+                        return size;
+                }
+            }
+        default:
+            return size;
+    }
+}
+
+// Point our reader at the first entry the replay hasn't consumed yet, i.e.
+// the head of its queue.
+static void seek_oldlog(void) {
+    uint64_t queued = 0;
+    size_t queued_size = 0;
+    RR_log_entry *item;
+    for (item = rr_get_queue_head(); item != NULL; item = item->next) {
+        queued++;
+        if (rr_nondet_log->version == 1) queued_size += entry_size(item);
+    }
+
+    if (rr_nondet_log->version == 1) {
+        sassert(fseeko(oldlog, ftello(rr_nondet_log->fp) - queued_size, SEEK_SET) == 0);
+        return;
+    }
+
+    // use the chunk index to find the chunk, then skip entries within it
+    uint64_t target = rr_nondet_log->item_number - queued;
+    uint64_t lo = 0, hi = rr_nondet_log->num_chunks;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (rr_nondet_log->chunks[mid].first_item <= target) lo = mid;
+        else hi = mid;
+    }
+    next_chunk = lo;
+    chunk_buf.clear();
+    chunk_pos = 0;
+    uint64_t n;
+    for (n = rr_nondet_log->chunks[lo].first_item; n < target; n++) {
+        sassert(copy_entry(NULL, UINT64_MAX));
+    }
+}
+
+static void begin_snip(uint64_t count) {
+    char suffix[32] = "";
+    if (windows.size() > 1) {
+        snprintf(suffix, sizeof(suffix), "-%zu", cur_window);
+    }
+    nondet_name = base_name + suffix + "-rr-nondet.log";
+    snp_name = base_name + suffix + "-rr-snp";
+
+    sassert((oldlog = fopen(rr_nondet_log->name, "r")));
+    printf("Original ending prog point: ");
+    rr_spit_prog_point(rr_nondet_log->last_prog_point);
+
+    actual_start_count = count;
+    printf("Saving snapshot at instr count %" PRIu64 "...\n", count);
+    do_savevm_rr(get_monitor(), snp_name.c_str());
+
+    // Only remember where we are in the log for now. The entries are copied
+    // at the end, once we know exactly where the new replay stops.
+    seek_oldlog();
+
+    printf("Beginning cut-and-paste process at prog point:\n");
+    rr_spit_prog_point(rr_prog_point);
+
+    snipping = true;
+    done = false;
+    printf("Continuing with replay.\n");
+}
+
+static void end_snip(void) {
+    RR_prog_point prog_point = rr_prog_point;
+    printf("Ending cut-and-paste on prog point:\n");
+    rr_spit_prog_point(rr_prog_point);
+    prog_point.guest_instr_count -= actual_start_count;
+
+    printf("Writing entries to %s...\n", nondet_name.c_str());
+    newlog = fopen(nondet_name.c_str(), "w");
+    sassert(newlog);
+    // We'll fix this up later.
+    RR_prog_point empty_prog_point = {0, 0, 0};
+    fwrite(&empty_prog_point, sizeof(RR_prog_point), 1, newlog);
+
+    // Everything the replay consumed before stopping here
+    while (copy_entry(newlog, rr_prog_point.guest_instr_count));
+    fclose(oldlog);
+    oldlog = NULL;
+
+    RR_header end;
+    end.kind = RR_LAST;
+    end.callsite_loc = RR_CALLSITE_LAST;
+    end.prog_point = rr_prog_point;
+    end.prog_point.guest_instr_count -= actual_start_count;
+    sassert(fwrite(&(end.prog_point), sizeof(end.prog_point), 1, newlog) == 1);
+    sassert(fwrite(&(end.kind), sizeof(end.kind), 1, newlog) == 1);
+    sassert(fwrite(&(end.callsite_loc), sizeof(end.callsite_loc), 1, newlog) == 1);
+
+    rewind(newlog);
+    fwrite(&prog_point, sizeof(RR_prog_point), 1, newlog);
+    fclose(newlog);
+    newlog = NULL;
+
+    snipping = false;
+    done = true;
+}
+
+int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    uint64_t count = rr_prog_point.guest_instr_count;
+
+    if (snipping && count > windows[cur_window].end) {
+        end_snip();
+        cur_window++;
+        if (cur_window == windows.size()) {
+            rr_end_replay_requested = 1;
+        }
+    }
+
+    if (!snipping && cur_window < windows.size() &&
+            count+tb->num_guest_insns > windows[cur_window].start) {
+        begin_snip(count);
+    }
+
+    return 0;
+}
+
+static bool read_windows(const char *file_name) {
+    FILE *fp = fopen(file_name, "r");
+    if (!fp) {
+        printf("scissors: couldn't open %s\n", file_name);
+        return false;
+    }
+    unsigned long long start, end;
+    while (fscanf(fp, "%llu %llu", &start, &end) == 2) {
+        Window w = { start, end };
+        windows.push_back(w);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool init_plugin(void *self) {
+    panda_cb pcb;
+    pcb.before_block_exec = before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+
+    uint64_t start_count = 0;
+    uint64_t end_count = UINT64_MAX;
+    const char *name = "scissors";
+    const char *windows_file = NULL;
+
+    panda_arg_list *args = panda_get_args("scissors");
+    if (args != NULL) {
+        name = panda_parse_string(args, "name", "scissors");
+        start_count = panda_parse_uint64(args, "start", 0);
+        end_count = panda_parse_uint64(args, "end", UINT64_MAX);
+        windows_file = panda_parse_string(args, "windows", NULL);
+    }
+    base_name = name;
+
+    if (windows_file) {
+        if (!read_windows(windows_file)) return false;
+    }
+    else {
+        Window w = { start_count, end_count };
+        windows.push_back(w);
+    }
+    if (windows.empty()) {
+        printf("scissors: no windows to cut\n");
+        return false;
+    }
+    std::sort(windows.begin(), windows.end());
+    for (size_t i = 0; i < windows.size(); i++) {
+        if (windows[i].start > windows[i].end ||
+                (i > 0 && windows[i].start <= windows[i-1].end)) {
+            printf("scissors: windows must be non-empty and must not overlap\n");
+            return false;
+        }
+    }
+
+    // Skip straight to the checkpoint nearest the first window, unless
+    // the replay is already being started somewhere else.
+    if (rr_replay_start_instr == 0) {
+        rr_replay_start_instr = windows[0].start;
+    }
+
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    if (snipping && !done) end_snip();
+}
@@ -30,11 +30,45 @@ PANDAENDCOMMENT */
 #include <set>
 #include <string>
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
-FastShad::FastShad(std::string name, uint64_t labelsets) : _name(name) {
+// Shared by all sparse shadows.  It's mapped read-only, so a write that
+// misses get_td_p_w() faults instead of tainting every clean page.
+static TaintData *shared_zero_page;
+
+FastShad::FastShad(std::string name, uint64_t labelsets, bool sparse) : _name(name) {
     uint64_t bytes = sizeof(TaintData) * labelsets;
 
+    pages = NULL;
+    page_taint = NULL;
+    zero_page = NULL;
+    num_pages = 0;
+    pages_used = 0;
+    num_tainted = 0;
+    size = labelsets;
+
+    if (sparse) {
+        if (!shared_zero_page) {
+            shared_zero_page = (TaintData *)mmap(NULL,
+                    FAST_SHAD_PAGE_SIZE * sizeof(TaintData), PROT_READ,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            assert(shared_zero_page != (TaintData *)MAP_FAILED);
+        }
+        zero_page = shared_zero_page;
+        num_pages = (labelsets + FAST_SHAD_PAGE_MASK) >> FAST_SHAD_PAGE_BITS;
+        pages = (TaintData **)malloc(num_pages * sizeof(TaintData *));
+        page_taint = (uint32_t *)calloc(num_pages, sizeof(uint32_t));
+        assert(pages && page_taint);
+        for (uint64_t i = 0; i < num_pages; i++) {
+            pages[i] = zero_page;
+        }
+        printf("taint2: Allocating sparse fast_shad (%" PRIu64 " pages of %lu bytes, on demand).\n",
+                num_pages, FAST_SHAD_PAGE_SIZE * sizeof(TaintData));
+        labels = NULL;
+        orig_labels = NULL;
+        return;
+    }
+
     TaintData *array;
     if (labelsets < (1UL << 24)) {
         array = (TaintData *)malloc(bytes);
@@ -60,12 +94,44 @@ FastShad::FastShad(std::string name, uint64_t labelsets) : _name(name) {
 
     labels = array;
     orig_labels = array;
-    size = labelsets;
+}
+
+// First taint write to a page of a sparse shadow
+TaintData *fast_shad_alloc_page(FastShad *fast_shad, uint64_t page) {
+    TaintData *p = (TaintData *)calloc(FAST_SHAD_PAGE_SIZE, sizeof(TaintData));
+    assert(p);
+    fast_shad->pages[page] = p;
+    fast_shad->pages_used++;
+    return p;
+}
+
+void FastShad::mark_label_sets() {
+    if (pages) {
+        for (uint64_t i = 0; i < num_pages; i++) {
+            if (pages[i] == zero_page) continue;
+            for (uint64_t j = 0; j < FAST_SHAD_PAGE_SIZE; j++) {
+                label_set_mark(pages[i][j].ls);
+            }
+        }
+        return;
+    }
+    // all of it, not just the current frame
+    for (uint64_t i = 0; i < size; i++) {
+        label_set_mark(orig_labels[i].ls);
+    }
 }
 
 // release all memory associated with this fast_shad.
 FastShad::~FastShad() {
-    if (size < (1UL << 24)) {
+    if (pages) {
+        printf("taint2: %s shadow used %" PRIu64 " of %" PRIu64 " pages.\n",
+                name(), pages_used, num_pages);
+        for (uint64_t i = 0; i < num_pages; i++) {
+            if (pages[i] != zero_page) free(pages[i]);
+        }
+        free(pages);
+        free(page_taint);
+    } else if (size < (1UL << 24)) {
         free(orig_labels);
     } else {
         munmap(orig_labels, sizeof(TaintData) * size);
@@ -77,35 +77,124 @@ struct TaintData {
     }
 };
 
+// Sparse shadows (RAM) are split into pages of this many entries.  A page
+// that has never been written points at a shared, read-only zero page.
+#define FAST_SHAD_PAGE_BITS 12
+#define FAST_SHAD_PAGE_SIZE (1UL << FAST_SHAD_PAGE_BITS)
+#define FAST_SHAD_PAGE_MASK (FAST_SHAD_PAGE_SIZE - 1)
+
+extern "C" {
+// Out of line so the JIT'd taint ops can call it
+TaintData *fast_shad_alloc_page(FastShad *fast_shad, uint64_t page);
+}
+
 class FastShad {
 private:
-    TaintData *labels;
+    TaintData *labels;        // dense: the whole shadow; sparse: NULL
     TaintData *orig_labels;
+    // sparse: one pointer per page, zero_page until the first taint write,
+    // and a count of the tainted entries in each page
+    TaintData **pages;
+    uint32_t *page_taint;
+    TaintData *zero_page;
+    uint64_t num_pages;
+    uint64_t pages_used;
+    uint64_t num_tainted;     // sparse: tainted entries in all pages
     uint64_t size; // Number of labelsets contained.
     std::string _name;
 
+    friend TaintData *fast_shad_alloc_page(FastShad *fast_shad, uint64_t page);
+
     inline TaintData *get_td_p(uint64_t guest_addr) {
         //taint_log("  %lx->get_ls_p(%lx)\n", (uint64_t)this, guest_addr);
         tassert(guest_addr < size);
-        return &labels[guest_addr];
+        if (likely(labels != NULL)) return &labels[guest_addr];
+        return pages[guest_addr >> FAST_SHAD_PAGE_BITS]
+            + (guest_addr & FAST_SHAD_PAGE_MASK);
     }
 
-    inline bool range_tainted(uint64_t addr, uint64_t size) {
-        for (unsigned i = addr; i < addr+size; i++) {
-            if (get_td_p(i)->ls) return true;
+    // Like get_td_p, but the entry is going to be written
+    inline TaintData *get_td_p_w(uint64_t guest_addr) {
+        tassert(guest_addr < size);
+        if (likely(labels != NULL)) return &labels[guest_addr];
+        uint64_t page = guest_addr >> FAST_SHAD_PAGE_BITS;
+        TaintData *p = pages[page];
+        if (unlikely(p == zero_page)) p = fast_shad_alloc_page(this, page);
+        return p + (guest_addr & FAST_SHAD_PAGE_MASK);
+    }
+
+    // Entries from addr to the end of its page, at most n
+    static inline uint64_t page_chunk(uint64_t addr, uint64_t n) {
+        uint64_t left = FAST_SHAD_PAGE_SIZE - (addr & FAST_SHAD_PAGE_MASK);
+        return n < left ? n : left;
+    }
+
+    static inline uint32_t count_tainted(const TaintData *p, uint64_t n) {
+        uint32_t count = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (p[i].ls) count++;
         }
-        return false;
+        return count;
+    }
+
+    inline void set_td(uint64_t addr, TaintData td) {
+        if (likely(labels != NULL)) {
+            labels[addr] = td;
+            return;
+        }
+        uint64_t page = addr >> FAST_SHAD_PAGE_BITS;
+        if (!td.ls && pages[page] == zero_page) return;
+        TaintData *p = get_td_p_w(addr);
+        if (!p->ls && td.ls) page_taint[page]++, num_tainted++;
+        else if (p->ls && !td.ls) page_taint[page]--, num_tainted--;
+        *p = td;
     }
 
 public:
-    FastShad(std::string name, uint64_t size);
+    FastShad(std::string name, uint64_t size, bool sparse = false);
     ~FastShad();
 
     uint64_t get_size() { return size; }
 
+    // Mark every label set in the shadow as live, for label_set_gc_sweep
+    void mark_label_sets();
+
+    // Any taint in [addr, addr+size)?  Pages of a sparse shadow that hold
+    // no taint are skipped without looking at their entries.
+    inline bool range_tainted(uint64_t addr, uint64_t size) {
+        if (likely(labels != NULL)) {
+            for (uint64_t i = addr; i < addr+size; i++) {
+                if (labels[i].ls) return true;
+            }
+            return false;
+        }
+        while (size > 0) {
+            uint64_t n = page_chunk(addr, size);
+            if (page_taint[addr >> FAST_SHAD_PAGE_BITS] &&
+                    count_tainted(get_td_p(addr), n))
+                return true;
+            addr += n;
+            size -= n;
+        }
+        return false;
+    }
+
+    // Does the page holding addr hold any taint?  Always true for dense
+    // shadows.
+    inline bool page_tainted(uint64_t addr) {
+        if (likely(labels != NULL)) return true;
+        return page_taint[addr >> FAST_SHAD_PAGE_BITS] != 0;
+    }
+
+    // No taint anywhere in the shadow?  Only cheap for sparse shadows.
+    inline bool clean() {
+        if (likely(labels != NULL)) return !range_tainted(0, size);
+        return num_tainted == 0;
+    }
+
     // Taint an address with a labelset.
     inline void label(uint64_t addr, LabelSetP ls) {
-        *get_td_p(addr) = TaintData(ls);
+        set_td(addr, TaintData(ls));
     }
 
     static inline void copy(FastShad *shad_dest, uint64_t dest, FastShad *shad_src, uint64_t src, uint64_t size) {
@@ -131,11 +220,45 @@ public:
                     shad_src->range_tainted(src, size)))
             change = true;
 
-        memcpy(shad_dest->get_td_p(dest), shad_src->get_td_p(src), size * sizeof(TaintData));
+        if (likely(shad_dest->labels != NULL && shad_src->labels != NULL)) {
+            memcpy(shad_dest->get_td_p(dest), shad_src->get_td_p(src), size * sizeof(TaintData));
+        } else {
+            shad_dest->copy_sparse(dest, shad_src, src, size);
+        }
 
         if (change) taint_state_changed(shad_dest, dest, size);
     }
 
+    // copy() when either side is sparse: go a page at a time, and don't
+    // allocate a destination page just to copy clean entries into it.
+    inline void copy_sparse(uint64_t dest, FastShad *shad_src, uint64_t src, uint64_t size) {
+        while (size > 0) {
+            uint64_t n = size;
+            if (!labels) n = page_chunk(dest, n);
+            if (!shad_src->labels) n = page_chunk(src, n);
+
+            TaintData *src_p = shad_src->get_td_p(src);
+            if (labels) {
+                memcpy(&labels[dest], src_p, n * sizeof(TaintData));
+            } else {
+                uint64_t page = dest >> FAST_SHAD_PAGE_BITS;
+                bool src_clean = !shad_src->page_tainted(src) ||
+                    count_tainted(src_p, n) == 0;
+                if (!(src_clean && page_taint[page] == 0)) {
+                    TaintData *dest_p = get_td_p_w(dest);
+                    uint32_t before = count_tainted(dest_p, n);
+                    memcpy(dest_p, src_p, n * sizeof(TaintData));
+                    uint32_t after = count_tainted(dest_p, n);
+                    page_taint[page] += after - before;
+                    num_tainted += (int64_t)after - before;
+                }
+            }
+            dest += n;
+            src += n;
+            size -= n;
+        }
+    }
+
     // Remove taint.
     inline void remove(uint64_t addr, uint64_t remove_size) {
         tassert(addr + remove_size >= addr);
@@ -154,7 +277,25 @@ public:
         bool change = false;
         if (track_taint_state && range_tainted(addr, remove_size))
             change = true;
-        memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
+
+        if (likely(labels != NULL)) {
+            memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
+        } else {
+            uint64_t a = addr, left = remove_size;
+            while (left > 0) {
+                uint64_t n = page_chunk(a, left);
+                uint64_t page = a >> FAST_SHAD_PAGE_BITS;
+                if (page_taint[page]) {
+                    TaintData *p = pages[page] + (a & FAST_SHAD_PAGE_MASK);
+                    uint32_t removed = count_tainted(p, n);
+                    page_taint[page] -= removed;
+                    num_tainted -= removed;
+                    memset(p, 0, n * sizeof(TaintData));
+                }
+                a += n;
+                left -= n;
+            }
+        }
 
         if (change) taint_state_changed(this, addr, remove_size);
     }
@@ -182,14 +323,14 @@ public:
     }
 
     inline TaintData query_full(uint64_t addr) {
-        return labels[addr];
+        return *get_td_p(addr);
     }
 
     inline void set_full(uint64_t addr, TaintData td) {
         tassert(addr < size);
 
         bool change = !(td == *get_td_p(addr));
-        labels[addr] = td;
+        set_td(addr, td);
 
         if (change) taint_state_changed(this, addr, 1);
     }
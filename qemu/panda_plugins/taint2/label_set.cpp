@@ -1,83 +1,467 @@
-extern "C" {
-#include <sys/mman.h>
-}
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
 
-#include <map>
+#include <algorithm>
+#include <iterator>
+#include <list>
 #include <vector>
 #include <set>
 #include <unordered_set>
 #include <unordered_map>
 #include <functional>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "label_set.h"
 
-template<typename T>
-class ArenaAlloc {
-private:
-    uint8_t *next = NULL;
-    std::vector<std::pair<uint8_t *, size_t>> blocks;
-    size_t next_block_size = 1 << 15;
-
-    void alloc_block() {
-        //printf("taint2: allocating block of size %lu\n", next_block_size);
-        next = (uint8_t *)mmap(NULL, next_block_size, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(next);
-        blocks.push_back(std::make_pair(next, next_block_size));
-        next_block_size <<= 1;
-    }
-
-    T *alloc_imp() {
-        assert(blocks.size() > 0);
-        std::pair<uint8_t *, size_t>& block = blocks.back();
-        if (next + sizeof(T) > block.first + block.second) {
-            alloc_block();
-            assert(next != NULL);
+// Label sets are immutable and hash-consed: there is only ever one LabelSet
+// with given contents, so sets are compared by pointer and the union of two
+// sets can be cached by the pair of pointers.  Each set is kept in one of
+// three encodings, picked from its contents alone so equal sets are always
+// encoded the same way:
+//
+//  LS_SMALL    a sorted array, up to LS_SMALL_MAX labels
+//  LS_BITMAP   a bitmap over the words between the lowest and highest
+//              label, when that's no bigger than the array would be.
+//              Positional labels from file_taint mostly end up here.
+//  LS_ROARING  a sorted array of containers for each 64k labels, each
+//              either a sorted array of the low 16 bits or, above
+//              LS_CONT_ARRAY_MAX labels, a bitmap.
+
+#define LS_SMALL_MAX 16
+#define LS_BITMAP_MAX_WORDS (1U << 16)
+#define LS_CONT_ARRAY_MAX 4096
+#define LS_CONT_WORDS 1024
+
+#define LS_UNION_CACHE_DEFAULT (1U << 20)
+#define LS_GC_DEFAULT (256ULL << 20)
+
+enum { LS_SMALL, LS_BITMAP, LS_ROARING };
+
+struct LsContainer {
+    uint32_t key;       // label >> 16
+    uint32_t card;
+    uint32_t offset;    // in data[] words
+    uint32_t pad;
+};
+
+struct LabelSet {
+    uint64_t hash;
+    uint32_t card;
+    uint32_t kind;
+    uint32_t min, max;
+    uint32_t n;         // LS_SMALL: labels; LS_BITMAP: words; LS_ROARING: containers
+    uint32_t nwords;    // size of data[]
+    uint32_t epoch;     // last gc that found it live
+    uint64_t data[];
+};
+
+static inline uint32_t ls_kind(uint64_t card, uint32_t min, uint32_t max) {
+    if (card <= LS_SMALL_MAX) return LS_SMALL;
+    uint64_t words = (max >> 6) - (min >> 6) + 1;
+    if (words <= LS_BITMAP_MAX_WORDS && words * 2 <= card) return LS_BITMAP;
+    return LS_ROARING;
+}
+
+static inline uint32_t ls_cont_words(uint32_t card) {
+    return card > LS_CONT_ARRAY_MAX ? LS_CONT_WORDS : (card + 3) / 4;
+}
+
+static inline const uint32_t *ls_small(LabelSetP ls) {
+    return (const uint32_t *)ls->data;
+}
+
+static inline const LsContainer *ls_conts(LabelSetP ls) {
+    return (const LsContainer *)ls->data;
+}
+
+static inline void ls_or_words(uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= n; i += 2) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(d, s));
+    }
+#endif
+    for (; i < n; i++) dst[i] |= src[i];
+}
+
+static inline uint64_t ls_popcount(const uint64_t *w, size_t n) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; i++) count += __builtin_popcountll(w[i]);
+    return count;
+}
+
+// Call f on every set bit as a label, in order, until it returns false
+template<typename F>
+static inline bool ls_each_bit(const uint64_t *w, uint32_t n, uint32_t base, F f) {
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t x = w[i];
+        while (x) {
+            if (!f(base + i * 64 + __builtin_ctzll(x))) return false;
+            x &= x - 1;
         }
+    }
+    return true;
+}
 
-        T *result = new(next) T;
-        next += sizeof(T);
-        return result;
+template<typename F>
+static bool ls_each(LabelSetP ls, F f) {
+    if (ls->kind == LS_SMALL) {
+        for (uint32_t i = 0; i < ls->n; i++) {
+            if (!f(ls_small(ls)[i])) return false;
+        }
+        return true;
+    } else if (ls->kind == LS_BITMAP) {
+        return ls_each_bit(ls->data, ls->n, ls->min & ~63U, f);
     }
+    for (uint32_t i = 0; i < ls->n; i++) {
+        const LsContainer *c = &ls_conts(ls)[i];
+        const uint64_t *p = ls->data + c->offset;
+        if (c->card > LS_CONT_ARRAY_MAX) {
+            if (!ls_each_bit(p, LS_CONT_WORDS, c->key << 16, f)) return false;
+        } else {
+            const uint16_t *a = (const uint16_t *)p;
+            for (uint32_t j = 0; j < c->card; j++) {
+                if (!f((c->key << 16) | a[j])) return false;
+            }
+        }
+    }
+    return true;
+}
 
-public:
-    ArenaAlloc() {
-        alloc_block();
+static void ls_to_vector(LabelSetP ls, std::vector<uint32_t> &v) {
+    v.reserve(ls->card);
+    ls_each(ls, [&](uint32_t l) { v.push_back(l); return true; });
+}
+
+struct LsHash {
+    size_t operator()(const LabelSet *ls) const { return ls->hash; }
+};
+
+struct LsEq {
+    bool operator()(const LabelSet *a, const LabelSet *b) const {
+        return a->hash == b->hash && a->kind == b->kind &&
+            a->card == b->card && a->min == b->min && a->nwords == b->nwords &&
+            !memcmp(a->data, b->data, a->nwords * sizeof(uint64_t));
     }
+};
 
-    const T *alloc() {
-        return alloc_imp();
+static std::unordered_set<LabelSet *, LsHash, LsEq> label_sets;
+static uint64_t label_set_bytes;
+
+static inline uint64_t ls_bytes(const LabelSet *ls) {
+    return sizeof(LabelSet) + ls->nwords * sizeof(uint64_t);
+}
+
+static LabelSet *ls_alloc(uint32_t kind, uint64_t nwords) {
+    LabelSet *ls = (LabelSet *)calloc(1, sizeof(LabelSet) + nwords * sizeof(uint64_t));
+    assert(ls);
+    ls->kind = kind;
+    ls->nwords = nwords;
+    return ls;
+}
+
+// Return the one copy of ls, freeing it if there already was one
+static LabelSetP ls_intern(LabelSet *ls, uint64_t card, uint32_t min, uint32_t max) {
+    // bitmaps only say where they start through min
+    uint64_t h = ((ls->kind + 1) * 0x9e3779b97f4a7c15ULL ^ card) + min;
+    for (uint32_t i = 0; i < ls->nwords; i++) {
+        h = (h ^ ls->data[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
     }
+    ls->hash = h;
+    ls->card = card;
+    ls->min = min;
+    ls->max = max;
 
-    const T *alloc(T &old) {
-        T *result = alloc_imp();
-        result->swap(old);
-        return result;
+    auto ins = label_sets.insert(ls);
+    if (!ins.second) {
+        free(ls);
+        return *ins.first;
+    }
+    label_set_bytes += ls_bytes(ls);
+    return ls;
+}
+
+static LabelSet *ls_build_small(const uint32_t *v, uint32_t n) {
+    LabelSet *ls = ls_alloc(LS_SMALL, (n + 1) / 2);
+    memcpy(ls->data, v, n * sizeof(uint32_t));
+    ls->n = n;
+    return ls;
+}
+
+static LabelSet *ls_build_bitmap(const uint32_t *v, size_t n) {
+    uint32_t base = v[0] >> 6;
+    uint32_t words = (v[n - 1] >> 6) - base + 1;
+    LabelSet *ls = ls_alloc(LS_BITMAP, words);
+    for (size_t i = 0; i < n; i++) {
+        ls->data[(v[i] >> 6) - base] |= 1ULL << (v[i] & 63);
+    }
+    ls->n = words;
+    return ls;
+}
+
+// Also used to get a roaring view of a set in another encoding
+static LabelSet *ls_build_roaring(const uint32_t *v, size_t n) {
+    uint32_t nc = 0;
+    uint64_t payload = 0;
+    size_t i, j;
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && (v[j] >> 16) == (v[i] >> 16); j++);
+        nc++;
+        payload += ls_cont_words(j - i);
     }
 
-    ~ArenaAlloc() {
-        for (auto&& block : blocks) {
-            munmap(block.first, block.second);
+    LabelSet *ls = ls_alloc(LS_ROARING, 2 * nc + payload);
+    LsContainer *c = (LsContainer *)ls->data;
+    uint32_t off = 2 * nc;
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && (v[j] >> 16) == (v[i] >> 16); j++);
+        c->key = v[i] >> 16;
+        c->card = j - i;
+        c->offset = off;
+        uint64_t *p = ls->data + off;
+        if (c->card > LS_CONT_ARRAY_MAX) {
+            for (size_t k = i; k < j; k++) {
+                p[(v[k] & 0xffff) >> 6] |= 1ULL << (v[k] & 63);
+            }
+        } else {
+            uint16_t *a = (uint16_t *)p;
+            for (size_t k = i; k < j; k++) a[k - i] = v[k] & 0xffff;
         }
+        off += ls_cont_words(c->card);
+        c++;
     }
-};
+    ls->n = nc;
+    return ls;
+}
 
-static ArenaAlloc<std::set<uint32_t>> LSA;
+// v is sorted, without repeats, and not empty
+static LabelSetP ls_from_sorted(const uint32_t *v, size_t n) {
+    LabelSet *ls;
+    switch (ls_kind(n, v[0], v[n - 1])) {
+        case LS_SMALL: ls = ls_build_small(v, n); break;
+        case LS_BITMAP: ls = ls_build_bitmap(v, n); break;
+        default: ls = ls_build_roaring(v, n); break;
+    }
+    return ls_intern(ls, n, v[0], v[n - 1]);
+}
 
-namespace std {
-template<>
-class hash<set<uint32_t>> {
-  public:
-    size_t operator()(const set<uint32_t> &labels) const {
-        uint64_t result = 0;
-        for (uint32_t l : labels) {
-            result ^= l;
-            result = result << 11 | result >> 53;
+// A set from a bitmap whose bit 0 is label base_word * 64
+static LabelSetP ls_from_words(const uint64_t *w, uint32_t base_word, uint32_t nwords) {
+    uint32_t lo = 0, hi = nwords - 1;
+    while (lo < nwords && !w[lo]) lo++;
+    assert(lo < nwords);
+    while (!w[hi]) hi--;
+
+    uint64_t card = ls_popcount(w + lo, hi - lo + 1);
+    uint32_t min = (base_word + lo) * 64 + __builtin_ctzll(w[lo]);
+    uint32_t max = (base_word + hi) * 64 + 63 - __builtin_clzll(w[hi]);
+    if (ls_kind(card, min, max) == LS_BITMAP) {
+        LabelSet *ls = ls_alloc(LS_BITMAP, hi - lo + 1);
+        memcpy(ls->data, w + lo, (hi - lo + 1) * sizeof(uint64_t));
+        ls->n = hi - lo + 1;
+        return ls_intern(ls, card, min, max);
+    }
+    std::vector<uint32_t> v;
+    v.reserve(card);
+    ls_each_bit(w + lo, hi - lo + 1, (base_word + lo) * 64,
+            [&](uint32_t l) { v.push_back(l); return true; });
+    return ls_from_sorted(&v[0], v.size());
+}
+
+static void ls_cont_or(const LsContainer *c, const uint64_t *p, uint64_t *w) {
+    if (c->card > LS_CONT_ARRAY_MAX) {
+        ls_or_words(w, p, LS_CONT_WORDS);
+    } else {
+        const uint16_t *a = (const uint16_t *)p;
+        for (uint32_t k = 0; k < c->card; k++) {
+            w[a[k] >> 6] |= 1ULL << (a[k] & 63);
         }
-        return result;
     }
+}
+
+// OR ls into a bitmap of nwords words whose bit 0 is label base_word * 64.
+// The bitmap covers every label of ls.
+static void ls_or_into(LabelSetP ls, uint64_t *w, uint32_t base_word, uint32_t nwords) {
+    if (ls->kind == LS_BITMAP) {
+        ls_or_words(w + (ls->min >> 6) - base_word, ls->data, ls->n);
+    } else if (ls->kind == LS_ROARING) {
+        for (uint32_t i = 0; i < ls->n; i++) {
+            const LsContainer *c = &ls_conts(ls)[i];
+            const uint64_t *p = ls->data + c->offset;
+            int64_t off = (int64_t)(c->key << 10) - base_word;
+            if (c->card > LS_CONT_ARRAY_MAX) {
+                // only part of a bitmap container can fall in the span
+                int64_t k = std::max<int64_t>(0, -off);
+                int64_t end = std::min<int64_t>(LS_CONT_WORDS, nwords - off);
+                for (; k < end; k++) w[off + k] |= p[k];
+            } else {
+                ls_cont_or(c, p, w + off);
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < ls->n; i++) {
+            uint32_t l = ls_small(ls)[i];
+            w[(l >> 6) - base_word] |= 1ULL << (l & 63);
+        }
+    }
+}
+
+struct LsTmpCont {
+    uint32_t key;
+    uint32_t card;
+    std::vector<uint64_t> payload;
 };
 
+static void ls_cont_union(const LsContainer *ca, const uint64_t *pa,
+        const LsContainer *cb, const uint64_t *pb, LsTmpCont &r) {
+    r.key = ca->key;
+    if (ca->card > LS_CONT_ARRAY_MAX || cb->card > LS_CONT_ARRAY_MAX) {
+        r.payload.assign(LS_CONT_WORDS, 0);
+        ls_cont_or(ca, pa, &r.payload[0]);
+        ls_cont_or(cb, pb, &r.payload[0]);
+        r.card = ls_popcount(&r.payload[0], LS_CONT_WORDS);
+        return;
+    }
+    const uint16_t *a = (const uint16_t *)pa, *b = (const uint16_t *)pb;
+    std::vector<uint16_t> m;
+    m.reserve(ca->card + cb->card);
+    std::set_union(a, a + ca->card, b, b + cb->card, std::back_inserter(m));
+    r.card = m.size();
+    r.payload.assign(ls_cont_words(r.card), 0);
+    if (r.card > LS_CONT_ARRAY_MAX) {
+        for (uint16_t l : m) r.payload[l >> 6] |= 1ULL << (l & 63);
+    } else {
+        memcpy(&r.payload[0], &m[0], r.card * sizeof(uint16_t));
+    }
+}
+
+// Union container by container, when at least one side is roaring
+static LabelSetP ls_union_roaring(LabelSetP a, LabelSetP b) {
+    LabelSet *tmp_a = NULL, *tmp_b = NULL;
+    if (a->kind != LS_ROARING) {
+        std::vector<uint32_t> v;
+        ls_to_vector(a, v);
+        a = tmp_a = ls_build_roaring(&v[0], v.size());
+    }
+    if (b->kind != LS_ROARING) {
+        std::vector<uint32_t> v;
+        ls_to_vector(b, v);
+        b = tmp_b = ls_build_roaring(&v[0], v.size());
+    }
+
+    std::vector<LsTmpCont> out;
+    out.reserve(a->n + b->n);
+    uint32_t i = 0, j = 0;
+    while (i < a->n || j < b->n) {
+        const LsContainer *ca = i < a->n ? &ls_conts(a)[i] : NULL;
+        const LsContainer *cb = j < b->n ? &ls_conts(b)[j] : NULL;
+        out.push_back(LsTmpCont());
+        LsTmpCont &r = out.back();
+        if (ca && cb && ca->key == cb->key) {
+            ls_cont_union(ca, a->data + ca->offset, cb, b->data + cb->offset, r);
+            i++, j++;
+        } else {
+            const LsContainer *c;
+            const uint64_t *p;
+            if (!cb || (ca && ca->key < cb->key)) {
+                c = ca, p = a->data + ca->offset, i++;
+            } else {
+                c = cb, p = b->data + cb->offset, j++;
+            }
+            r.key = c->key;
+            r.card = c->card;
+            r.payload.assign(p, p + ls_cont_words(c->card));
+        }
+    }
+    free(tmp_a);
+    free(tmp_b);
+
+    uint64_t card = 0, payload = 0;
+    for (auto &r : out) {
+        card += r.card;
+        payload += r.payload.size();
+    }
+    LsTmpCont &first = out.front(), &last = out.back();
+    uint32_t min, max;
+    if (first.card > LS_CONT_ARRAY_MAX) {
+        uint32_t k = 0;
+        while (!first.payload[k]) k++;
+        min = (first.key << 16) + k * 64 + __builtin_ctzll(first.payload[k]);
+    } else {
+        min = (first.key << 16) | ((const uint16_t *)&first.payload[0])[0];
+    }
+    if (last.card > LS_CONT_ARRAY_MAX) {
+        uint32_t k = LS_CONT_WORDS - 1;
+        while (!last.payload[k]) k--;
+        max = (last.key << 16) + k * 64 + 63 - __builtin_clzll(last.payload[k]);
+    } else {
+        max = (last.key << 16) | ((const uint16_t *)&last.payload[0])[last.card - 1];
+    }
+
+    if (ls_kind(card, min, max) != LS_ROARING) {
+        // dense enough now to be a bitmap
+        uint32_t base = min >> 6;
+        std::vector<uint64_t> w((max >> 6) - base + 1);
+        for (auto &r : out) {
+            LsContainer c = { r.key, r.card, 0, 0 };
+            uint32_t off = r.key << 10;
+            if (r.card > LS_CONT_ARRAY_MAX) {
+                // only part of a bitmap container can fall in the span
+                for (uint32_t k = 0; k < LS_CONT_WORDS; k++) {
+                    if (r.payload[k]) w[off + k - base] |= r.payload[k];
+                }
+            } else {
+                ls_cont_or(&c, &r.payload[0], &w[0] + off - base);
+            }
+        }
+        return ls_from_words(&w[0], base, w.size());
+    }
+
+    LabelSet *ls = ls_alloc(LS_ROARING, 2 * out.size() + payload);
+    LsContainer *c = (LsContainer *)ls->data;
+    uint32_t off = 2 * out.size();
+    for (auto &r : out) {
+        c->key = r.key;
+        c->card = r.card;
+        c->offset = off;
+        memcpy(ls->data + off, &r.payload[0], r.payload.size() * sizeof(uint64_t));
+        off += r.payload.size();
+        c++;
+    }
+    ls->n = out.size();
+    return ls_intern(ls, card, min, max);
+}
+
+static LabelSetP ls_union(LabelSetP a, LabelSetP b) {
+    uint32_t lo = std::min(a->min, b->min) >> 6;
+    uint32_t hi = std::max(a->max, b->max) >> 6;
+    uint64_t words = hi - lo + 1;
+    if (words <= LS_BITMAP_MAX_WORDS && words * 2 <= (uint64_t)a->card + b->card) {
+        // the result may well be a bitmap, so build it as one
+        std::vector<uint64_t> w(words);
+        ls_or_into(a, &w[0], lo, words);
+        ls_or_into(b, &w[0], lo, words);
+        return ls_from_words(&w[0], lo, words);
+    }
+    if (a->kind == LS_ROARING || b->kind == LS_ROARING) {
+        return ls_union_roaring(a, b);
+    }
+    std::vector<uint32_t> va, vb, v;
+    ls_to_vector(a, va);
+    ls_to_vector(b, vb);
+    v.reserve(va.size() + vb.size());
+    std::set_union(va.begin(), va.end(), vb.begin(), vb.end(), std::back_inserter(v));
+    return ls_from_sorted(&v[0], v.size());
+}
+
+namespace std {
 template<>
 class hash<pair<LabelSetP, LabelSetP>> {
   public:
@@ -88,35 +472,38 @@ class hash<pair<LabelSetP, LabelSetP>> {
 };
 }
 
-static std::unordered_set<std::set<uint32_t>> label_sets;
-LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
-    static std::unordered_map<std::pair<LabelSetP, LabelSetP>, LabelSetP> memoized_unions;
+// Unions are cached by pair of operands, evicting the least recently used
+typedef std::pair<LabelSetP, LabelSetP> LsPair;
+typedef std::list<std::pair<LsPair, LabelSetP>> LsLru;
+static LsLru union_lru;
+static std::unordered_map<LsPair, LsLru::iterator> union_cache;
+static size_t union_cache_max = LS_UNION_CACHE_DEFAULT;
+static uint64_t union_hits, union_misses;
 
+LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
     if (ls1 == ls2) {
         return ls1;
     } else if (ls1 && ls2) {
         LabelSetP min = std::min(ls1, ls2);
         LabelSetP max = std::max(ls1, ls2);
-        std::pair<LabelSetP, LabelSetP> minmax(min, max);
-
-        {
-            auto it = memoized_unions.find(minmax);
-            if (it != memoized_unions.end()) {
-                return it->second;
-            }
-        }
+        LsPair minmax(min, max);
 
-        std::set<uint32_t> temp(*min);
-        for (auto l : *max) {
-            temp.insert(l);
+        auto it = union_cache.find(minmax);
+        if (it != union_cache.end()) {
+            union_hits++;
+            union_lru.splice(union_lru.begin(), union_lru, it->second);
+            return it->second->second;
         }
+        union_misses++;
 
-        // insert returns a pair <iterator, bool>; second is whether it happened
-        // first is iterator to new/existing element
-        auto it = label_sets.insert(temp).first;
-        const std::set<uint32_t> *result = &(*it);
+        LabelSetP result = ls_union(min, max);
 
-        memoized_unions.insert(std::make_pair(minmax, result));
+        if (union_cache.size() >= union_cache_max && !union_lru.empty()) {
+            union_cache.erase(union_lru.back().first);
+            union_lru.pop_back();
+        }
+        union_lru.push_front(std::make_pair(minmax, result));
+        union_cache[minmax] = union_lru.begin();
         return result;
     } else if (ls1) {
         return ls1;
@@ -126,12 +513,129 @@ LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
 }
 
 LabelSetP label_set_singleton(uint32_t label) {
-    std::set<uint32_t> temp;
-    temp.insert(label);
-    return LSA.alloc(temp);
+    return ls_from_sorted(&label, 1);
+}
+
+uint32_t label_set_card(LabelSetP ls) {
+    return ls ? ls->card : 0;
+}
+
+bool label_set_contains(LabelSetP ls, uint32_t label) {
+    if (!ls || label < ls->min || label > ls->max) return false;
+    if (ls->kind == LS_SMALL) {
+        return std::binary_search(ls_small(ls), ls_small(ls) + ls->n, label);
+    } else if (ls->kind == LS_BITMAP) {
+        uint32_t bit = label - (ls->min & ~63U);
+        return (ls->data[bit >> 6] >> (bit & 63)) & 1;
+    }
+    const LsContainer *c = ls_conts(ls), *end = c + ls->n;
+    c = std::lower_bound(c, end, label >> 16,
+            [](const LsContainer &x, uint32_t key) { return x.key < key; });
+    if (c == end || c->key != label >> 16) return false;
+    const uint64_t *p = ls->data + c->offset;
+    uint16_t low = label & 0xffff;
+    if (c->card > LS_CONT_ARRAY_MAX) return (p[low >> 6] >> (low & 63)) & 1;
+    const uint16_t *a = (const uint16_t *)p;
+    return std::binary_search(a, a + c->card, low);
+}
+
+void label_set_iter(LabelSetP ls, int (*app)(uint32_t, void *), void *user) {
+    if (!ls) return;
+    ls_each(ls, [&](uint32_t l) { return app(l, user) == 0; });
 }
 
 std::set<uint32_t> label_set_render_set(LabelSetP ls) {
-    if (ls) return *ls;
-    else return std::set<uint32_t>();
+    std::set<uint32_t> result;
+    if (ls) {
+        ls_each(ls, [&](uint32_t l) { result.insert(result.end(), l); return true; });
+    }
+    return result;
+}
+
+void label_set_cache_size(size_t entries) {
+    union_cache_max = entries;
+    while (union_cache.size() > union_cache_max) {
+        union_cache.erase(union_lru.back().first);
+        union_lru.pop_back();
+    }
+}
+
+// Mark and sweep.  The shadow holds the only references to label sets that
+// last past a basic block, so between blocks a set the shadow doesn't point
+// to can be freed, along with any cached union that mentions it.  Marking
+// stamps sets with the current epoch, so nothing has to be cleared first.
+// Sets whose pointers were handed out for good (label_set_gc_root) are
+// never freed.
+static uint32_t gc_epoch;
+static std::unordered_set<LabelSetP> gc_roots;
+static uint64_t gc_min_bytes = LS_GC_DEFAULT;
+static uint64_t gc_next_bytes = LS_GC_DEFAULT;
+static uint64_t gc_runs, gc_freed_bytes;
+
+static inline bool ls_live(LabelSetP ls) {
+    return ls->epoch == gc_epoch;
+}
+
+void label_set_gc_threshold(uint64_t bytes) {
+    gc_min_bytes = gc_next_bytes = bytes;
+}
+
+bool label_set_gc_due(void) {
+    return gc_min_bytes && label_set_bytes >= gc_next_bytes;
+}
+
+void label_set_gc_begin(void) {
+    gc_epoch++;
+}
+
+void label_set_mark(LabelSetP ls) {
+    if (ls) const_cast<LabelSet *>(ls)->epoch = gc_epoch;
+}
+
+void label_set_gc_root(LabelSetP ls) {
+    if (ls) gc_roots.insert(ls);
+}
+
+void label_set_gc_unroot(LabelSetP ls) {
+    gc_roots.erase(ls);
+}
+
+uint64_t label_set_gc_sweep(void) {
+    for (LabelSetP ls : gc_roots) label_set_mark(ls);
+
+    for (auto it = union_lru.begin(); it != union_lru.end();) {
+        if (ls_live(it->first.first) && ls_live(it->first.second) && ls_live(it->second)) {
+            ++it;
+        } else {
+            union_cache.erase(it->first);
+            it = union_lru.erase(it);
+        }
+    }
+
+    uint64_t freed = 0;
+    for (auto it = label_sets.begin(); it != label_sets.end();) {
+        LabelSet *ls = *it;
+        if (ls_live(ls)) {
+            ++it;
+        } else {
+            freed += ls_bytes(ls);
+            it = label_sets.erase(it);
+            free(ls);
+        }
+    }
+    label_set_bytes -= freed;
+    gc_next_bytes = std::max(gc_min_bytes, 2 * label_set_bytes);
+    gc_runs++;
+    gc_freed_bytes += freed;
+    return freed;
+}
+
+void label_set_print_stats(void) {
+    printf("taint2: %zu label sets, %lu bytes; union cache %zu entries, %lu hits, %lu misses.\n",
+            label_sets.size(), (unsigned long)label_set_bytes, union_cache.size(),
+            (unsigned long)union_hits, (unsigned long)union_misses);
+    if (gc_runs) {
+        printf("taint2: label set gc ran %lu times, freed %lu bytes.\n",
+                (unsigned long)gc_runs, (unsigned long)gc_freed_bytes);
+    }
 }
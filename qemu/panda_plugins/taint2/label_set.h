@@ -27,13 +27,34 @@ extern "C" {
 #include <set>
 
 extern "C" {
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2);
 LabelSetP label_set_singleton(uint32_t label);
 }
 
-void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user);
+uint32_t label_set_card(LabelSetP ls);
+bool label_set_contains(LabelSetP ls, uint32_t label);
+// Calls app on each label in ascending order, until it returns nonzero
+void label_set_iter(LabelSetP ls, int (*app)(uint32_t, void *), void *user);
 std::set<uint32_t> label_set_render_set(LabelSetP ls);
 
+// Most unions to keep memoized; the least recently used go first
+void label_set_cache_size(size_t entries);
+void label_set_print_stats(void);
+
+// Garbage collection: begin, mark every set still in use, then sweep to
+// free the rest.  Returns the bytes freed.  Only safe between blocks.
+// label_set_gc_due says when label sets have grown past the threshold
+// (0 turns gc off), or twice what was live after the last sweep.
+void label_set_gc_threshold(uint64_t bytes);
+bool label_set_gc_due(void);
+void label_set_gc_begin(void);
+void label_set_mark(LabelSetP ls);
+// Keep ls for good, e.g. when its pointer has been written out as its name
+void label_set_gc_root(LabelSetP ls);
+// Let a sweep free ls again, e.g. when shutting down
+void label_set_gc_unroot(LabelSetP ls);
+uint64_t label_set_gc_sweep(void);
+
 #endif
@@ -35,6 +35,7 @@ PANDAENDCOMMENT */
 #include "fast_shad.h"
 #include "llvm_taint_lib.h"
 #include "taint_ops.h"
+#include "taint_replay.h"
 #include "guestarch.h"
 #include "taint2.h"
 
@@ -86,6 +87,8 @@ static inline Constant *const_struct_ptr(LLVMContext &C, Type *ptrT, void *ptr)
 }
 
 static void taint_branch_run(FastShad *shad, uint64_t src) {
+    // Callbacks look at the shadow, which has to be caught up first
+    if (taint_decoupled && ppp_on_branch2_num_cb > 0) taint_replay_sync();
     // this arg should be the register number
     Addr a = make_laddr(src / MAXREGSIZE, 0);
     PPP_RUN_CB(on_branch2, a);
@@ -178,21 +181,27 @@ bool PandaTaintFunctionPass::doInitialization(Module &M) {
 #define ADD_MAPPING(func) \
     EE->addGlobalMapping(M.getFunction(#func), (void *)(func));\
     M.getFunction(#func)->deleteBody();
-    ADD_MAPPING(taint_delete);
-    ADD_MAPPING(taint_mix);
-    ADD_MAPPING(taint_pointer);
-    ADD_MAPPING(taint_mix_compute);
-    ADD_MAPPING(taint_parallel_compute);
-    ADD_MAPPING(taint_copy);
-    ADD_MAPPING(taint_sext);
-    ADD_MAPPING(taint_select);
-    ADD_MAPPING(taint_host_copy);
-    ADD_MAPPING(taint_host_memcpy);
-    ADD_MAPPING(taint_host_delete);
-
-    ADD_MAPPING(taint_push_frame);
-    ADD_MAPPING(taint_pop_frame);
-    ADD_MAPPING(taint_reset_frame);
+    // Decoupled, the ops that touch the shadow are logged for the replay
+    // thread instead.
+#define ADD_LOGGED_MAPPING(func) \
+    EE->addGlobalMapping(M.getFunction(#func), \
+            taint_decoupled ? (void *)(func##_log) : (void *)(func));\
+    M.getFunction(#func)->deleteBody();
+    ADD_LOGGED_MAPPING(taint_delete);
+    ADD_LOGGED_MAPPING(taint_mix);
+    ADD_LOGGED_MAPPING(taint_pointer);
+    ADD_LOGGED_MAPPING(taint_mix_compute);
+    ADD_LOGGED_MAPPING(taint_parallel_compute);
+    ADD_LOGGED_MAPPING(taint_copy);
+    ADD_LOGGED_MAPPING(taint_sext);
+    ADD_LOGGED_MAPPING(taint_select);
+    ADD_LOGGED_MAPPING(taint_host_copy);
+    ADD_LOGGED_MAPPING(taint_host_memcpy);
+    ADD_LOGGED_MAPPING(taint_host_delete);
+
+    ADD_LOGGED_MAPPING(taint_push_frame);
+    ADD_LOGGED_MAPPING(taint_pop_frame);
+    ADD_LOGGED_MAPPING(taint_reset_frame);
     ADD_MAPPING(taint_breadcrumb);
 
     ADD_MAPPING(taint_memlog_pop);
@@ -200,6 +209,7 @@ bool PandaTaintFunctionPass::doInitialization(Module &M) {
     //ADD_MAPPING(label_set_union);
     //ADD_MAPPING(label_set_singleton);
 #undef ADD_MAPPING
+#undef ADD_LOGGED_MAPPING
 
     std::cout << "taint2: Done initializing taint transformation." << std::endl;
 
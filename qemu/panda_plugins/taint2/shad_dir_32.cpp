@@ -48,7 +48,7 @@ PANDAENDCOMMENT */
 #include "my_bool.h"
 #include "shad_dir_32.h"
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 // create a new table
 static SdTable *__shad_dir_table_new_32(SdDir32 *shad_dir) {
@@ -30,7 +30,7 @@ PANDAENDCOMMENT */
 #include "my_bool.h"
 #include "shad_dir_64.h"
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 
 // 64-bit addresses
 // create a new table
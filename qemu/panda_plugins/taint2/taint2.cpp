@@ -29,6 +29,8 @@
 
 #include "label_set.h"
 
+#include <unordered_map>
+#include <unordered_set>
 
 #include "../common/prog_point.h"
 
@@ -106,6 +108,7 @@ void taint2_track_taint_state(void);
 #include "llvm_taint_lib.h"
 #include "fast_shad.h"
 #include "taint_ops.h"
+#include "taint_replay.h"
 #include "taint2.h"
 
 #define PANDA_LAVA
@@ -128,6 +131,7 @@ bool before_block_exec_invalidate_opt(CPUState *env, TranslationBlock *tb);
 int before_block_exec(CPUState *env, TranslationBlock *tb);
 int after_block_exec(CPUState *env, TranslationBlock *tb,
     TranslationBlock *next_tb);
+bool before_block_exec_llvm(CPUState *env, TranslationBlock *tb);
 //int cb_cpu_restore_state(CPUState *env, TranslationBlock *tb);
 int guest_hypercall_callback(CPUState *env);
 
@@ -172,6 +176,30 @@ static TaintLabelMode mode;
 bool optimize_llvm = true;
 extern bool inline_taint;
 
+// Hybrid execution: while no register holds taint, blocks run their plain
+// TCG code, since their taint ops could only copy clean data around.  A
+// read of tainted RAM would change that, so it restarts its instruction,
+// which then runs with taint ops; a write just clears the taint of what
+// it overwrites.
+static bool hybrid = false;
+static bool tcg_block = false;      // the block running now is TCG code
+static bool need_llvm = false;      // the next one has to have taint ops
+static target_ulong tcg_block_pc;
+// Blocks that read taint run with taint ops for their next HYBRID_STICKY
+// runs instead of restarting each time
+#define HYBRID_STICKY 64
+static std::unordered_map<target_ulong, uint32_t> taint_pcs;
+static uint64_t hybrid_tcg_blocks, hybrid_llvm_blocks, hybrid_restarts;
+// Blocks that call helpers doing their own loads and stores (cmpxchg8b,
+// fxrstor, iret, ...).  The TCG versions of those go through the plain
+// softmmu functions, which make no memory callbacks, so these blocks
+// always run with taint ops.
+static std::unordered_set<TranslationBlock *> mem_helper_tbs;
+static std::unordered_map<llvm::Function *, bool> helper_mem;
+
+// Replay taint ops on a thread of their own (taint_replay.h)
+static bool decouple = false;
+
 
 /*
  * These memory callbacks are only for whole-system mode.  User-mode memory
@@ -182,6 +210,12 @@ int phys_mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
     /*if (size == 4) {
         printf("pmem: " TARGET_FMT_lx "\n", addr);
     }*/
+    if (tcg_block) {
+        if (addr + size <= shadow->ram->get_size()) {
+            shadow->ram->remove(addr, size);
+        }
+        return 0;
+    }
     taint_memlog_push(&taint_memlog, addr);
     return 0;
 }
@@ -191,10 +225,83 @@ int phys_mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
     /*if (size == 4) {
         printf("pmem: " TARGET_FMT_lx "\n", addr);
     }*/
+    if (tcg_block) {
+        // Only RAM is ever restarted; reading I/O again would repeat it
+        if (addr + size <= shadow->ram->get_size() &&
+                shadow->ram->range_tainted(addr, size)) {
+            tcg_block = false;
+            need_llvm = true;
+            taint_pcs[tcg_block_pc] = HYBRID_STICKY;
+            hybrid_restarts++;
+            panda_restart_insn(env);
+        }
+        return 0;
+    }
     taint_memlog_push(&taint_memlog, addr);
     return 0;
 }
 
+static bool is_mmu_fn(llvm::Function *F) {
+    llvm::StringRef name = F->getName();
+    return (name.startswith("__ld") || name.startswith("__st")) &&
+        (name.endswith("_mmu") || name.endswith("_mmu_panda"));
+}
+
+// Whether calling F can load or store guest memory
+static bool touches_memory(llvm::Function *F) {
+    auto it = helper_mem.find(F);
+    if (it != helper_mem.end()) return it->second;
+    bool mem = is_mmu_fn(F);
+    // in case F ends up calling itself
+    helper_mem[F] = mem;
+    for (auto &BB : *F) {
+        for (auto &I : BB) {
+            llvm::CallInst *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            if (mem) break;
+            if (CI && CI->getCalledFunction()) {
+                mem = touches_memory(CI->getCalledFunction());
+            }
+        }
+    }
+    helper_mem[F] = mem;
+    return mem;
+}
+
+// Whether a block calls a helper that touches guest memory.  The block's
+// own loads and stores make memory callbacks as TCG code too.
+static bool calls_mem_helper(llvm::Function *tbf) {
+    for (auto &BB : *tbf) {
+        for (auto &I : BB) {
+            llvm::CallInst *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+            llvm::Function *F = CI ? CI->getCalledFunction() : NULL;
+            if (F && !is_mmu_fn(F) && touches_memory(F)) return true;
+        }
+    }
+    return false;
+}
+
+// Pick TCG or LLVM code for the next block, in hybrid mode
+bool before_block_exec_llvm(CPUState *env, TranslationBlock *tb) {
+    bool llvm = need_llvm || !shadow->grv->clean() || !shadow->gsv->clean() ||
+        mem_helper_tbs.count(tb);
+    if (!llvm && !taint_pcs.empty()) {
+        auto it = taint_pcs.find(tb->pc);
+        if (it != taint_pcs.end()) {
+            llvm = true;
+            if (--it->second == 0) taint_pcs.erase(it);
+        }
+    }
+    need_llvm = false;
+    tcg_block = !llvm;
+    if (llvm) {
+        hybrid_llvm_blocks++;
+    } else {
+        tcg_block_pc = tb->pc;
+        hybrid_tcg_blocks++;
+    }
+    return llvm;
+}
+
 void verify(void) {
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     std::string err;
@@ -221,6 +328,10 @@ void __taint2_enable_taint(void) {
     panda_register_callback(plugin_ptr, PANDA_CB_PHYS_MEM_READ, pcb);
     pcb.phys_mem_write = phys_mem_write_callback;
     panda_register_callback(plugin_ptr, PANDA_CB_PHYS_MEM_WRITE, pcb);
+    if (hybrid) {
+        pcb.before_block_exec_llvm = before_block_exec_llvm;
+        panda_register_callback(plugin_ptr, PANDA_CB_BEFORE_BLOCK_EXEC_LLVM, pcb);
+    }
 /*
     pcb.cb_cpu_restore_state = cb_cpu_restore_state;
     panda_register_callback(plugin_ptr, PANDA_CB_CPU_RESTORE_STATE, pcb);
@@ -252,6 +363,12 @@ void __taint2_enable_taint(void) {
     // Initialize memlog.
     memset(&taint_memlog, 0, sizeof(taint_memlog));
 
+    // Before the taint pass is set up, which maps the ops to their logging
+    // versions if so
+    if (decouple && !track_taint_state) {
+        taint_replay_init(shadow);
+    }
+
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     FPM = tcg_llvm_ctx->getFunctionPassManager();
 
@@ -295,6 +412,12 @@ int after_block_translate(CPUState *env, TranslationBlock *tb){
         // taintfp will make sure it never runs twice.
         //FPM->run(*(tb->llvm_function));
         //tb->llvm_function->dump();
+        // TBs are reused after a flush, so this also clears stale entries
+        if (hybrid && calls_mem_helper(tb->llvm_function)) {
+            mem_helper_tbs.insert(tb);
+        } else {
+            mem_helper_tbs.erase(tb);
+        }
     }
 
     return 0;
@@ -306,6 +429,8 @@ int after_block_exec(CPUState *env, TranslationBlock *tb,
 
     if (taintJustDisabled){
         taintJustDisabled = false;
+        tcg_block = false;
+        taint_replay_sync();
         execute_llvm = 0;
         generate_llvm = 0;
         panda_do_flush_tb();
@@ -314,6 +439,7 @@ int after_block_exec(CPUState *env, TranslationBlock *tb,
         return 0;
     }
 
+    taint_replay_flush(true);
     return 0;
 }
 
@@ -423,6 +549,7 @@ std::set < LabelSetP > ls_returned;
 // if anything is tainted returns 1, else returns 0
 // if there is taint, we write an entry to the pandalog. 
 uint8_t __taint2_query_pandalog (Addr a, uint32_t offset) {
+    taint_replay_sync();
     uint8_t saw_taint = 0;
     LabelSetP ls = tp_query(shadow, a);
     if (ls) {
@@ -433,6 +560,9 @@ uint8_t __taint2_query_pandalog (Addr a, uint32_t offset) {
             // write out mapping from ls pointer to labelset contents
             // as its own separate log entry
             ls_returned.insert(ls);
+            // The log names the set by its pointer, so it can't be freed
+            // and the pointer reused for another set.
+            label_set_gc_root(ls);
             Panda__TaintQueryUniqueLabelSet *tquls = (Panda__TaintQueryUniqueLabelSet *) malloc (sizeof (Panda__TaintQueryUniqueLabelSet));
             *tquls = PANDA__TAINT_QUERY_UNIQUE_LABEL_SET__INIT;
             tquls->ptr = (uint64_t) ls;
@@ -673,6 +803,7 @@ bool __taint2_enabled() {
 
 // label this phys addr in memory with this label
 void __taint2_label_ram(uint64_t pa, uint32_t l) {
+    taint_replay_sync();
     tp_label_ram(shadow, pa, l);
 }
 
@@ -726,6 +857,7 @@ void taint2_add_taint_ram_single_label(CPUState *env, uint64_t addr,
 }
 
 uint32_t __taint2_query(Addr a) {
+    taint_replay_sync();
     LabelSetP ls = tp_query(shadow, a);
     return ls_card(ls);
 }
@@ -733,17 +865,20 @@ uint32_t __taint2_query(Addr a) {
 // if phys addr pa is untainted, return 0.
 // else returns label set cardinality
 uint32_t __taint2_query_ram(uint64_t pa) {
+    taint_replay_sync();
     LabelSetP ls = tp_query_ram(shadow, pa);
     return ls_card(ls);
 }
 
 
 uint32_t __taint2_query_reg(int reg_num, int offset) {
+    taint_replay_sync();
     LabelSetP ls = tp_query_reg(shadow, reg_num, offset);
     return ls_card(ls);
 }
 
 uint32_t __taint2_query_llvm(int reg_num, int offset) {
+    taint_replay_sync();
     LabelSetP ls = tp_query_llvm(shadow, reg_num, offset);
     return ls_card(ls);
 }
@@ -751,18 +886,22 @@ uint32_t __taint2_query_llvm(int reg_num, int offset) {
 
 
 uint32_t __taint2_query_tcn(Addr a) {
+    taint_replay_sync();
     return tp_query_tcn(shadow, a);
 }
 
 uint32_t __taint2_query_tcn_ram(uint64_t pa) {
+    taint_replay_sync();
     return tp_query_tcn_ram(shadow, pa);
 }
 
 uint32_t __taint2_query_tcn_reg(int reg_num, int offset) {
+    taint_replay_sync();
     return tp_query_tcn_reg(shadow, reg_num, offset);
 }
 
 uint32_t __taint2_query_tcn_llvm(int reg_num, int offset) {
+    taint_replay_sync();
     return tp_query_tcn_llvm(shadow, reg_num, offset);
 }
 
@@ -779,14 +918,12 @@ uint32_t __taint2_num_labels_applied(void) {
 
 
 void __taint2_delete_ram(uint64_t pa) {
+    taint_replay_sync();
     tp_delete_ram(shadow, pa);
 }
 
 void __taint2_labelset_spit(LabelSetP ls) {
-    std::set<uint32_t> rendered(label_set_render_set(ls));
-    for (uint32_t l : rendered) {
-        printf("%u ", l);
-    }
+    label_set_iter(ls, [](uint32_t l, void *) { printf("%u ", l); return 0; }, NULL);
     printf("\n");
 }
 
@@ -798,20 +935,25 @@ void __taint2_labelset_iter(LabelSetP ls,  int (*app)(uint32_t el, void *stuff1)
 
 
 void __taint2_labelset_ram_iter(uint64_t pa, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_replay_sync();
     tp_ls_ram_iter(shadow, pa, app, stuff2);
 }
 
 
 void __taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_replay_sync();
     tp_ls_reg_iter(shadow, reg_num, offset, app, stuff2);
 }
 
 
 void __taint2_labelset_llvm_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    taint_replay_sync();
     tp_ls_llvm_iter(shadow, reg_num, offset, app, stuff2);
 }
 
 void __taint2_track_taint_state(void) {
+    // Changes have to be reported as they happen, on this thread
+    taint_replay_stop();
     track_taint_state = true;
 }
 
@@ -918,8 +1060,13 @@ void taint2_track_taint_state(void) {
 ////////////////////////////////////////////////////////////////////////////////////
 
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
-
-
+    // Nothing outside the shadow holds a label set between blocks
+    // (decoupled, the replay thread collects)
+    if (shadow && !taint_decoupled && label_set_gc_due()) {
+        uint64_t freed = tp_gc(shadow);
+        printf("taint2: label set gc at instr %" PRIu64 " freed %" PRIu64 " bytes.\n",
+                rr_get_guest_instr_count(), freed);
+    }
 
     return 0;
 }
@@ -985,10 +1132,27 @@ bool init_plugin(void *self) {
     if (panda_parse_bool(args, "binary")) mode = TAINT_BINARY_LABEL;
     if (panda_parse_bool(args, "word")) granularity = TAINT_GRANULARITY_WORD;
     optimize_llvm = panda_parse_bool(args, "opt");
+    label_set_cache_size(panda_parse_uint64(args, "union_cache", 1 << 20));
+    label_set_gc_threshold(panda_parse_uint64(args, "label_gc_mb", 256) << 20);
+    hybrid = panda_parse_bool(args, "hybrid");
+    if (hybrid) {
+        printf("taint2: Running blocks without taint ops while registers are clean.\n");
+    }
+    decouple = panda_parse_bool(args, "decouple");
+    if (decouple && hybrid) {
+        // Hybrid mode looks at the shadow on every block and memory access
+        printf("taint2: decouple doesn't work with hybrid; running taint ops inline.\n");
+        decouple = false;
+    }
 
     panda_require("callstack_instr");
     assert(init_callstack_instr_api());
 
+    // Normally taint is turned on by the first label
+    if (panda_parse_bool(args, "enable")) {
+        __taint2_enable_taint();
+    }
+
     return true;
 }
 
@@ -998,7 +1162,13 @@ void uninit_plugin(void *self) {
 
     printf ("uninit taint plugin\n");
 
+    if (hybrid) {
+        printf("taint2: hybrid: %" PRIu64 " blocks in TCG, %" PRIu64 " in LLVM, %" PRIu64 " restarts.\n",
+                hybrid_tcg_blocks, hybrid_llvm_blocks, hybrid_restarts);
+    }
+    taint_replay_free();
     if (shadow) tp_free(shadow);
+    label_set_print_stats();
 
     panda_disable_llvm();
     panda_disable_memcb();
@@ -30,7 +30,7 @@
 
 //#define TAINTDEBUG // print out all debugging info for taint ops
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const struct LabelSet *LabelSetP;
 typedef struct FastShad FastShad;
 typedef struct SdDir32 SdDir32;
 typedef struct SdDir64 SdDir64;
@@ -80,6 +80,9 @@ Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity);
 // Delete a shadow memory
 void tp_free(Shad *shad);
 
+// Free unreachable label sets; returns bytes freed.  Only between blocks.
+uint64_t tp_gc(Shad *shad);
+
 // label -- associate label l with address a
 void tp_label(Shad *shad, Addr *a, uint32_t l);
 
@@ -105,21 +105,22 @@ Shad *tp_init(TaintLabelMode mode, TaintGranularity granularity) {
 
     if (granularity == TAINT_GRANULARITY_BYTE) {
         printf("taint2: Creating byte-level taint processor\n");
-        shad->ram = new FastShad("RAM", ram_size);
+        shad->ram = new FastShad("RAM", ram_size, true);
         // we're working with LLVM values that can be up to 128 bits
         shad->llv = new FastShad("LLVM", MAXFRAMESIZE * FUNCTIONFRAMES * MAXREGSIZE);
         shad->ret = new FastShad("Ret", MAXREGSIZE);
         // guest registers are generally the size of the guest architecture
-        shad->grv = new FastShad("Reg", NUMREGS * WORDSIZE);
+        shad->grv = new FastShad("Reg", NUMREGS * WORDSIZE, true);
     } else {
         printf("taint2: Creating word-level taint processor\n");
-        shad->ram = new FastShad("RAM", ram_size / WORDSIZE);
+        shad->ram = new FastShad("RAM", ram_size / WORDSIZE, true);
         shad->llv = new FastShad("LLVM", MAXFRAMESIZE * FUNCTIONFRAMES);
         shad->ret = new FastShad("Ret", 1);
-        shad->grv = new FastShad("Reg", NUMREGS);
+        shad->grv = new FastShad("Reg", NUMREGS, true);
     }
 
-    shad->gsv = new FastShad("CPUState", sizeof(CPUState));
+    // Sparse, so it's cheap to tell whether any register holds taint
+    shad->gsv = new FastShad("CPUState", sizeof(CPUState), true);
 
     return shad;
 }
@@ -140,6 +141,33 @@ void tp_free(Shad *shad){
     free(shad);
 }
 
+static int tp_mark_aux_64(uint64_t addr, LabelSetP ls, void *stuff) {
+    label_set_mark(ls);
+    return 0;
+}
+
+static int tp_mark_aux_32(uint32_t addr, LabelSetP ls, void *stuff) {
+    label_set_mark(ls);
+    return 0;
+}
+
+/*
+ * Free label sets that nothing in the shadow refers to any more
+ */
+uint64_t tp_gc(Shad *shad) {
+    label_set_gc_begin();
+    shad->ram->mark_label_sets();
+    shad->llv->mark_label_sets();
+    shad->ret->mark_label_sets();
+    shad->grv->mark_label_sets();
+    shad->gsv->mark_label_sets();
+    shad_dir_iter_64(shad->hd, tp_mark_aux_64, NULL);
+    shad_dir_iter_64(shad->io, tp_mark_aux_64, NULL);
+    shad_dir_iter_32(shad->ports, tp_mark_aux_32, NULL);
+    return label_set_gc_sweep();
+}
+
+
 // returns a copy of the labelset associated with a.  or NULL if none.
 // so you'll need to call labelset_free on this pointer when done with it.
 LabelSetP tp_labelset_get(Shad *shad, Addr *a) {
@@ -255,7 +283,7 @@ uint32_t tp_query_tcn_llvm(Shad *shad, int reg_num, int offset) {
 
 
 uint32_t ls_card(LabelSetP ls) {
-    return label_set_render_set(ls).size();
+    return label_set_card(ls);
 }
 
 
@@ -270,8 +298,7 @@ void tp_lsr_iter(std::set<uint32_t> rendered, int (*app)(uint32_t el, void *stuf
     
 // retrieve ls for this addr
 void tp_ls_iter(LabelSetP ls, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
-    std::set<uint32_t> rendered = label_set_render_set(ls);
-    tp_lsr_iter(rendered, app, stuff2);
+    label_set_iter(ls, app, stuff2);
 }
 
 void tp_ls_a_iter(Shad *shad, Addr *a, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
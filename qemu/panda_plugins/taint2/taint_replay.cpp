@@ -0,0 +1,472 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+extern "C" {
+#include <stdio.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "cpu.h"
+#include "rr_log.h"
+#include "panda_work.h"
+}
+
+#include <vector>
+
+#include "fast_shad.h"
+#include "label_set.h"
+#include "taint_ops.h"
+#include "taint_replay.h"
+#include "taint2.h"
+
+bool taint_decoupled = false;
+
+enum TaintOpKind {
+    TOP_COPY,
+    TOP_PCOMPUTE,
+    TOP_MCOMPUTE,
+    TOP_DELETE,
+    TOP_SET,
+    TOP_MIX,
+    TOP_POINTER,
+    TOP_SEXT,
+    TOP_SELECT,
+    TOP_HOST_COPY,
+    TOP_HOST_MEMCPY,
+    TOP_HOST_DELETE,
+    TOP_RESET_FRAME,
+    TOP_PUSH_FRAME,
+    TOP_POP_FRAME,
+};
+
+// One logged op: which one, and its arguments in the order it takes them
+struct TaintOp {
+    uint64_t kind;
+    FastShad *shad[3];
+    uint64_t arg[6];
+};
+
+// What goes through the queue: a batch of ops, in order
+struct TaintBatch {
+    std::vector<TaintOp> *ops;
+    uint64_t instr;
+    bool block_end;
+};
+
+static Shad *replay_shad;
+static panda_work_queue *replay_queue;
+static std::vector<TaintOp> *cur_ops;
+// Batches the replay thread is done with, to be reused
+static std::vector<std::vector<TaintOp> *> spare_ops;
+
+static uint64_t ops_logged, syncs;
+
+static inline TaintOp *log_op(uint64_t kind) {
+    cur_ops->emplace_back();
+    TaintOp *op = &cur_ops->back();
+    op->kind = kind;
+    ops_logged++;
+    return op;
+}
+
+static void replay_batch(void *rec, void *opaque, unsigned worker) {
+    TaintBatch *b = (TaintBatch *)rec;
+    for (const TaintOp &op : *b->ops) {
+        const uint64_t *a = op.arg;
+        FastShad *const *s = op.shad;
+        switch (op.kind) {
+        case TOP_COPY:
+            taint_copy(s[0], a[0], s[1], a[1], a[2]);
+            break;
+        case TOP_PCOMPUTE:
+            taint_parallel_compute(s[0], a[0], a[1], a[2], a[3], a[4]);
+            break;
+        case TOP_MCOMPUTE:
+            taint_mix_compute(s[0], a[0], a[1], a[2], a[3], a[4]);
+            break;
+        case TOP_DELETE:
+            taint_delete(s[0], a[0], a[1]);
+            break;
+        case TOP_SET:
+            taint_set(s[0], a[0], a[1], s[1], a[2]);
+            break;
+        case TOP_MIX:
+            taint_mix(s[0], a[0], a[1], a[2], a[3]);
+            break;
+        case TOP_POINTER:
+            taint_pointer(s[0], a[0], s[1], a[1], a[2], s[2], a[3], a[4]);
+            break;
+        case TOP_SEXT:
+            taint_sext(s[0], a[0], a[1], a[2], a[3]);
+            break;
+        case TOP_SELECT:
+            FastShad::copy(s[0], a[0], s[0], a[1], a[2]);
+            break;
+        case TOP_HOST_COPY:
+            taint_host_copy(a[0], a[1], s[0], a[2], s[1], s[2], a[3], a[4], a[5]);
+            break;
+        case TOP_HOST_MEMCPY:
+            taint_host_memcpy(a[0], a[1], a[2], s[0], s[1], a[3], a[4]);
+            break;
+        case TOP_HOST_DELETE:
+            taint_host_delete(a[0], a[1], s[0], s[1], a[2], a[3]);
+            break;
+        case TOP_RESET_FRAME:
+            taint_reset_frame(s[0]);
+            break;
+        case TOP_PUSH_FRAME:
+            taint_push_frame(s[0]);
+            break;
+        case TOP_POP_FRAME:
+            taint_pop_frame(s[0]);
+            break;
+        default:
+            assert(false && "bad taint op");
+        }
+    }
+
+    // Label sets are only collected between blocks, same as when the ops
+    // run inline, and here it doesn't need the guest to stop.
+    if (b->block_end && label_set_gc_due()) {
+        uint64_t freed = tp_gc(replay_shad);
+        printf("taint2: label set gc at instr %" PRIu64 " freed %" PRIu64 " bytes.\n",
+                b->instr, freed);
+    }
+}
+
+static void replay_done(void *rec, void *opaque) {
+    TaintBatch *b = (TaintBatch *)rec;
+    b->ops->clear();
+    spare_ops.push_back(b->ops);
+}
+
+void taint_replay_init(Shad *shad) {
+    replay_shad = shad;
+    cur_ops = new std::vector<TaintOp>;
+    cur_ops->reserve(TAINT_REPLAY_BATCH);
+    replay_queue = panda_work_queue_new("taint2", sizeof(TaintBatch),
+            TAINT_REPLAY_QUEUE, 1, replay_batch, replay_done, NULL);
+    taint_decoupled = true;
+    printf("taint2: Replaying taint ops on their own thread.\n");
+}
+
+static void post_batch(bool block_end) {
+    TaintBatch b;
+    b.ops = cur_ops;
+    b.instr = rr_get_guest_instr_count();
+    b.block_end = block_end;
+    if (spare_ops.empty()) {
+        cur_ops = new std::vector<TaintOp>;
+        cur_ops->reserve(TAINT_REPLAY_BATCH);
+    } else {
+        cur_ops = spare_ops.back();
+        spare_ops.pop_back();
+    }
+    panda_work_post(replay_queue, &b);
+}
+
+void taint_replay_flush(bool block_end) {
+    if (!replay_queue || cur_ops->empty()) return;
+    // Small batches wait for the next block
+    if (block_end && cur_ops->size() < TAINT_REPLAY_BATCH) return;
+    post_batch(block_end);
+}
+
+void taint_replay_sync(void) {
+    if (!replay_queue) return;
+    syncs++;
+    if (!cur_ops->empty()) post_batch(false);
+    panda_work_drain(replay_queue);
+}
+
+void taint_replay_stop(void) {
+    if (!taint_decoupled) return;
+    taint_replay_sync();
+    taint_decoupled = false;
+    printf("taint2: Running taint ops inline from now on.\n");
+}
+
+void taint_replay_free(void) {
+    if (!replay_queue) return;
+    taint_replay_sync();
+    printf("taint2: replay: %" PRIu64 " ops logged, %" PRIu64 " syncs.\n",
+            ops_logged, syncs);
+    panda_work_queue_free(replay_queue);
+    replay_queue = NULL;
+    taint_decoupled = false;
+    for (auto ops : spare_ops) delete ops;
+    spare_ops.clear();
+    delete cur_ops;
+    cur_ops = NULL;
+}
+
+// Logging versions of the taint ops
+
+void taint_copy_log(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size) {
+    if (!taint_decoupled) {
+        taint_copy(shad_dest, dest, shad_src, src, size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_COPY);
+    op->shad[0] = shad_dest;
+    op->shad[1] = shad_src;
+    op->arg[0] = dest;
+    op->arg[1] = src;
+    op->arg[2] = size;
+}
+
+void taint_parallel_compute_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t ignored,
+        uint64_t src1, uint64_t src2, uint64_t src_size) {
+    if (!taint_decoupled) {
+        taint_parallel_compute(shad, dest, ignored, src1, src2, src_size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_PCOMPUTE);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = ignored;
+    op->arg[2] = src1;
+    op->arg[3] = src2;
+    op->arg[4] = src_size;
+}
+
+void taint_mix_compute_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src1, uint64_t src2, uint64_t src_size) {
+    if (!taint_decoupled) {
+        taint_mix_compute(shad, dest, dest_size, src1, src2, src_size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_MCOMPUTE);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = dest_size;
+    op->arg[2] = src1;
+    op->arg[3] = src2;
+    op->arg[4] = src_size;
+}
+
+void taint_delete_log(FastShad *shad, uint64_t dest, uint64_t size) {
+    if (!taint_decoupled) {
+        taint_delete(shad, dest, size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_DELETE);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = size;
+}
+
+void taint_set_log(
+        FastShad *shad_dest, uint64_t dest, uint64_t dest_size,
+        FastShad *shad_src, uint64_t src) {
+    if (!taint_decoupled) {
+        taint_set(shad_dest, dest, dest_size, shad_src, src);
+        return;
+    }
+    TaintOp *op = log_op(TOP_SET);
+    op->shad[0] = shad_dest;
+    op->shad[1] = shad_src;
+    op->arg[0] = dest;
+    op->arg[1] = dest_size;
+    op->arg[2] = src;
+}
+
+void taint_mix_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size) {
+    if (!taint_decoupled) {
+        taint_mix(shad, dest, dest_size, src, src_size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_MIX);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = dest_size;
+    op->arg[2] = src;
+    op->arg[3] = src_size;
+}
+
+void taint_pointer_log(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_ptr, uint64_t ptr, uint64_t ptr_size,
+        FastShad *shad_src, uint64_t src, uint64_t size) {
+    if (!taint_decoupled) {
+        taint_pointer(shad_dest, dest, shad_ptr, ptr, ptr_size,
+                shad_src, src, size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_POINTER);
+    op->shad[0] = shad_dest;
+    op->shad[1] = shad_ptr;
+    op->shad[2] = shad_src;
+    op->arg[0] = dest;
+    op->arg[1] = ptr;
+    op->arg[2] = ptr_size;
+    op->arg[3] = src;
+    op->arg[4] = size;
+}
+
+void taint_sext_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size) {
+    if (!taint_decoupled) {
+        taint_sext(shad, dest, dest_size, src, src_size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_SEXT);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = dest_size;
+    op->arg[2] = src;
+    op->arg[3] = src_size;
+}
+
+// The selector is only known here, so pick the source now and log the
+// copy it turns into.  Same (~0UL, ~0UL)-terminated list as taint_select.
+void taint_select_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t size, uint64_t selector,
+        ...) {
+    const uint64_t ones = ~0UL;
+    va_list argp;
+    uint64_t src, srcsel;
+
+    va_start(argp, selector);
+    src = va_arg(argp, uint64_t);
+    srcsel = va_arg(argp, uint64_t);
+    while (!(src == ones && srcsel == ones)) {
+        if (srcsel == selector) break;
+        src = va_arg(argp, uint64_t);
+        srcsel = va_arg(argp, uint64_t);
+    }
+    va_end(argp);
+
+    if (srcsel != selector) {
+        tassert(false && "Couldn't find selected argument!!");
+        return;
+    }
+    if (src == ones) return; // a constant
+
+    if (!taint_decoupled) {
+        FastShad::copy(shad, dest, shad, src, size);
+        return;
+    }
+    TaintOp *op = log_op(TOP_SELECT);
+    op->shad[0] = shad;
+    op->arg[0] = dest;
+    op->arg[1] = src;
+    op->arg[2] = size;
+}
+
+void taint_host_copy_log(
+        uint64_t env_ptr, uint64_t addr,
+        FastShad *llv, uint64_t llv_offset,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg, bool is_store) {
+    // Most loads and stores from CPUState don't matter; don't log those.
+    if (is_irrelevant(addr - env_ptr)) return;
+    if (!taint_decoupled) {
+        taint_host_copy(env_ptr, addr, llv, llv_offset, greg, gspec,
+                size, labels_per_reg, is_store);
+        return;
+    }
+    TaintOp *op = log_op(TOP_HOST_COPY);
+    op->shad[0] = llv;
+    op->shad[1] = greg;
+    op->shad[2] = gspec;
+    op->arg[0] = env_ptr;
+    op->arg[1] = addr;
+    op->arg[2] = llv_offset;
+    op->arg[3] = size;
+    op->arg[4] = labels_per_reg;
+    op->arg[5] = is_store;
+}
+
+void taint_host_memcpy_log(
+        uint64_t env_ptr, uint64_t dest, uint64_t src,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg) {
+    if (!taint_decoupled) {
+        taint_host_memcpy(env_ptr, dest, src, greg, gspec,
+                size, labels_per_reg);
+        return;
+    }
+    TaintOp *op = log_op(TOP_HOST_MEMCPY);
+    op->shad[0] = greg;
+    op->shad[1] = gspec;
+    op->arg[0] = env_ptr;
+    op->arg[1] = dest;
+    op->arg[2] = src;
+    op->arg[3] = size;
+    op->arg[4] = labels_per_reg;
+}
+
+void taint_host_delete_log(
+        uint64_t env_ptr, uint64_t dest_addr,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg) {
+    if (!taint_decoupled) {
+        taint_host_delete(env_ptr, dest_addr, greg, gspec,
+                size, labels_per_reg);
+        return;
+    }
+    TaintOp *op = log_op(TOP_HOST_DELETE);
+    op->shad[0] = greg;
+    op->shad[1] = gspec;
+    op->arg[0] = env_ptr;
+    op->arg[1] = dest_addr;
+    op->arg[2] = size;
+    op->arg[3] = labels_per_reg;
+}
+
+// Frames move the llv shadow's label pointer, so they go through the log
+// too, in order with the ops that use them.
+
+void taint_reset_frame_log(FastShad *shad) {
+    if (!taint_decoupled) {
+        taint_reset_frame(shad);
+        return;
+    }
+    log_op(TOP_RESET_FRAME)->shad[0] = shad;
+}
+
+void taint_push_frame_log(FastShad *shad) {
+    if (!taint_decoupled) {
+        taint_push_frame(shad);
+        return;
+    }
+    log_op(TOP_PUSH_FRAME)->shad[0] = shad;
+}
+
+void taint_pop_frame_log(FastShad *shad) {
+    if (!taint_decoupled) {
+        taint_pop_frame(shad);
+        return;
+    }
+    log_op(TOP_POP_FRAME)->shad[0] = shad;
+}
@@ -0,0 +1,106 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __TAINT_REPLAY_H_
+#define __TAINT_REPLAY_H_
+
+#include <cstdint>
+
+class FastShad;
+struct shad_struct;
+
+// Decoupled taint propagation
+//
+// With decouple=1 the JIT'd code doesn't run taint ops itself.  Each op is
+// logged with its operands, which are already resolved by then (addresses
+// popped from the memlog, the selector of a select), and batches of ops are
+// replayed against the shadow by a thread of their own, so guest execution
+// and taint propagation overlap.  The replay thread owns the shadow and the
+// label sets while it runs; anything else that looks at them has to call
+// taint_replay_sync() first.
+
+// Ops logged before a batch is handed to the replay thread at the end of a
+// block, and how many batches can be in flight.
+#define TAINT_REPLAY_BATCH 4096
+#define TAINT_REPLAY_QUEUE 256
+
+extern "C" {
+
+// Set while ops are being logged rather than run
+extern bool taint_decoupled;
+
+void taint_replay_init(struct shad_struct *shad);
+// Hand the ops logged so far to the replay thread.  block_end is set at
+// the end of a block, when label sets may be collected.
+void taint_replay_flush(bool block_end);
+// Wait until every op logged so far has been replayed
+void taint_replay_sync(void);
+// Sync and go back to running ops inline
+void taint_replay_stop(void);
+void taint_replay_free(void);
+
+// Logging versions of the taint ops, which the JIT calls instead of the
+// ones in taint_ops.h.  They run the op right away when not decoupled.
+void taint_copy_log(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_src, uint64_t src,
+        uint64_t size);
+void taint_parallel_compute_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t ignored,
+        uint64_t src1, uint64_t src2, uint64_t src_size);
+void taint_mix_compute_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src1, uint64_t src2, uint64_t src_size);
+void taint_delete_log(FastShad *shad, uint64_t dest, uint64_t size);
+void taint_set_log(
+        FastShad *shad_dest, uint64_t dest, uint64_t dest_size,
+        FastShad *shad_src, uint64_t src);
+void taint_mix_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size);
+void taint_pointer_log(
+        FastShad *shad_dest, uint64_t dest,
+        FastShad *shad_ptr, uint64_t ptr, uint64_t ptr_size,
+        FastShad *shad_src, uint64_t src, uint64_t size);
+void taint_sext_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t dest_size,
+        uint64_t src, uint64_t src_size);
+void taint_select_log(
+        FastShad *shad,
+        uint64_t dest, uint64_t size, uint64_t selector,
+        ...);
+void taint_host_copy_log(
+        uint64_t env_ptr, uint64_t addr,
+        FastShad *llv, uint64_t llv_offset,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg, bool is_store);
+void taint_host_memcpy_log(
+        uint64_t env_ptr, uint64_t dest, uint64_t src,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg);
+void taint_host_delete_log(
+        uint64_t env_ptr, uint64_t dest_addr,
+        FastShad *greg, FastShad *gspec,
+        uint64_t size, uint64_t labels_per_reg);
+void taint_reset_frame_log(FastShad *shad);
+void taint_push_frame_log(FastShad *shad);
+void taint_pop_frame_log(FastShad *shad);
+
+} // extern "C"
+
+#endif
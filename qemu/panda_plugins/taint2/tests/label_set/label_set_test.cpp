@@ -0,0 +1,193 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+// Checks label set unions, queries and gc against std::set.  Run it with
+// `make` in this directory.
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "label_set.h"
+
+typedef std::pair<LabelSetP, std::set<uint32_t>> Entry;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static std::mt19937 rng(1);
+
+// Union the singletons pairwise, so big sets don't take quadratic time
+static LabelSetP make_set(const std::set<uint32_t> &labels) {
+    std::vector<LabelSetP> v;
+    for (uint32_t l : labels) v.push_back(label_set_singleton(l));
+    while (v.size() > 1) {
+        std::vector<LabelSetP> next;
+        for (size_t i = 0; i + 1 < v.size(); i += 2) {
+            next.push_back(label_set_union(v[i], v[i + 1]));
+        }
+        if (v.size() % 2) next.push_back(v.back());
+        v.swap(next);
+    }
+    return v.empty() ? NULL : v[0];
+}
+
+static void add_range(std::set<uint32_t> &s, uint32_t lo, uint32_t hi) {
+    for (uint32_t l = lo; l <= hi; l++) s.insert(l);
+}
+
+// Labels spread over scales from one word to the whole label space, so
+// every representation and mix of them comes up.
+static uint32_t random_label() {
+    switch (rng() % 4) {
+        case 0: return rng() % 64;
+        case 1: return rng() % 5000;
+        case 2: return rng() % 300000;
+        default: return rng();
+    }
+}
+
+// A run of labels, often across a 64k container boundary
+static std::set<uint32_t> random_range() {
+    std::set<uint32_t> s;
+    uint32_t lo = (rng() % 5) * 65536 + rng() % 70000;
+    uint32_t len = rng() % 3 == 0 ? rng() % 100 : rng() % 8000;
+    add_range(s, lo, lo + len);
+    return s;
+}
+
+static void check_entry(const Entry &e) {
+    CHECK(label_set_render_set(e.first) == e.second);
+    CHECK(label_set_card(e.first) == e.second.size());
+    for (int k = 0; k < 5; k++) {
+        uint32_t l = random_label();
+        CHECK(label_set_contains(e.first, l) == (e.second.count(l) > 0));
+    }
+}
+
+static Entry union_of(const Entry &a, const Entry &b) {
+    std::set<uint32_t> s = a.second;
+    s.insert(b.second.begin(), b.second.end());
+    return Entry(label_set_union(a.first, b.first), s);
+}
+
+// A bitmap-sized union of a roaring set whose lowest label isn't on a
+// container boundary, so its bitmap containers stick out of the span.
+static void test_unaligned_roaring() {
+    std::set<uint32_t> a, b;
+    a.insert(10);
+    add_range(a, 196608, 201607);
+    add_range(b, 0, 200000);
+    Entry ea(make_set(a), a), eb(make_set(b), b);
+    check_entry(union_of(ea, eb));
+    check_entry(union_of(eb, ea));
+}
+
+static void test_random_unions() {
+    std::vector<Entry> pool;
+    for (int i = 0; i < 300; i++) {
+        uint32_t l = random_label();
+        pool.push_back(Entry(label_set_singleton(l), std::set<uint32_t>{l}));
+    }
+    for (int i = 0; i < 30; i++) {
+        std::set<uint32_t> s = random_range();
+        pool.push_back(Entry(make_set(s), s));
+    }
+    for (int it = 0; it < 4000; it++) {
+        Entry u = union_of(pool[rng() % pool.size()], pool[rng() % pool.size()]);
+        check_entry(u);
+        // keep the sets from all growing into one big one
+        if (u.second.size() > 20000) continue;
+        if (pool.size() < 600) pool.push_back(u);
+        else pool[rng() % pool.size()] = u;
+    }
+}
+
+// Equal sets are the same pointer, however they were built
+static void test_interning() {
+    LabelSetP x = NULL, y = NULL;
+    for (uint32_t l = 0; l < 100; l++) {
+        x = label_set_union(x, label_set_singleton(l * 7));
+    }
+    for (int l = 99; l >= 0; l--) {
+        y = label_set_union(y, label_set_singleton(l * 7));
+    }
+    CHECK(x == y);
+
+    int seen = 0;
+    label_set_iter(x, [](uint32_t, void *c) { return (int)(++*(int *)c >= 5); }, &seen);
+    CHECK(seen == 5);
+}
+
+// Sets that are marked survive a sweep, and unions of them stay right
+static std::vector<LabelSetP> roots;
+
+static void test_gc() {
+    for (int round = 0; round < 10; round++) {
+        std::vector<Entry> pool;
+        for (int i = 0; i < 50; i++) {
+            uint32_t l = rng() % 100000;
+            pool.push_back(Entry(label_set_singleton(l), std::set<uint32_t>{l}));
+        }
+        for (int it = 0; it < 3000; it++) {
+            pool.push_back(union_of(pool[rng() % pool.size()], pool[rng() % pool.size()]));
+        }
+        std::vector<Entry> keep;
+        for (auto &e : pool) {
+            if (rng() % 2) keep.push_back(e);
+        }
+        // a root is kept without being marked
+        Entry root = pool[rng() % pool.size()];
+        label_set_gc_root(root.first);
+        roots.push_back(root.first);
+        keep.push_back(root);
+        label_set_gc_begin();
+        for (size_t i = 0; i + 1 < keep.size(); i++) label_set_mark(keep[i].first);
+        label_set_gc_sweep();
+        for (auto &e : keep) check_entry(e);
+        label_set_gc_begin();
+        for (auto &e : keep) label_set_mark(e.first);
+        label_set_gc_sweep();
+        for (auto &e : keep) check_entry(e);
+        for (int k = 0; k < 2000; k++) {
+            check_entry(union_of(keep[rng() % keep.size()], keep[rng() % keep.size()]));
+        }
+    }
+}
+
+int main() {
+    label_set_cache_size(1000);
+    test_unaligned_roaring();
+    test_random_unions();
+    test_interning();
+    test_gc();
+    // free everything, roots included, so leak checking sees no sets
+    for (LabelSetP ls : roots) label_set_gc_unroot(ls);
+    label_set_gc_begin();
+    label_set_gc_sweep();
+    if (failures) {
+        printf("label_set_test: %d failures\n", failures);
+        return 1;
+    }
+    printf("label_set_test: ok\n");
+    return 0;
+}
@@ -0,0 +1 @@
+// label_set.h includes this; the label set code doesn't need any of it
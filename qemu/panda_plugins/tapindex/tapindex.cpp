@@ -24,6 +24,7 @@ extern "C" {
 #include "disas.h"
 
 #include "panda_plugin.h"
+#include "panda_vmem.h"
 
 }
 
@@ -61,12 +62,13 @@ std::map<prog_point,long> read_tracker;
 std::map<prog_point,long> write_tracker;
 FILE *read_index;
 FILE *write_index;
+panda_vmem_reader *vmem;
 
 int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf) {
     prog_point p = {};
 #ifdef TARGET_I386
-    panda_virtual_memory_rw(env, env->regs[R_EBP]+4, (uint8_t *)&p.caller, 4, 0);
+    panda_vmem_read(vmem, env, env->regs[R_EBP]+4, &p.caller, 4);
     if((env->hflags & HF_CPL_MASK) != 0) // Lump all kernel-mode CR3s together
         p.cr3 = env->cr[3];
 #endif
@@ -80,7 +82,7 @@ int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
                        target_ulong size, void *buf) {
     prog_point p = {};
 #ifdef TARGET_I386
-    panda_virtual_memory_rw(env, env->regs[R_EBP]+4, (uint8_t *)&p.caller, 4, 0);
+    panda_vmem_read(vmem, env, env->regs[R_EBP]+4, &p.caller, 4);
     if((env->hflags & HF_CPL_MASK) != 0) // Lump all kernel-mode CR3s together
         p.cr3 = env->cr[3];
 #endif
@@ -96,9 +98,10 @@ bool init_plugin(void *self) {
     printf("Initializing plugin tapindex\n");
 
     // Need this to get EIP with our callbacks
-    panda_enable_precise_pc();
+    panda_enable_lazy_pc();
     // Enable memory logging
     panda_enable_memcb();
+    vmem = panda_vmem_reader_new();
 
     pcb.virt_mem_read = mem_read_callback;
     panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
@@ -109,6 +112,8 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    panda_vmem_reader_free(vmem);
+
     read_index = fopen("tap_reads.idx", "w");
     if(!read_index) {
         printf("Couldn't write report:\n");
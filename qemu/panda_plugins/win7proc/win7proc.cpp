@@ -23,6 +23,7 @@ extern "C" {
 #include "panda_plugin.h"
 #include "pandalog.h"        
 #include "panda_common.h"
+#include "panda_vmem.h"
 #include "../syscalls2/gen_syscalls_ext_typedefs_windows7_x86.h"
 #include "panda_plugin_plugin.h"
 
@@ -55,14 +56,17 @@ void uninit_plugin(void *);
 #define EPROC_PEB_OFF           0x1a8 // _EPROCESS.Peb
 #define PEB_IMAGE_BASE_ADDRESS  0x8   // _PEB.ImageBaseAddress (Reserved3[1])
 
+// Handle table and object walks read the same kernel pages over and over
+panda_vmem_reader *vmem;
+
 static uint32_t get_pid(CPUState *env, target_ulong eproc) {
     uint32_t pid;
-    panda_virtual_memory_rw(env, eproc+EPROC_PID_OFF, (uint8_t *)&pid, 4, false);
+    panda_vmem_read(vmem, env, eproc+EPROC_PID_OFF, &pid, 4);
     return pid;
 }
 
 static void get_procname(CPUState *env, target_ulong eproc, char *name) {
-    panda_virtual_memory_rw(env, eproc+EPROC_NAME_OFF, (uint8_t *)name, 15, false);
+    panda_vmem_read(vmem, env, eproc+EPROC_NAME_OFF, name, 15);
     name[16] = '\0';
 }
 
@@ -72,15 +76,15 @@ static uint32_t get_current_proc(CPUState *env) {
     uint32_t fs_base, thread, proc;
 
     // Read out the two 32-bit ints that make up a segment descriptor
-    panda_virtual_memory_rw(env, env->gdt.base + KMODE_FS, (uint8_t *)&e1, 4, false);
-    panda_virtual_memory_rw(env, env->gdt.base + KMODE_FS + 4, (uint8_t *)&e2, 4, false);
+    panda_vmem_read(vmem, env, env->gdt.base + KMODE_FS, &e1, 4);
+    panda_vmem_read(vmem, env, env->gdt.base + KMODE_FS + 4, &e2, 4);
     
     // Turn wacky segment into base
     fs_base = (e1 >> 16) | ((e2 & 0xff) << 16) | (e2 & 0xff000000);
 
     // Read KPCR->CurrentThread->Process
-    panda_virtual_memory_rw(env, fs_base+KPCR_CURTHREAD_OFF, (uint8_t *)&thread, 4, false);
-    panda_virtual_memory_rw(env, thread+KTHREAD_KPROC_OFF, (uint8_t *)&proc, 4, false);
+    panda_vmem_read(vmem, env, fs_base+KPCR_CURTHREAD_OFF, &thread, 4);
+    panda_vmem_read(vmem, env, thread+KTHREAD_KPROC_OFF, &proc, 4);
 
     return proc;
 }
@@ -90,13 +94,11 @@ static uint32_t get_virtual_base_addr(CPUState *env){
     uint32_t eproc = get_current_proc(env);
     uint32_t peb = -1;
     uint32_t virtual_base_addr = -1;
-    panda_virtual_memory_rw(env, eproc+EPROC_PEB_OFF, (uint8_t *)&peb,
-        sizeof(uint32_t), false);
+    panda_vmem_read(vmem, env, eproc+EPROC_PEB_OFF, &peb, sizeof(uint32_t));
     assert(peb != (uint32_t)-1);
     //printf("Current process: %s\n", current_process->name);
     //printf("PEB: 0x%x\n", peb);
-    panda_virtual_memory_rw(env, peb+PEB_IMAGE_BASE_ADDRESS,
-        (uint8_t *)&virtual_base_addr, sizeof(uint32_t), false);
+    panda_vmem_read(vmem, env, peb+PEB_IMAGE_BASE_ADDRESS, &virtual_base_addr, sizeof(uint32_t));
     assert(virtual_base_addr != (uint32_t)-1);
     return virtual_base_addr;
 }
@@ -203,7 +205,7 @@ typedef enum {
 uint32_t handle_table_code(CPUState *env, uint32_t table_vaddr) {
     uint32_t tableCode;
     // HANDLE_TABLE.TableCode is offest 0
-    panda_virtual_memory_rw(env, table_vaddr, (uint8_t *)&tableCode, 4, false);
+    panda_vmem_read(vmem, env, table_vaddr, &tableCode, 4);
     return (tableCode & TABLE_MASK);
 }
 
@@ -243,7 +245,7 @@ uint32_t handle_table_L3_entry(uint32_t table_vaddr, uint32_t L2_table, uint32_t
 uint32_t get_handle_table_entry(CPUState *env, uint32_t pHandleTable, uint32_t handle) {
     uint32_t tableCode, tableLevels;
     // get tablecode
-    panda_virtual_memory_rw(env, pHandleTable, (uint8_t *)&tableCode, 4, false);
+    panda_vmem_read(vmem, env, pHandleTable, &tableCode, 4);
     //printf ("tableCode = 0x%x\n", tableCode);
     // extract levels
     tableLevels = tableCode & LEVEL_MASK;  
@@ -261,7 +263,7 @@ uint32_t get_handle_table_entry(CPUState *env, uint32_t pHandleTable, uint32_t h
         uint32_t L1_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L1_table_off = handle_table_L1_addr(env, pHandleTable, L1_index);
         uint32_t L1_table;
-        panda_virtual_memory_rw(env, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        panda_vmem_read(vmem, env, L1_table_off, &L1_table, 4);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L2_entry(pHandleTable, L1_table, index);
     }
@@ -269,16 +271,16 @@ uint32_t get_handle_table_entry(CPUState *env, uint32_t pHandleTable, uint32_t h
         uint32_t L1_index = (handle & HANDLE_MASK3) >> HANDLE_SHIFT3;
         uint32_t L1_table_off = handle_table_L1_addr(env, pHandleTable, L1_index);
         uint32_t L1_table;
-        panda_virtual_memory_rw(env, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        panda_vmem_read(vmem, env, L1_table_off, &L1_table, 4);
         uint32_t L2_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L2_table_off = handle_table_L2_addr(L1_table, L2_index);
         uint32_t L2_table;
-        panda_virtual_memory_rw(env, L2_table_off, (uint8_t *) &L2_table, 4, false);
+        panda_vmem_read(vmem, env, L2_table_off, &L2_table, 4);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L3_entry(pHandleTable, L2_table, index);
     }
     uint32_t pObjectHeader;
-    if ((panda_virtual_memory_rw(env, pEntry, (uint8_t *) &pObjectHeader, 4, false)) == -1) {
+    if ((panda_vmem_read(vmem, env, pEntry, &pObjectHeader, 4)) == -1) {
         return 0;
     }
     //  printf ("processHandle_to_pid pObjectHeader = 0x%x\n", pObjectHeader);
@@ -295,21 +297,13 @@ static void unicode_to_ascii(char *uni, char *ascii, int len) {
 }
 
 static char *read_unicode_string(CPUState *env, target_ulong pUstr) {
-    uint16_t fileNameLen;
-    uint32_t fileNamePtr;
+    uint16_t fileNameLen = 0;
+    uint32_t fileNamePtr = 0;
     char *fileName = (char *)calloc(1, 260);
-    char fileNameUnicode[260*2] = {};
-
-    panda_virtual_memory_rw(env, pUstr,
-            (uint8_t *) &fileNameLen, 2, false);
-    panda_virtual_memory_rw(env, pUstr+4,
-            (uint8_t *) &fileNamePtr, 4, false);
 
-    if (fileNameLen > 259*2) {
-        fileNameLen = 259*2; 
-    }
-    panda_virtual_memory_rw(env, fileNamePtr, (uint8_t *)fileNameUnicode, fileNameLen, false);
-    unicode_to_ascii(fileNameUnicode, fileName, fileNameLen/2);
+    panda_vmem_read(vmem, env, pUstr, &fileNameLen, 2);
+    panda_vmem_read_u32(vmem, env, pUstr+4, &fileNamePtr);
+    panda_vmem_read_utf16(vmem, env, fileNamePtr, fileNameLen, fileName, 260);
 
     return fileName;
 }
@@ -317,8 +311,7 @@ static char *read_unicode_string(CPUState *env, target_ulong pUstr) {
 static char * get_objname(CPUState *env, target_ulong obj) {
     uint32_t pObjectName;
 
-    panda_virtual_memory_rw(env, obj+OBJNAME_OFF,
-            (uint8_t *) &pObjectName, 4, false);
+    panda_vmem_read(vmem, env, obj+OBJNAME_OFF, &pObjectName, 4);
     return read_unicode_string(env, pObjectName);
 }
 
@@ -335,14 +328,14 @@ typedef struct handle_object_struct {
 
 static HandleObject *get_handle_object(CPUState *env, uint32_t eproc, uint32_t handle) {
     uint32_t pObjectTable;
-    if (-1 == panda_virtual_memory_rw(env, eproc+EPROC_OBJTABLE_OFF, (uint8_t *)&pObjectTable, 4, false)) {
+    if (-1 == panda_vmem_read(vmem, env, eproc+EPROC_OBJTABLE_OFF, &pObjectTable, 4)) {
         return NULL;
     }
     uint32_t pObjHeader = get_handle_table_entry(env, pObjectTable, handle);
     if (pObjHeader == 0) return NULL;
     uint32_t pObj = pObjHeader + 0x18;
     uint8_t objType = 0;
-    if (-1 == panda_virtual_memory_rw(env, pObjHeader+0xc, &objType, 1, false)) {
+    if (-1 == panda_vmem_read(vmem, env, pObjHeader+0xc, &objType, 1)) {
         return NULL;
     }
     HandleObject *ho = (HandleObject *) malloc(sizeof(HandleObject));
@@ -418,19 +411,17 @@ void w7p_NtCreateUserProcess_return(
     char procName[260] = {};
     char procNameUnicode[260*2] = {};
     
-    panda_virtual_memory_rw(env, ProcessParameters+IMAGEPATHNAME_OFF,
-            (uint8_t *) &procNameLen, 2, false);
-    panda_virtual_memory_rw(env, ProcessParameters+IMAGEPATHNAME_OFF+4,
-            (uint8_t *) &procNamePtr, 4, false);
+    panda_vmem_read(vmem, env, ProcessParameters+IMAGEPATHNAME_OFF, &procNameLen, 2);
+    panda_vmem_read(vmem, env, ProcessParameters+IMAGEPATHNAME_OFF+4, &procNamePtr, 4);
     if (procNameLen > 259*2) {
         procNameLen = 259*2;
     }  
-    panda_virtual_memory_rw(env, procNamePtr, (uint8_t *)procNameUnicode, procNameLen, false);
+    panda_vmem_read(vmem, env, procNamePtr, procNameUnicode, procNameLen);
     unicode_to_ascii(procNameUnicode, procName, procNameLen/2);
     // Retrieve the returned handle and look up the name/PID of the newly created
     // process
     uint32_t handle;
-    panda_virtual_memory_rw(env, ProcessHandle, (uint8_t *)&handle, 4, false);
+    panda_vmem_read(vmem, env, ProcessHandle, &handle, 4);
     uint32_t eproc = get_current_proc(env);
     HandleObject *ho = get_handle_object(env, eproc, handle);
     char *newProc = get_handle_object_name(env, ho);
@@ -464,7 +455,7 @@ void w7p_NtTerminateProcess_enter(
     else {
         // less common -- kill another process
         uint32_t handle;
-        panda_virtual_memory_rw(env, ProcessHandle, (uint8_t *)&handle, 4, false);
+        panda_vmem_read(vmem, env, ProcessHandle, &handle, 4);
         uint32_t eproc = get_current_proc(env);
         HandleObject *ho = get_handle_object(env, eproc, handle);
         if (ho) {
@@ -603,7 +594,7 @@ void w7p_NtCreateKey_return(
     ple.nt_create_key = create_cur_process_key(keyName);
     pandalog_write_entry(&ple);    
     uint32_t KeyHandle;
-    panda_virtual_memory_rw(env, pKeyHandle, (uint8_t *) &KeyHandle, 4, false);
+    panda_vmem_read(vmem, env, pKeyHandle, &KeyHandle, 4);
     save_reg_key(KeyHandle, keyName);
     free(keyName);
 }
@@ -644,7 +635,7 @@ void w7p_NtOpenKey_return (
     ple.nt_open_key = create_cur_process_key(keyName);
     pandalog_write_entry(&ple);        
     uint32_t KeyHandle;
-    panda_virtual_memory_rw(env, pKeyHandle, (uint8_t *) &KeyHandle, 4, false);
+    panda_vmem_read(vmem, env, pKeyHandle, &KeyHandle, 4);
     save_reg_key(KeyHandle, keyName);
     free(keyName);
 }
@@ -663,7 +654,7 @@ void w7p_NtOpenKeyEx_return (
     ple.nt_open_key_ex = create_cur_process_key(keyName);
     pandalog_write_entry(&ple);        
     uint32_t KeyHandle;
-    panda_virtual_memory_rw(env, pKeyHandle, (uint8_t *) &KeyHandle, 4, false);
+    panda_vmem_read(vmem, env, pKeyHandle, &KeyHandle, 4);
     save_reg_key(KeyHandle, keyName);
     free(keyName);
 }
@@ -897,6 +888,8 @@ bool init_plugin(void *self) {
 #endif
     //    panda_require("syscalls2");
 
+    vmem = panda_vmem_reader_new();
+
     panda_cb pcb;
 
     pcb.before_block_exec = before_block_exec;
@@ -934,6 +927,7 @@ bool init_plugin(void *self) {
 void uninit_plugin(void *self) {
     printf("Unloading win7proc\n");
 #ifdef TARGET_I386
+    panda_vmem_reader_free(vmem);
     //    fclose(proc_log);
 
     /*
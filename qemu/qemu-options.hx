@@ -2609,10 +2609,51 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-async", HAS_ARG, QEMU_OPTION_record_async,
+    "-record-async <nbufs>\n"
+    "                stage the record log in <nbufs> 16MB buffers flushed by a\n"
+    "                background thread\n", QEMU_ARCH_ALL)
+
+DEF("record-compress", 0, QEMU_OPTION_record_compress,
+    "-record-compress\n"
+    "                write the record log as compressed, indexed chunks\n", QEMU_ARCH_ALL)
+
+DEF("record-hash", HAS_ARG, QEMU_OPTION_record_hash,
+    "-record-hash <n>\n"
+    "                log a hash of CPU and RAM state every <n> guest\n"
+    "                instructions, checked during replay\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay <snapshot>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-at", HAS_ARG, QEMU_OPTION_replay_at,
+    "-replay-at <instr>\n"
+    "                start the replay from the nearest checkpoint at or\n"
+    "                before guest instruction <instr>\n", QEMU_ARCH_ALL)
+
+DEF("replay-end", HAS_ARG, QEMU_OPTION_replay_end,
+    "-replay-end <instr>\n"
+    "                end the replay at guest instruction <instr>\n", QEMU_ARCH_ALL)
+
+DEF("replay-chain", 0, QEMU_OPTION_replay_chain,
+    "-replay-chain\n"
+    "                chain translation blocks during replay\n", QEMU_ARCH_ALL)
+
+DEF("replay-checkpoint", HAS_ARG, QEMU_OPTION_replay_checkpoint,
+    "-replay-checkpoint <n>\n"
+    "                save a replay checkpoint every <n> guest instructions\n", QEMU_ARCH_ALL)
+
+DEF("replay-stats", HAS_ARG, QEMU_OPTION_replay_stats,
+    "-replay-stats <file>\n"
+    "                write replay speed and a breakdown of where the time\n"
+    "                went to <file>, as JSON\n", QEMU_ARCH_ALL)
+
+DEF("replay-telemetry", HAS_ARG, QEMU_OPTION_replay_telemetry,
+    "-replay-telemetry <file>[,<secs>]\n"
+    "                append the progress of the replay to <file> as a line\n"
+    "                of JSON every <secs> seconds (default 10)\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
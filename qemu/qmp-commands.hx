@@ -1607,6 +1607,48 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_kvm,
     },
 
+SQMP
+query-replay
+------------
+
+Show the progress of the current replay.
+
+Return a json-object with the following information:
+
+- "active": true if a replay is running (json-bool).  The remaining
+  members are only present if it is.
+- "name": the recording being replayed (json-string)
+- "instr-count": guest instructions replayed so far (json-int)
+- "pc", "secondary": the current program point (json-int)
+- "total-instr": guest instructions in the recording (json-int)
+- "seconds": wall-clock time since the replay started (json-number)
+- "instr-per-sec": average replay speed so far (json-number)
+- "max-queue-len": most nondet log entries queued at once (json-int)
+- "log-entries": nondet log entries read so far, a json-array of
+  json-objects with "kind" (json-string), "count" and "bytes" (json-int)
+- "plugins": only with -replay-stats or -replay-telemetry; time spent in
+  each plugin's callbacks, a json-array of json-objects with "name"
+  (json-string), "calls" (json-int) and "seconds" (json-number)
+
+Example:
+
+-> { "execute": "query-replay" }
+<- { "return": { "active": true, "name": "/replays/foo",
+                 "instr-count": 1730023, "pc": 3222643974,
+                 "secondary": 0, "total-instr": 53102117,
+                 "seconds": 2.5, "instr-per-sec": 692009.2,
+                 "max-queue-len": 36,
+                 "log-entries": [ { "kind": "RR_INPUT_4", "count": 210,
+                                    "bytes": 2940 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-replay",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_replay,
+    },
+
 SQMP
 query-status
 ------------
@@ -36,12 +36,18 @@
 #include <unistd.h>
 
 #include <libgen.h>
+#include <zlib.h>
 
 #include "qemu-common.h"
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "sysemu.h"
+#include "monitor.h"
+#include "qjson.h"
+#include "qapi-visit.h"
+#include "qapi/qmp-output-visitor.h"
 #include "rr_log.h"
+#include "rr_stats.h"
 
 #include "panda_plugin.h"
 
@@ -85,7 +91,12 @@ double rr_get_percentage (void) {
         rr_nondet_log->last_prog_point.guest_instr_count;
 }
 
+static uint8_t rr_log_reader_empty(void);
+
 static inline uint8_t rr_log_is_empty(void) {
+    if (rr_nondet_log->type == REPLAY && rr_nondet_log->version == 2) {
+        return rr_log_reader_empty();
+    }
     if ((rr_nondet_log->type == REPLAY) &&
         (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
         return 1;
@@ -108,6 +119,22 @@ volatile sig_atomic_t rr_end_replay_requested = 0;
 char * rr_requested_name = NULL;
 char * rr_snapshot_name  = NULL;
 
+// replay checkpoints: save one every rr_checkpoint_interval instructions
+// (0 = off), and start replay from the one nearest rr_replay_start_instr
+uint64_t rr_checkpoint_interval = 0;
+uint64_t rr_next_checkpoint = 0;
+uint64_t rr_replay_start_instr = 0;
+// end the replay once this instruction count is reached (0 = run to the end)
+uint64_t rr_replay_end_instr = 0;
+// chain TBs in replay.  must not change during a replay, as the TBs
+// translated with it on are the only ones safe to chain
+bool rr_replay_chaining = false;
+volatile sig_atomic_t rr_checkpoint_requested = 0;
+// state hashes: record one every rr_hash_interval instructions (0 = off),
+// so that replay can tell where it diverges
+uint64_t rr_hash_interval = 0;
+uint64_t rr_next_hash = 0;
+
 //mz FIFO queue of log entries read from the log file
 static RR_log_entry *rr_queue_head;
 static RR_log_entry *rr_queue_tail;
@@ -129,7 +156,12 @@ RR_log_entry *rr_get_queue_head(void) {
 // Check if replay is really finished. Conditions:
 // 1) The log is empty
 // 2) The only thing in the queue is RR_LAST
+// or we've reached rr_replay_end_instr.
 uint8_t rr_replay_finished(void) {
+    if (rr_replay_end_instr != 0 &&
+        rr_prog_point.guest_instr_count >= rr_replay_end_instr) {
+        return 1;
+    }
     return rr_log_is_empty() && rr_queue_head->header.kind == RR_LAST && rr_prog_point.guest_instr_count >= rr_queue_head->header.prog_point.guest_instr_count;
 }
 
@@ -192,7 +224,9 @@ static void rr_spit_log_entry(RR_log_entry item) {
             printf("\tRR_LAST\n");
             break;
         case RR_DEBUG:
-            printf("\tRR_DEBUG\n");
+            printf("\tRR_DEBUG cpu_hash=%016llx, %u pages\n",
+                    (unsigned long long) item.variant.state_hash.cpu_hash,
+                    item.variant.state_hash.num_pages);
             break;
         default:
             printf("\tUNKNOWN RR log kind %d\n", item.header.kind);
@@ -261,6 +295,501 @@ inline void rr_assert_fail(const char *exp, const char *file, int line, const ch
     /* NOT REACHED */
 }
 
+/******************************************************************************************/
+/* ASYNC RECORD WRITER */
+/******************************************************************************************/
+
+// Number of in-memory buffers used to stage the record log.  0 means entries
+// go straight to the file with fwrite on the vCPU thread (the old behavior).
+// Set with -record-async <nbufs>.
+unsigned rr_async_num_bufs = 0;
+
+// Write the chunked, compressed v2 log format.  Set with -record-compress.
+bool rr_record_compressed = false;
+
+#define RR_ASYNC_BUF_SIZE (16 * 1024 * 1024)
+
+// A staging buffer for serialized log entries.  For v2 logs each buffer holds
+// exactly one chunk, and we also keep track of which entries are in it so
+// that the chunk can be added to the index.
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t first_instr;
+    uint64_t last_instr;
+    uint64_t first_item;
+    uint64_t num_items;
+} RR_log_buf;
+
+static inline void rr_log_buf_append(RR_log_buf *buf, const void *ptr, size_t size) {
+    if (buf->len + size > buf->cap) {
+        buf->cap = MAX(buf->cap * 2, buf->len + size);
+        buf->data = g_realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, ptr, size);
+    buf->len += size;
+}
+
+static inline void rr_log_buf_reset(RR_log_buf *buf) {
+    buf->len = 0;
+    buf->num_items = 0;
+}
+
+// scratch space for compressed chunks.  Only ever used by one thread at a
+// time (the async writer if there is one, else the vCPU thread).
+static uint8_t *rr_log_zbuf = NULL;
+static size_t rr_log_zbuf_size = 0;
+
+// compress a chunk's worth of entries, write it out and add it to the index
+static void rr_log_write_chunk(RR_log *log, FILE *fp, RR_log_buf *buf) {
+    RR_log_chunk_header hdr;
+    RR_log_chunk_info *info;
+    uLongf zlen = compressBound(buf->len);
+    if (zlen > rr_log_zbuf_size) {
+        rr_log_zbuf_size = zlen;
+        rr_log_zbuf = g_realloc(rr_log_zbuf, rr_log_zbuf_size);
+    }
+    rr_assert(compress2(rr_log_zbuf, &zlen, buf->data, buf->len,
+                        Z_DEFAULT_COMPRESSION) == Z_OK);
+
+    if (log->num_chunks == log->chunks_cap) {
+        log->chunks_cap = MAX(log->chunks_cap * 2, 1024);
+        log->chunks = g_renew(RR_log_chunk_info, log->chunks, log->chunks_cap);
+    }
+    info = &log->chunks[log->num_chunks++];
+    info->offset = ftello(fp);
+    info->first_instr = buf->first_instr;
+    info->last_instr = buf->last_instr;
+    info->first_item = buf->first_item;
+    info->compressed_size = zlen;
+    info->uncompressed_size = buf->len;
+
+    hdr.compressed_size = zlen;
+    hdr.uncompressed_size = buf->len;
+    rr_assert(fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+    rr_assert(fwrite(rr_log_zbuf, 1, zlen, fp) == zlen);
+}
+
+// A ring of large buffers.  The vCPU thread serializes log entries into
+// bufs[fill_idx]; when that fills up it is handed to a background thread
+// which writes it out (compressing it first for v2 logs) and returns it to
+// the ring.  If every buffer is waiting to be flushed, the vCPU thread blocks
+// until one is free (bounded memory), and we count that as a stall.
+typedef struct {
+    RR_log_buf *bufs;
+    unsigned num_bufs;
+    unsigned fill_idx;          // buffer the vCPU thread is filling
+    unsigned flush_idx;         // next buffer the writer thread will flush
+    unsigned num_full;          // buffers queued for the writer thread
+    bool chunked;               // v2 log: one compressed chunk per buffer
+    bool quit;                  // no more buffers coming; drain and exit
+    bool done;                  // writer thread has exited
+    RR_log *log;
+    FILE *fp;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond buf_full;          // a buffer was queued (or quit was set)
+    QemuCond buf_free;          // a buffer was flushed (or writer exited)
+    // stats
+    unsigned long long num_stalls;
+    unsigned long long stall_usecs;
+    unsigned long long bytes_written;
+} RR_async_writer;
+
+static RR_async_writer *rr_async_writer = NULL;
+
+static void *rr_async_writer_thread(void *opaque) {
+    RR_async_writer *w = (RR_async_writer *) opaque;
+    qemu_mutex_lock(&w->lock);
+    while (true) {
+        while (w->num_full == 0 && !w->quit) {
+            qemu_cond_wait(&w->buf_full, &w->lock);
+        }
+        if (w->num_full == 0) {
+            // quit requested and everything has been flushed
+            break;
+        }
+        RR_log_buf *buf = &w->bufs[w->flush_idx];
+        qemu_mutex_unlock(&w->lock);
+        // buffer is owned by this thread until we return it below
+        if (buf->len > 0) {
+            if (w->chunked) {
+                rr_log_write_chunk(w->log, w->fp, buf);
+            }
+            else {
+                rr_assert(fwrite(buf->data, 1, buf->len, w->fp) == buf->len);
+            }
+        }
+        qemu_mutex_lock(&w->lock);
+        w->bytes_written += buf->len;
+        rr_log_buf_reset(buf);
+        w->flush_idx = (w->flush_idx + 1) % w->num_bufs;
+        w->num_full--;
+        qemu_cond_signal(&w->buf_free);
+    }
+    w->done = true;
+    qemu_cond_signal(&w->buf_free);
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void rr_async_writer_start(RR_log *log, unsigned num_bufs) {
+    unsigned i;
+    RR_async_writer *w = g_new0(RR_async_writer, 1);
+    // need at least one buffer to fill while another is being flushed
+    if (num_bufs < 2) num_bufs = 2;
+    w->num_bufs = num_bufs;
+    w->chunked = (log->version == 2);
+    w->bufs = g_new0(RR_log_buf, num_bufs);
+    for (i = 0; i < num_bufs; i++) {
+        // leave some slack so that a chunk rarely has to grow
+        w->bufs[i].cap = w->chunked ? 2 * RR_LOG_CHUNK_SIZE : RR_ASYNC_BUF_SIZE;
+        w->bufs[i].data = g_malloc(w->bufs[i].cap);
+    }
+    w->log = log;
+    w->fp = log->fp;
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->buf_full);
+    qemu_cond_init(&w->buf_free);
+    qemu_thread_create(&w->thread, rr_async_writer_thread, w);
+    rr_async_writer = w;
+}
+
+// hand the buffer being filled to the writer thread and move on to the next
+// one, waiting for it to be flushed if necessary.
+static void rr_async_writer_submit(RR_async_writer *w) {
+    qemu_mutex_lock(&w->lock);
+    w->num_full++;
+    qemu_cond_signal(&w->buf_full);
+    if (w->num_full == w->num_bufs) {
+        struct timeval start, end;
+        w->num_stalls++;
+        gettimeofday(&start, NULL);
+        while (w->num_full == w->num_bufs) {
+            qemu_cond_wait(&w->buf_free, &w->lock);
+        }
+        gettimeofday(&end, NULL);
+        w->stall_usecs += (end.tv_sec - start.tv_sec) * 1000000ULL
+            + end.tv_usec - start.tv_usec;
+    }
+    w->fill_idx = (w->fill_idx + 1) % w->num_bufs;
+    qemu_mutex_unlock(&w->lock);
+}
+
+// vCPU side: copy bytes into the current buffer.  In a v1 log, large DMA
+// payloads simply span several buffers.  In a v2 log chunks have to start on
+// an entry boundary, so the buffer grows instead and gets submitted once the
+// entry is complete (see rr_log_end_item).
+static inline void rr_async_writer_copy(RR_async_writer *w, const void *ptr, size_t size) {
+    const uint8_t *src = (const uint8_t *) ptr;
+    if (w->chunked) {
+        rr_log_buf_append(&w->bufs[w->fill_idx], ptr, size);
+        return;
+    }
+    while (size > 0) {
+        RR_log_buf *buf = &w->bufs[w->fill_idx];
+        size_t n = buf->cap - buf->len;
+        if (n > size) n = size;
+        memcpy(buf->data + buf->len, src, n);
+        buf->len += n;
+        src += n;
+        size -= n;
+        if (buf->len == buf->cap) {
+            rr_async_writer_submit(w);
+        }
+    }
+}
+
+// flush whatever is left, wait for the writer thread to exit, and free
+// everything.  Afterwards the log file is safe to touch from this thread again.
+static void rr_async_writer_stop(void) {
+    RR_async_writer *w = rr_async_writer;
+    unsigned i;
+    if (w == NULL) return;
+    if (w->bufs[w->fill_idx].len > 0) {
+        rr_async_writer_submit(w);
+    }
+    qemu_mutex_lock(&w->lock);
+    w->quit = true;
+    qemu_cond_signal(&w->buf_full);
+    while (!w->done) {
+        qemu_cond_wait(&w->buf_free, &w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+    printf("async record log: %llu bytes, %u buffers, %llu stalls, %.3f sec stalled\n",
+           w->bytes_written, w->num_bufs, w->num_stalls, w->stall_usecs / 1000000.0);
+    qemu_cond_destroy(&w->buf_full);
+    qemu_cond_destroy(&w->buf_free);
+    qemu_mutex_destroy(&w->lock);
+    for (i = 0; i < w->num_bufs; i++) {
+        g_free(w->bufs[i].data);
+    }
+    g_free(w->bufs);
+    g_free(w);
+    rr_async_writer = NULL;
+}
+
+// staging buffer for v2 logs written without the async writer
+static RR_log_buf rr_chunk_buf;
+
+// drop-in for fwrite in rr_write_item
+static inline void rr_log_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    if (rr_async_writer) {
+        rr_async_writer_copy(rr_async_writer, ptr, size * nmemb);
+    }
+    else if (rr_nondet_log->version == 2) {
+        rr_log_buf_append(&rr_chunk_buf, ptr, size * nmemb);
+    }
+    else {
+        fwrite(ptr, size, nmemb, fp);
+    }
+}
+
+// finish off the current v2 chunk, if it has anything in it
+static void rr_log_flush_chunk(void) {
+    if (rr_async_writer) {
+        if (rr_async_writer->bufs[rr_async_writer->fill_idx].len > 0) {
+            rr_async_writer_submit(rr_async_writer);
+        }
+    }
+    else if (rr_chunk_buf.len > 0) {
+        rr_log_write_chunk(rr_nondet_log, rr_nondet_log->fp, &rr_chunk_buf);
+        rr_log_buf_reset(&rr_chunk_buf);
+    }
+}
+
+// called after each complete entry.  For v2 logs, note the entry in the
+// current chunk and cut the chunk once it is big enough.
+static inline void rr_log_end_item(RR_prog_point *pp) {
+    RR_log_buf *buf;
+    if (rr_nondet_log->version != 2) return;
+    buf = rr_async_writer ? &rr_async_writer->bufs[rr_async_writer->fill_idx] : &rr_chunk_buf;
+    if (buf->num_items == 0) {
+        buf->first_instr = pp->guest_instr_count;
+        buf->first_item = rr_nondet_log->item_number;
+    }
+    buf->last_instr = pp->guest_instr_count;
+    buf->num_items++;
+    if (buf->len >= RR_LOG_CHUNK_SIZE) {
+        rr_log_flush_chunk();
+    }
+}
+
+/******************************************************************************************/
+/* STATE HASHES */
+/******************************************************************************************/
+
+// With -record-hash, record logs an RR_DEBUG entry every so often with a hash
+// of the CPU registers and of every RAM page written since the last one.
+// Replay recomputes them at the same program point, so the first mismatch
+// says between which two hashes, and in which pages, replay went wrong.
+#ifdef CONFIG_SOFTMMU
+
+#define RR_HASH_SEED  0xcbf29ce484222325ULL
+#define RR_HASH_PRIME 0x100000001b3ULL
+// how many differing pages to print
+#define RR_HASH_MAX_REPORT 32
+
+// whether RAM writes are being tracked for state hashes yet
+static bool rr_hash_tracking = false;
+// replay only: last instruction count where the state hash matched
+static uint64_t rr_hash_last_good = 0;
+
+// dirty pages found by the last rr_hash_dirty_pages
+static RR_page_hash *rr_hash_pages = NULL;
+static uint32_t rr_hash_pages_cap = 0;
+
+// FNV-1a, a word at a time
+static uint64_t rr_hash_bytes(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *) data;
+    while (len >= sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * RR_HASH_PRIME;
+        p += sizeof(w);
+        len -= sizeof(w);
+    }
+    while (len-- > 0) {
+        h = (h ^ *p++) * RR_HASH_PRIME;
+    }
+    return h;
+}
+
+// registers that matter to the guest.  Lazily computed flags are hashed
+// in their architectural form.
+static uint64_t rr_hash_cpu(CPUState *env) {
+    uint64_t h = RR_HASH_SEED;
+#if defined(TARGET_I386)
+    target_ulong eflags = env->eflags | cpu_cc_compute_all(env, env->cc_op) |
+        (env->df & DF_MASK);
+    int i;
+    h = rr_hash_bytes(h, env->regs, sizeof(env->regs));
+    h = rr_hash_bytes(h, &env->eip, sizeof(env->eip));
+    h = rr_hash_bytes(h, &eflags, sizeof(eflags));
+    for (i = 0; i < 6; i++) {
+        h = rr_hash_bytes(h, &env->segs[i].selector, sizeof(env->segs[i].selector));
+        h = rr_hash_bytes(h, &env->segs[i].base, sizeof(env->segs[i].base));
+    }
+    h = rr_hash_bytes(h, env->cr, sizeof(env->cr));
+#elif defined(TARGET_ARM)
+    uint32_t flags[4] = { env->NF >> 31, env->ZF == 0, env->CF, env->VF >> 31 };
+    h = rr_hash_bytes(h, env->regs, sizeof(env->regs));
+    h = rr_hash_bytes(h, &env->uncached_cpsr, sizeof(env->uncached_cpsr));
+    h = rr_hash_bytes(h, &env->spsr, sizeof(env->spsr));
+    h = rr_hash_bytes(h, flags, sizeof(flags));
+#endif
+    // other targets: only the program point is compared
+    return h;
+}
+
+// forget which pages have been written so far
+static void rr_hash_reset_dirty(void) {
+    RAMBlock *block;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset, block->offset + block->length,
+                                        RR_HASH_DIRTY_FLAG);
+    }
+}
+
+static int rr_page_hash_compare(const void *a, const void *b) {
+    const RR_page_hash *pa = (const RR_page_hash *) a;
+    const RR_page_hash *pb = (const RR_page_hash *) b;
+    return pa->ram_addr < pb->ram_addr ? -1 : pa->ram_addr > pb->ram_addr;
+}
+
+// hash every RAM page written since the last call, sorted by ram_addr
+static uint32_t rr_hash_dirty_pages(RR_page_hash **pages) {
+    RAMBlock *block;
+    uint32_t n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t off;
+        for (off = 0; off < block->length; off += TARGET_PAGE_SIZE) {
+            if (!cpu_physical_memory_get_dirty(block->offset + off, RR_HASH_DIRTY_FLAG)) {
+                continue;
+            }
+            if (n == rr_hash_pages_cap) {
+                rr_hash_pages_cap = rr_hash_pages_cap ? rr_hash_pages_cap * 2 : 1024;
+                rr_hash_pages = g_renew(RR_page_hash, rr_hash_pages, rr_hash_pages_cap);
+            }
+            rr_hash_pages[n].ram_addr = block->offset + off;
+            rr_hash_pages[n].hash = rr_hash_bytes(RR_HASH_SEED, block->host + off, TARGET_PAGE_SIZE);
+            n++;
+        }
+    }
+    rr_hash_reset_dirty();
+    // the block list is kept in MRU order, which needn't match record's
+    qsort(rr_hash_pages, n, sizeof(RR_page_hash), rr_page_hash_compare);
+    *pages = rr_hash_pages;
+    return n;
+}
+
+// called at the start of record and replay, with the VM in the state the
+// snapshot holds.  Resetting the dirty flags costs a pass over all of RAM
+// and makes the next write to every page take the slow path, so it's only
+// done once we know hashes are wanted: at once in record, and at the first
+// hash found in the log in replay.
+static void rr_begin_state_hashes(void) {
+    rr_hash_last_good = rr_prog_point.guest_instr_count;
+    rr_hash_tracking = false;
+    if (rr_hash_interval == 0) {
+        return;
+    }
+    rr_hash_reset_dirty();
+    rr_hash_tracking = true;
+    rr_next_hash = (rr_prog_point.guest_instr_count / rr_hash_interval + 1) * rr_hash_interval;
+}
+
+static void rr_hash_mismatch_header(bool *printed) {
+    if (*printed) return;
+    *printed = true;
+    printf("STATE HASH MISMATCH at ");
+    rr_spit_prog_point(rr_prog_point);
+    printf("Replay diverged from record after guest_instr_count=%llu (last matching hash)\n",
+           (unsigned long long) rr_hash_last_good);
+}
+
+// compare our state with the hash record logged at this program point.  On
+// a mismatch, report what differs and end the replay.
+static void rr_check_state_hash(RR_state_hash *rec) {
+    RR_page_hash *pages = NULL;
+    uint32_t num_pages = 0;
+    uint32_t i = 0, j = 0, num_bad = 0;
+    bool printed = false;
+    bool check_ram = rr_hash_tracking;
+
+    if (rr_hash_tracking) {
+        num_pages = rr_hash_dirty_pages(&pages);
+    }
+    else {
+        // first hash in the log: start tracking writes from here.  We
+        // haven't seen the writes record hashed in this interval, so only
+        // the registers can be checked this time.
+        rr_hash_reset_dirty();
+        rr_hash_tracking = true;
+    }
+
+    if (rr_hash_cpu(first_cpu) != rec->cpu_hash) {
+        rr_hash_mismatch_header(&printed);
+        printf(">>> CPU registers differ\n");
+    }
+    // merge the two sorted page lists
+    while (check_ram && (i < rec->num_pages || j < num_pages)) {
+        RR_page_hash r = { UINT64_MAX, 0 };
+        const char *what = NULL;
+        uint64_t addr;
+        if (i < rec->num_pages) {
+            memcpy(&r, &rec->pages[i], sizeof(r));
+        }
+        if (j < num_pages && pages[j].ram_addr < r.ram_addr) {
+            addr = pages[j++].ram_addr;
+            what = "written only in replay";
+        }
+        else if (j < num_pages && pages[j].ram_addr == r.ram_addr) {
+            addr = r.ram_addr;
+            if (pages[j].hash != r.hash) what = "contents differ";
+            i++;
+            j++;
+        }
+        else {
+            addr = r.ram_addr;
+            what = "written only in record";
+            i++;
+        }
+        if (what) {
+            rr_hash_mismatch_header(&printed);
+            if (num_bad++ < RR_HASH_MAX_REPORT) {
+                printf(">>> RAM page at ram_addr 0x%llx: %s\n", (unsigned long long) addr, what);
+            }
+        }
+    }
+    if (num_bad > RR_HASH_MAX_REPORT) {
+        printf(">>> ... %u pages differ in all\n", num_bad);
+    }
+
+    if (printed) {
+        printf("Recent log entries:\n");
+        rr_print_history();
+        // the log holds no state between hashes, so this is as close as
+        // replay can get on its own
+        printf("To narrow it down, replay just this interval with plugins "
+               "(-replay-at %llu -replay-end %llu), or record again with a "
+               "smaller -record-hash\n",
+               (unsigned long long) rr_hash_last_good,
+               (unsigned long long) rr_prog_point.guest_instr_count);
+        rr_end_replay_requested = 1;
+    }
+    else {
+        rr_hash_last_good = rr_prog_point.guest_instr_count;
+        if (rr_debug_whisper()) {
+            fprintf(logfile, "state hash matches at ");
+            rr_debug_log_prog_point(rr_prog_point);
+        }
+    }
+}
+
+#endif // CONFIG_SOFTMMU
+
 /******************************************************************************************/
 /* RECORD */
 /******************************************************************************************/
@@ -273,9 +802,9 @@ static inline void rr_write_item(void) {
     rr_assert (rr_in_record());
     rr_assert (rr_nondet_log != NULL);
     //mz this is more compact, as it doesn't include extra padding.
-    fwrite(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
-    fwrite(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp);
-    fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp);
+    rr_log_fwrite(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+    rr_log_fwrite(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp);
+    rr_log_fwrite(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp);
 
     //mz also save the program point in the log structure to ensure that our
     //header will include the latest program point.
@@ -283,67 +812,67 @@ static inline void rr_write_item(void) {
 
     switch (item->header.kind) {
         case RR_INPUT_1:
-            fwrite(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp);
             break;
         case RR_INPUT_2:
-            fwrite(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp);
             break;
         case RR_INPUT_4:
-            fwrite(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp);
             break;
         case RR_INPUT_8:
-            fwrite(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp);
             break;
         case RR_INTERRUPT_REQUEST:
-            fwrite(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp);
             break;
         case RR_EXIT_REQUEST:
-            fwrite(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp);
+            rr_log_fwrite(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz write kind first!
-                fwrite(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp);
+                rr_log_fwrite(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp);
                 switch (args->kind) {
                     case RR_CALL_CPU_MEM_RW:
                         rr_assert(args->variant.cpu_mem_rw_args.buf != NULL || 
                                 args->variant.cpu_mem_rw_args.len == 0);
-                        fwrite(&(args->variant.cpu_mem_rw_args), 
+                        rr_log_fwrite(&(args->variant.cpu_mem_rw_args), 
 			       sizeof(args->variant.cpu_mem_rw_args), 
 			       1, rr_nondet_log->fp);
                         //mz write the buffer
-                        fwrite(args->variant.cpu_mem_rw_args.buf, 1, 
+                        rr_log_fwrite(args->variant.cpu_mem_rw_args.buf, 1, 
 			       args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
                         //bdg same deal as RR_CALL_CPU_MEM_RW
                         rr_assert(args->variant.cpu_mem_unmap.buf != NULL || 
                                 args->variant.cpu_mem_unmap.len == 0);
-                        fwrite(&(args->variant.cpu_mem_unmap),
+                        rr_log_fwrite(&(args->variant.cpu_mem_unmap),
 			       sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp);
-                        fwrite(args->variant.cpu_mem_unmap.buf, 1, 
+                        rr_log_fwrite(args->variant.cpu_mem_unmap.buf, 1, 
 			       args->variant.cpu_mem_unmap.len, rr_nondet_log->fp);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        fwrite(&(args->variant.cpu_mem_reg_region_args), 
+                        rr_log_fwrite(&(args->variant.cpu_mem_reg_region_args), 
                                sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp);
                         break;
                     case RR_CALL_HD_TRANSFER:
-		        fwrite(&(args->variant.hd_transfer_args), 
+		        rr_log_fwrite(&(args->variant.hd_transfer_args), 
                                sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp);
                         break;
                     case RR_CALL_NET_TRANSFER:
-		        fwrite(&(args->variant.net_transfer_args), 
+		        rr_log_fwrite(&(args->variant.net_transfer_args), 
                                sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp);
                         break;
                     case RR_CALL_HANDLE_PACKET:
                         assert(args->variant.handle_packet_args.buf != NULL || 
                                 args->variant.handle_packet_args.size == 0);
-                        fwrite(&(args->variant.handle_packet_args), 
+                        rr_log_fwrite(&(args->variant.handle_packet_args), 
 			       sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp);
                         //mz write the buffer
-                        fwrite(args->variant.handle_packet_args.buf, 1, 
+                        rr_log_fwrite(args->variant.handle_packet_args.buf, 1, 
 			       args->variant.handle_packet_args.size, rr_nondet_log->fp);
                         break;
                     default:
@@ -352,14 +881,19 @@ static inline void rr_write_item(void) {
                 }
             }
             break;
-        case RR_LAST:
         case RR_DEBUG:
+            rr_log_fwrite(&(item->variant.state_hash), sizeof(item->variant.state_hash), 1, rr_nondet_log->fp);
+            rr_log_fwrite(item->variant.state_hash.pages, sizeof(RR_page_hash),
+                   item->variant.state_hash.num_pages, rr_nondet_log->fp);
+            break;
+        case RR_LAST:
             //mz nothing to write
             break;
         default:
             //mz unimplemented
             rr_assert(0);
     }
+    rr_log_end_item(&item->header.prog_point);
     rr_nondet_log->item_number++;
 }
 
@@ -373,6 +907,14 @@ void rr_record_debug(RR_callsite_id call_site) {
     item->header.callsite_loc = call_site;
     item->header.prog_point = rr_prog_point;
 
+#ifdef CONFIG_SOFTMMU
+    item->variant.state_hash.cpu_hash = rr_hash_cpu(first_cpu);
+    item->variant.state_hash.num_pages = rr_hash_dirty_pages(&item->variant.state_hash.pages);
+#endif
+    if (rr_hash_interval != 0) {
+        rr_next_hash = (rr_prog_point.guest_instr_count / rr_hash_interval + 1) * rr_hash_interval;
+    }
+
     rr_write_item();
 }
 
@@ -617,6 +1159,313 @@ static void rr_record_end_of_log(void) {
 /* REPLAY */
 /******************************************************************************************/
 
+//
+// Payload blocks.  The buffers of skipped calls (DMA, packets) aren't
+// malloc'd per entry.  A v2 entry points straight into the decompressed
+// chunk it came from, and v1 entries are read into big blocks that are
+// carved up in order.  Either way, the entries using a block hold
+// references on it, and it goes back to a pool when the last is recycled.
+//
+
+#define RR_PAYLOAD_BLOCK_SIZE (4*1024*1024)
+#define RR_PAYLOAD_POOL_MAX 16
+
+typedef struct RR_payload_block {
+    struct RR_payload_block *next;  // in the pool
+    unsigned refs;
+    size_t len;
+    size_t cap;
+    uint8_t *data;
+} RR_payload_block;
+
+// the pool is shared with the prefetch thread
+static RR_payload_block *rr_payload_pool = NULL;
+static unsigned rr_payload_pool_len = 0;
+static QemuMutex rr_payload_lock;
+static bool rr_payload_lock_inited = false;
+// v1 only: block currently being filled
+static RR_payload_block *rr_payload_cur = NULL;
+
+// get an empty block with room for at least cap bytes, holding one reference
+static RR_payload_block *rr_payload_block_get(size_t cap) {
+    RR_payload_block *b;
+    qemu_mutex_lock(&rr_payload_lock);
+    b = rr_payload_pool;
+    if (b) {
+        rr_payload_pool = b->next;
+        rr_payload_pool_len--;
+    }
+    qemu_mutex_unlock(&rr_payload_lock);
+    if (b == NULL) {
+        b = g_new0(RR_payload_block, 1);
+    }
+    if (b->cap < cap) {
+        b->cap = cap;
+        b->data = g_realloc(b->data, b->cap);
+    }
+    b->next = NULL;
+    b->refs = 1;
+    b->len = 0;
+    return b;
+}
+
+static void rr_payload_block_put(RR_payload_block *b) {
+    rr_assert(b->refs > 0);
+    if (--b->refs > 0) return;
+    qemu_mutex_lock(&rr_payload_lock);
+    if (rr_payload_pool_len < RR_PAYLOAD_POOL_MAX) {
+        b->next = rr_payload_pool;
+        rr_payload_pool = b;
+        rr_payload_pool_len++;
+        b = NULL;
+    }
+    qemu_mutex_unlock(&rr_payload_lock);
+    if (b) {
+        g_free(b->data);
+        g_free(b);
+    }
+}
+
+static void rr_payload_pool_free(void) {
+    if (rr_payload_cur) {
+        rr_payload_block_put(rr_payload_cur);
+        rr_payload_cur = NULL;
+    }
+    while (rr_payload_pool) {
+        RR_payload_block *b = rr_payload_pool;
+        rr_payload_pool = b->next;
+        g_free(b->data);
+        g_free(b);
+    }
+    rr_payload_pool_len = 0;
+}
+
+//
+// v2 log reader.  A prefetch thread reads and decompresses chunks ahead of
+// the vCPU thread into a small ring of slots; rr_read_item then just copies
+// out of the current slot.
+//
+
+#define RR_PREFETCH_SLOTS 4
+
+typedef struct {
+    RR_payload_block *block;    // decompressed chunk
+    bool ready;                 // holds decompressed chunk, not yet consumed
+} RR_prefetch_slot;
+
+typedef struct {
+    RR_log *log;
+    int fd;
+    RR_prefetch_slot slots[RR_PREFETCH_SLOTS];
+    uint64_t cur_chunk;         // chunk the vCPU thread is reading from
+    size_t cur_pos;             // read position within cur_chunk
+    bool have_cur;              // vCPU thread owns the slot for cur_chunk
+    uint64_t next_fetch;        // next chunk for the prefetch thread
+    uint8_t *zbuf;              // compressed data, prefetch thread only
+    size_t zbuf_size;
+    bool quit;
+    bool done;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond slot_ready;
+    QemuCond slot_free;
+} RR_log_reader;
+
+static RR_log_reader *rr_log_reader = NULL;
+
+static void *rr_log_prefetch_thread(void *opaque) {
+    RR_log_reader *r = (RR_log_reader *) opaque;
+    qemu_mutex_lock(&r->lock);
+    while (true) {
+        // stay at most RR_PREFETCH_SLOTS chunks ahead of the reader
+        while (!r->quit &&
+               (r->next_fetch >= r->log->num_chunks ||
+                r->next_fetch >= r->cur_chunk + RR_PREFETCH_SLOTS ||
+                r->slots[r->next_fetch % RR_PREFETCH_SLOTS].ready)) {
+            qemu_cond_wait(&r->slot_free, &r->lock);
+        }
+        if (r->quit) break;
+        RR_log_chunk_info *info = &r->log->chunks[r->next_fetch];
+        RR_prefetch_slot *slot = &r->slots[r->next_fetch % RR_PREFETCH_SLOTS];
+        qemu_mutex_unlock(&r->lock);
+
+        if (info->compressed_size > r->zbuf_size) {
+            r->zbuf_size = info->compressed_size;
+            r->zbuf = g_realloc(r->zbuf, r->zbuf_size);
+        }
+        // a fresh block each time, since entries may still point into the
+        // last one this slot held
+        RR_payload_block *block = rr_payload_block_get(info->uncompressed_size);
+        rr_assert(pread(r->fd, r->zbuf, info->compressed_size,
+                        info->offset + sizeof(RR_log_chunk_header))
+                  == info->compressed_size);
+        uLongf len = info->uncompressed_size;
+        rr_assert(uncompress(block->data, &len, r->zbuf, info->compressed_size) == Z_OK);
+        rr_assert(len == info->uncompressed_size);
+        block->len = len;
+
+        qemu_mutex_lock(&r->lock);
+        slot->block = block;
+        slot->ready = true;
+        r->next_fetch++;
+        qemu_cond_signal(&r->slot_ready);
+    }
+    r->done = true;
+    qemu_cond_signal(&r->slot_ready);
+    qemu_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// start reading at the beginning of chunk first_chunk
+static void rr_log_reader_start(RR_log *log, uint64_t first_chunk) {
+    RR_log_reader *r = g_new0(RR_log_reader, 1);
+    r->log = log;
+    r->fd = fileno(log->fp);
+    r->cur_chunk = first_chunk;
+    r->next_fetch = first_chunk;
+    qemu_mutex_init(&r->lock);
+    qemu_cond_init(&r->slot_ready);
+    qemu_cond_init(&r->slot_free);
+    qemu_thread_create(&r->thread, rr_log_prefetch_thread, r);
+    rr_log_reader = r;
+}
+
+static void rr_log_reader_stop(void) {
+    RR_log_reader *r = rr_log_reader;
+    int i;
+    if (r == NULL) return;
+    qemu_mutex_lock(&r->lock);
+    r->quit = true;
+    qemu_cond_signal(&r->slot_free);
+    while (!r->done) {
+        qemu_cond_wait(&r->slot_ready, &r->lock);
+    }
+    qemu_mutex_unlock(&r->lock);
+    qemu_cond_destroy(&r->slot_ready);
+    qemu_cond_destroy(&r->slot_free);
+    qemu_mutex_destroy(&r->lock);
+    for (i = 0; i < RR_PREFETCH_SLOTS; i++) {
+        if (r->slots[i].block) {
+            rr_payload_block_put(r->slots[i].block);
+        }
+    }
+    g_free(r->zbuf);
+    g_free(r);
+    rr_log_reader = NULL;
+}
+
+// chunks are released as soon as they are used up, so once the reader has
+// moved past the last chunk there is nothing left
+static uint8_t rr_log_reader_empty(void) {
+    return rr_log_reader->cur_chunk >= rr_log_reader->log->num_chunks;
+}
+
+// wait for the slot holding cur_chunk.  Returns NULL at the end of the log.
+static RR_prefetch_slot *rr_log_reader_cur_slot(RR_log_reader *r) {
+    RR_prefetch_slot *slot = &r->slots[r->cur_chunk % RR_PREFETCH_SLOTS];
+    if (!r->have_cur) {
+        if (r->cur_chunk >= r->log->num_chunks) return NULL;
+        qemu_mutex_lock(&r->lock);
+        while (!slot->ready) {
+            qemu_cond_wait(&r->slot_ready, &r->lock);
+        }
+        qemu_mutex_unlock(&r->lock);
+        r->have_cur = true;
+        r->cur_pos = 0;
+    }
+    return slot;
+}
+
+// done with this chunk; give the slot back to the prefetcher.  The block
+// stays alive as long as entries point into it.
+static void rr_log_reader_release_slot(RR_log_reader *r, RR_prefetch_slot *slot) {
+    RR_payload_block *block;
+    qemu_mutex_lock(&r->lock);
+    block = slot->block;
+    slot->block = NULL;
+    slot->ready = false;
+    r->cur_chunk++;
+    r->have_cur = false;
+    qemu_cond_signal(&r->slot_free);
+    qemu_mutex_unlock(&r->lock);
+    rr_payload_block_put(block);
+}
+
+// copy size bytes out of the decompressed stream.  Returns number of bytes read.
+static size_t rr_log_reader_read(void *ptr, size_t size) {
+    RR_log_reader *r = rr_log_reader;
+    uint8_t *dst = (uint8_t *) ptr;
+    size_t total = 0;
+    while (size > 0) {
+        RR_prefetch_slot *slot = rr_log_reader_cur_slot(r);
+        if (slot == NULL) break;
+        size_t n = MIN(size, slot->block->len - r->cur_pos);
+        memcpy(dst, slot->block->data + r->cur_pos, n);
+        r->cur_pos += n;
+        dst += n;
+        size -= n;
+        total += n;
+        if (r->cur_pos == slot->block->len) {
+            rr_log_reader_release_slot(r, slot);
+        }
+    }
+    return total;
+}
+
+// return a pointer to the next size bytes of the decompressed stream, and
+// take a reference on the block they're in.  Entries never straddle chunks,
+// so a payload is always in one piece.
+static void *rr_log_reader_payload(size_t size, RR_payload_block **block) {
+    RR_log_reader *r = rr_log_reader;
+    RR_prefetch_slot *slot = rr_log_reader_cur_slot(r);
+    void *buf;
+    if (slot == NULL || r->cur_pos + size > slot->block->len) return NULL;
+    buf = slot->block->data + r->cur_pos;
+    slot->block->refs++;
+    *block = slot->block;
+    r->cur_pos += size;
+    if (r->cur_pos == slot->block->len) {
+        rr_log_reader_release_slot(r, slot);
+    }
+    return buf;
+}
+
+// drop-in for fread in rr_read_item
+static inline size_t rr_log_fread(void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    if (rr_nondet_log->version == 2) {
+        return rr_log_reader_read(ptr, size * nmemb) / size;
+    }
+    else {
+        return fread(ptr, size, nmemb, fp);
+    }
+}
+
+
+// read a len-byte payload for the entry being read, without copying it if
+// we can.  Returns NULL on a short read.
+static void *rr_log_read_payload(size_t len, RR_payload_block **block) {
+    RR_payload_block *b = rr_payload_cur;
+    size_t alloc_len = (len + 7) & ~(size_t) 7;
+    void *buf;
+    if (rr_nondet_log->version == 2) {
+        return rr_log_reader_payload(len, block);
+    }
+    if (b && b->refs == 1) {
+        // everything read into it so far has been consumed
+        b->len = 0;
+    }
+    if (b == NULL || b->len + alloc_len > b->cap) {
+        if (b) rr_payload_block_put(b);
+        b = rr_payload_cur = rr_payload_block_get(MAX(alloc_len, RR_PAYLOAD_BLOCK_SIZE));
+    }
+    buf = b->data + b->len;
+    if (fread(buf, 1, len, rr_nondet_log->fp) != len) return NULL;
+    b->len += alloc_len;
+    b->refs++;
+    *block = b;
+    return buf;
+}
+
 //mz avoid actually releasing memory
 static RR_log_entry *recycle_list = NULL;
 
@@ -627,18 +1476,26 @@ static inline void free_entry_params(RR_log_entry *entry)
         case RR_SKIPPED_CALL:
             switch (entry->variant.call_args.kind) {
                 case RR_CALL_CPU_MEM_RW:
-                    g_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
                     entry->variant.call_args.variant.cpu_mem_rw_args.buf = NULL;
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
-                    g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
                     entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
                     break;
 	        case RR_CALL_HANDLE_PACKET:
-	            g_free(entry->variant.call_args.variant.handle_packet_args.buf);
 		    entry->variant.call_args.variant.handle_packet_args.buf = NULL;
 		    break;
             }
+            if (entry->payload_block) {
+                rr_payload_block_put(entry->payload_block);
+                entry->payload_block = NULL;
+            }
+            break;
+        case RR_DEBUG:
+            entry->variant.state_hash.pages = NULL;
+            if (entry->payload_block) {
+                rr_payload_block_put(entry->payload_block);
+                entry->payload_block = NULL;
+            }
             break;
         case RR_INPUT_1:
         case RR_INPUT_2:
@@ -695,7 +1552,7 @@ static RR_log_entry *rr_read_item(void) {
     rr_assert (rr_nondet_log->fp != NULL);
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
+    if (rr_log_fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
         //mz an error occurred
         if (feof(rr_nondet_log->fp)) {
             // replay is done - we've reached the end of file
@@ -709,8 +1566,8 @@ static RR_log_entry *rr_read_item(void) {
         }
     }
     //mz this is more compact, as it doesn't include extra padding.
-    rr_assert(fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
-    rr_assert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
+    rr_assert(rr_log_fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
+    rr_assert(rr_log_fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
 
     //mz let's do some counting
     rr_number_of_log_entries[item->header.kind]++;
@@ -720,86 +1577,84 @@ static RR_log_entry *rr_read_item(void) {
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            rr_assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_1);
             break;
         case RR_INPUT_2:
-            rr_assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_2);
             break;
         case RR_INPUT_4:
-            rr_assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_4);
             break;
         case RR_INPUT_8:
-            rr_assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.input_8);
             break;
         case RR_INTERRUPT_REQUEST:
-            rr_assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.interrupt_request);
             break;
         case RR_EXIT_REQUEST:
-            rr_assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            rr_assert(rr_log_fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
             rr_size_of_log_entries[item->header.kind] += sizeof(item->variant.exit_request);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                rr_assert(fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
+                rr_assert(rr_log_fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
                 rr_size_of_log_entries[item->header.kind] += sizeof(args->kind);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        rr_assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        rr_assert(rr_log_fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_rw_args);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
-                        //mz read the buffer
-                        rr_assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
+                        //mz read the buffer.  we release it when the item is added to the recycle list
+                        args->variant.cpu_mem_rw_args.buf =
+                            rr_log_read_payload(args->variant.cpu_mem_rw_args.len, &item->payload_block);
+                        rr_assert(args->variant.cpu_mem_rw_args.buf != NULL);
                         rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_rw_args.len;
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        rr_assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        rr_assert(rr_log_fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_unmap);
-                        args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
-                        rr_assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
+                        args->variant.cpu_mem_unmap.buf =
+                            rr_log_read_payload(args->variant.cpu_mem_unmap.len, &item->payload_block);
+                        rr_assert(args->variant.cpu_mem_unmap.buf != NULL);
                         rr_size_of_log_entries[item->header.kind] += args->variant.cpu_mem_unmap.len;
                         break;
 
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        rr_assert(fread(&(args->variant.cpu_mem_reg_region_args), 
+                        rr_assert(rr_log_fread(&(args->variant.cpu_mem_reg_region_args), 
                               sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp) == 1);
                         rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.cpu_mem_reg_region_args);
                         break;
 		     
 		    case RR_CALL_HD_TRANSFER:
-		        rr_assert(fread(&(args->variant.hd_transfer_args),
+		        rr_assert(rr_log_fread(&(args->variant.hd_transfer_args),
 			      sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
 			rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.hd_transfer_args);
 			break;
 		    
                     case RR_CALL_NET_TRANSFER:
-		        rr_assert(fread(&(args->variant.net_transfer_args),
+		        rr_assert(rr_log_fread(&(args->variant.net_transfer_args),
 			      sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
 			rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.net_transfer_args);
 			break;
 		    
 		    case RR_CALL_HANDLE_PACKET:
-  		        rr_assert(fread(&(args->variant.handle_packet_args), 
+  		        rr_assert(rr_log_fread(&(args->variant.handle_packet_args), 
 					sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
 		        rr_size_of_log_entries[item->header.kind] += sizeof(args->variant.handle_packet_args);
 			//mz XXX HACK
 			args->old_buf_addr = (uint64_t) args->variant.handle_packet_args.buf;
 			//mz buffer length in args->variant.cpu_mem_rw_args.len 
-			//mz always allocate a new one. we free it when the item is added to the recycle list
+			//mz read the buffer.  we release it when the item is added to the recycle list
 			args->variant.handle_packet_args.buf = 
-			  g_malloc(args->variant.handle_packet_args.size);
-			//mz read the buffer 
-			assert (fread(args->variant.handle_packet_args.buf, 
-				      args->variant.handle_packet_args.size, 1,
-                                      rr_nondet_log->fp) == 1 /*> 0*/);
+			  rr_log_read_payload(args->variant.handle_packet_args.size, &item->payload_block);
+			assert (args->variant.handle_packet_args.buf != NULL);
 			rr_size_of_log_entries[item->header.kind] += args->variant.handle_packet_args.size;
 			break;
 
@@ -809,8 +1664,21 @@ static RR_log_entry *rr_read_item(void) {
                 }
             }
             break;
-        case RR_LAST:
         case RR_DEBUG:
+            {
+                RR_state_hash *hash = &item->variant.state_hash;
+                rr_assert(rr_log_fread(hash, sizeof(*hash), 1, rr_nondet_log->fp) == 1);
+                hash->pages = NULL;
+                if (hash->num_pages > 0) {
+                    hash->pages = (RR_page_hash *)
+                        rr_log_read_payload(hash->num_pages * sizeof(RR_page_hash), &item->payload_block);
+                    rr_assert(hash->pages != NULL);
+                }
+                rr_size_of_log_entries[item->header.kind] +=
+                    sizeof(*hash) + hash->num_pages * sizeof(RR_page_hash);
+            }
+            break;
+        case RR_LAST:
             //mz nothing to read
             break;
         default:
@@ -824,10 +1692,13 @@ static RR_log_entry *rr_read_item(void) {
 
 #define RR_MAX_QUEUE_LEN 65536
 
+static void rr_telemetry_poll(void);
+
 //mz fill the queue of log entries from the file
 static void rr_fill_queue(void) {
     RR_log_entry *log_entry = NULL;
     unsigned long long num_entries = 0;
+    RR_phase old_phase = rr_stats_enter(RR_PHASE_NONDET);
 
     //mz first, some sanity checks.  The queue should be empty when this is called.
     rr_assert(rr_queue_head == NULL && rr_queue_tail == NULL);
@@ -852,7 +1723,10 @@ static void rr_fill_queue(void) {
             break;
         }
         else if ((log_entry->header.kind == RR_SKIPPED_CALL && log_entry->header.callsite_loc == RR_CALLSITE_MAIN_LOOP_WAIT) ||
-                 log_entry->header.kind == RR_INTERRUPT_REQUEST) {
+                 log_entry->header.kind == RR_INTERRUPT_REQUEST ||
+                 // stop TBs at state hashes, so they're checked at the
+                 // same point they were recorded
+                 log_entry->header.kind == RR_DEBUG) {
             rr_num_instr_before_next_interrupt = log_entry->header.prog_point.guest_instr_count - rr_prog_point.guest_instr_count;
             break;
         }
@@ -868,6 +1742,8 @@ static void rr_fill_queue(void) {
     if (num_entries > rr_max_num_queue_entries) {
         rr_max_num_queue_entries = num_entries;
     }
+    rr_stats_enter(old_phase);
+    rr_telemetry_poll();
 #if RR_REPORT_PROGRESS
     static uint64_t num = 1;
     if ((rr_prog_point.guest_instr_count / (double)rr_nondet_log->last_prog_point.guest_instr_count) * 100 >= num) {
@@ -877,6 +1753,33 @@ static void rr_fill_queue(void) {
 #endif /* RR_REPORT_PROGRESS */
 }
 
+// position the replay log so that the next entry read is item number
+// item_number.  For a v2 log we jump to the chunk containing it using the
+// index; otherwise (and within that chunk) entries are read and dropped.
+static void rr_seek_log_item(uint64_t item_number) {
+    rr_assert(rr_queue_head == NULL && rr_queue_tail == NULL);
+    if (rr_nondet_log->version == 2 && rr_nondet_log->num_chunks > 0 &&
+        item_number > rr_nondet_log->item_number) {
+        RR_log_chunk_info *chunks = rr_nondet_log->chunks;
+        uint64_t lo = 0, hi = rr_nondet_log->num_chunks - 1;
+        // last chunk with first_item <= item_number
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo + 1) / 2;
+            if (chunks[mid].first_item <= item_number) lo = mid;
+            else hi = mid - 1;
+        }
+        if (chunks[lo].first_item > rr_nondet_log->item_number) {
+            rr_log_reader_stop();
+            rr_log_reader_start(rr_nondet_log, lo);
+            rr_nondet_log->item_number = chunks[lo].first_item;
+        }
+    }
+    while (rr_nondet_log->item_number < item_number) {
+        rr_assert(!rr_log_is_empty());
+        add_to_recycle_list(rr_read_item());
+    }
+}
+
 //mz return next log entry from the queue
 static inline RR_log_entry *get_next_entry(RR_log_entry_kind kind, RR_callsite_id call_site, bool check_callsite) 
 {
@@ -901,6 +1804,11 @@ static inline RR_log_entry *get_next_entry(RR_log_entry_kind kind, RR_callsite_i
             if (current == rr_queue_tail) {
                 rr_queue_tail = NULL;
             }
+            // puts back the payload block its hash pages are in
+            add_to_recycle_list(current);
+        }
+        if (rr_queue_head == NULL) {
+            return NULL;
         }
     }
 
@@ -951,36 +1859,34 @@ void rr_replay_debug(RR_callsite_id call_site) {
         // than in record due to TB chaining being off
         return;
     }
-    else if (log_point.guest_instr_count == rr_prog_point.guest_instr_count) {
+
+    current_item = rr_queue_head;
+    rr_queue_head = rr_queue_head->next;
+    current_item->next = NULL;
+    if (current_item == rr_queue_tail) {
+        rr_queue_tail = NULL;
+    }
+
+    if (log_point.guest_instr_count == rr_prog_point.guest_instr_count) {
         // We think we're in the right place now, so let's do more stringent checks
         if (log_point.secondary != rr_prog_point.secondary || log_point.pc != rr_prog_point.pc)
             rr_signal_disagreement(rr_prog_point, log_point);
-        
-        // We passed all these, so consume the log entry
-        current_item = rr_queue_head;
-        rr_queue_head = rr_queue_head->next;
-        current_item->next = NULL;
-        if (current_item == rr_queue_tail) {
-            rr_queue_tail = NULL;
-        }
-
-        add_to_recycle_list(current_item);
-        printf("RR_DEBUG check passed: ");
-        rr_spit_prog_point(rr_prog_point);
+#ifdef CONFIG_SOFTMMU
+        rr_check_state_hash(&current_item->variant.state_hash);
+#endif
     }
-    else { // log_point.guest_instr_count > rr_prog_point.guest_instr_count
+    else { // log_point.guest_instr_count < rr_prog_point.guest_instr_count
         // This shouldn't happen. We're ahead of the log.
-        //rr_signal_disagreement(rr_prog_point, log_point);
-        current_item = rr_queue_head;
-        rr_queue_head = rr_queue_head->next;
-        current_item->next = NULL;
-        if (current_item == rr_queue_tail) {
-            rr_queue_tail = NULL;
+        if (rr_debug_whisper()) {
+            fprintf(logfile, "missed state hash at ");
+            rr_debug_log_prog_point(log_point);
         }
+    }
 
-        add_to_recycle_list(current_item);
-
-        //abort();
+    add_to_recycle_list(current_item);
+    //mz the hash stopped the queue; fill it up to the next interrupt value
+    if (rr_queue_head == NULL) {
+        rr_fill_queue();
     }
 }
 
@@ -1162,7 +2068,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
 		    // run all callbacks registered for hd transfer
 		    RR_hd_transfer_args *hdt = &(args->variant.hd_transfer_args);
 		    panda_cb_list *plist;
-		    for (plist = panda_cbs[PANDA_CB_REPLAY_HD_TRANSFER]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		    panda_cb_list **pcb;
+		    PANDA_CB_FOREACH(PANDA_CB_REPLAY_HD_TRANSFER, pcb, plist) {
 		      plist->entry.replay_hd_transfer
 			(cpu_single_env, 
 			 hdt->type,
@@ -1178,7 +2085,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
 		    // run all callbacks registered for packet handling
 		    RR_handle_packet_args *hp = &(args->variant.handle_packet_args);
 		    panda_cb_list *plist;
-		    for (plist = panda_cbs[PANDA_CB_REPLAY_HANDLE_PACKET]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		    panda_cb_list **pcb;
+		    PANDA_CB_FOREACH(PANDA_CB_REPLAY_HANDLE_PACKET, pcb, plist) {
 		      plist->entry.replay_handle_packet
 			(cpu_single_env, 
 			 hp->buf,
@@ -1197,8 +2105,8 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site) {
                     RR_net_transfer_args *nta =
                         &(args->variant.net_transfer_args);
                     panda_cb_list *plist;
-                    for (plist = panda_cbs[PANDA_CB_REPLAY_NET_TRANSFER];
-                            plist != NULL; plist = panda_cb_list_next(plist)) {
+                    panda_cb_list **pcb;
+                    PANDA_CB_FOREACH(PANDA_CB_REPLAY_NET_TRANSFER, pcb, plist) {
                       plist->entry.replay_net_transfer
                         (cpu_single_env, 
                          nta->type,
@@ -1252,7 +2160,21 @@ void rr_create_record_log (const char *filename) {
   //count as a monotonicly increasing measure of progress.
   //This way, when we print progress, we can use something better than size of log consumed
   //(as that can jump //sporadically).
-  fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+  if (rr_record_compressed) {
+    // v2 header also holds the location of the chunk index, also filled in at close
+    RR_log_v2_header hdr = {{0}};
+    rr_nondet_log->version = 2;
+    memcpy(hdr.magic, RR_LOG_V2_MAGIC, sizeof(hdr.magic));
+    fwrite(&hdr, sizeof(hdr), 1, rr_nondet_log->fp);
+  }
+  else {
+    rr_nondet_log->version = 1;
+    fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+  }
+  // everything after the header goes through the async writer, if enabled
+  if (rr_async_num_bufs > 0) {
+    rr_async_writer_start(rr_nondet_log, rr_async_num_bufs);
+  }
 }
 
 
@@ -1266,6 +2188,10 @@ void rr_create_replay_log (const char *filename) {
   rr_nondet_log->type = REPLAY;
   rr_nondet_log->name = g_strdup(filename);
   rr_nondet_log->fp = fopen(rr_nondet_log->name, "r");
+  if (!rr_payload_lock_inited) {
+    qemu_mutex_init(&rr_payload_lock);
+    rr_payload_lock_inited = true;
+  }
   rr_assert(rr_nondet_log->fp != NULL);
 
   //mz fill in log size
@@ -1276,7 +2202,26 @@ void rr_create_replay_log (const char *filename) {
 	     rr_nondet_log->name, rr_nondet_log->size);
   }
   //mz read the last program point from the log header.
-  rr_assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  RR_log_v2_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, rr_nondet_log->fp) == 1 &&
+      memcmp(hdr.magic, RR_LOG_V2_MAGIC, sizeof(hdr.magic)) == 0) {
+    rr_nondet_log->version = 2;
+    rr_nondet_log->last_prog_point = hdr.last_prog_point;
+    rr_nondet_log->num_chunks = rr_nondet_log->chunks_cap = hdr.num_chunks;
+    rr_nondet_log->chunks = g_new(RR_log_chunk_info, hdr.num_chunks);
+    rr_assert(fseeko(rr_nondet_log->fp, hdr.index_offset, SEEK_SET) == 0);
+    rr_assert(fread(rr_nondet_log->chunks, sizeof(RR_log_chunk_info),
+                    hdr.num_chunks, rr_nondet_log->fp) == hdr.num_chunks);
+    if (rr_debug_whisper()) {
+      fprintf (logfile, "v2 log with %llu chunks\n", (unsigned long long) hdr.num_chunks);
+    }
+    rr_log_reader_start(rr_nondet_log, 0);
+  }
+  else {
+    rr_nondet_log->version = 1;
+    rewind(rr_nondet_log->fp);
+    rr_assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  }
 }
 
 
@@ -1285,12 +2230,40 @@ void rr_destroy_log(void) {
   if (rr_nondet_log->fp) {
     //mz if in record, update the header with the last written prog point.
     if (rr_nondet_log->type == RECORD) {
-        rewind(rr_nondet_log->fp);
-        fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+        // drain the async writer before we touch the file ourselves
+        if (rr_nondet_log->version == 2) {
+            rr_log_flush_chunk();
+        }
+        rr_async_writer_stop();
+        if (rr_nondet_log->version == 2) {
+            // append the chunk index, then point the header at it
+            RR_log_v2_header hdr = {{0}};
+            memcpy(hdr.magic, RR_LOG_V2_MAGIC, sizeof(hdr.magic));
+            hdr.last_prog_point = rr_nondet_log->last_prog_point;
+            hdr.index_offset = ftello(rr_nondet_log->fp);
+            hdr.num_chunks = rr_nondet_log->num_chunks;
+            fwrite(rr_nondet_log->chunks, sizeof(RR_log_chunk_info),
+                   rr_nondet_log->num_chunks, rr_nondet_log->fp);
+            rewind(rr_nondet_log->fp);
+            fwrite(&hdr, sizeof(hdr), 1, rr_nondet_log->fp);
+            g_free(rr_chunk_buf.data);
+            memset(&rr_chunk_buf, 0, sizeof(rr_chunk_buf));
+        }
+        else {
+            rewind(rr_nondet_log->fp);
+            fwrite(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp);
+        }
+    }
+    else {
+        rr_log_reader_stop();
+        // blocks still used by queued entries go back to the pool (or are
+        // freed) as those entries are recycled
+        rr_payload_pool_free();
     }
     fclose(rr_nondet_log->fp);
     rr_nondet_log->fp = NULL;
   }
+  g_free(rr_nondet_log->chunks);
   g_free(rr_nondet_log->name);
   g_free(rr_nondet_log);
   rr_nondet_log = NULL;
@@ -1343,6 +2316,99 @@ uint64_t replay_get_total_num_instructions(void) {
   }
 }
 
+/******************************************************************************************/
+/* CHECKPOINTS */
+/******************************************************************************************/
+
+// "<path>/<name>" of the replay in progress; checkpoints are stored next to it
+static char *rr_checkpoint_prefix = NULL;
+// index of checkpoints taken so far, appended to during replay
+static FILE *rr_checkpoint_index = NULL;
+
+static inline void rr_get_checkpoint_file_name(uint64_t instr_count, char *file_name, size_t file_name_len) {
+  rr_assert (rr_checkpoint_prefix != NULL);
+  snprintf(file_name, file_name_len, "%s-rr-ckpt-%llu", rr_checkpoint_prefix,
+           (unsigned long long) instr_count);
+}
+
+static inline void rr_get_checkpoint_index_name(char *file_name, size_t file_name_len) {
+  rr_assert (rr_checkpoint_prefix != NULL);
+  snprintf(file_name, file_name_len, "%s-rr-ckpt.idx", rr_checkpoint_prefix);
+}
+
+// find the latest checkpoint at or before instr_count.  returns 0 if there is none.
+static int rr_find_checkpoint(uint64_t instr_count, RR_checkpoint *found) {
+  char name_buf[1024];
+  RR_checkpoint ckpt;
+  int have_one = 0;
+  rr_get_checkpoint_index_name(name_buf, sizeof(name_buf));
+  FILE *fp = fopen(name_buf, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fread(&ckpt, sizeof(ckpt), 1, fp) == 1) {
+    if (ckpt.prog_point.guest_instr_count <= instr_count &&
+        (!have_one || ckpt.prog_point.guest_instr_count > found->prog_point.guest_instr_count)) {
+      *found = ckpt;
+      have_one = 1;
+    }
+  }
+  fclose(fp);
+  return have_one;
+}
+
+static void rr_begin_checkpoints(void) {
+  char name_buf[1024];
+  if (rr_checkpoint_interval == 0) {
+    return;
+  }
+  rr_get_checkpoint_index_name(name_buf, sizeof(name_buf));
+  rr_checkpoint_index = fopen(name_buf, "a");
+  rr_assert(rr_checkpoint_index != NULL);
+  rr_next_checkpoint = (rr_prog_point.guest_instr_count / rr_checkpoint_interval + 1) * rr_checkpoint_interval;
+}
+
+static void rr_end_checkpoints(void) {
+  if (rr_checkpoint_index) {
+    fclose(rr_checkpoint_index);
+    rr_checkpoint_index = NULL;
+  }
+  g_free(rr_checkpoint_prefix);
+  rr_checkpoint_prefix = NULL;
+  rr_checkpoint_requested = 0;
+}
+
+// Save a checkpoint at the current program point.  The cpu loop requests
+// this between TBs; we're called from the main loop with the global mutex held.
+// Entries still sitting in the queue haven't been consumed, so the log
+// position recorded is that of the queue head.
+void rr_do_checkpoint(void) {
+#ifdef CONFIG_SOFTMMU
+  char name_buf[1024];
+  RR_checkpoint ckpt;
+  RR_log_entry *entry;
+  uint64_t num_queued = 0;
+
+  if (rr_checkpoint_index == NULL) {
+    rr_checkpoint_requested = 0;
+    return;
+  }
+  for (entry = rr_queue_head; entry != NULL; entry = entry->next) {
+    num_queued++;
+  }
+  ckpt.prog_point = rr_prog_point;
+  ckpt.item_number = rr_nondet_log->item_number - num_queued;
+  rr_get_checkpoint_file_name(ckpt.prog_point.guest_instr_count, name_buf, sizeof(name_buf));
+  printf ("writing checkpoint:\t%s\n", name_buf);
+  if (do_savevm_rr(get_monitor(), name_buf) == 0) {
+    fwrite(&ckpt, sizeof(ckpt), 1, rr_checkpoint_index);
+    fflush(rr_checkpoint_index);
+  }
+  rr_next_checkpoint = ckpt.prog_point.guest_instr_count + rr_checkpoint_interval;
+  rr_checkpoint_requested = 0;
+#endif
+}
+
 /******************************************************************************************/
 /* MONITOR CALLBACKS (top-level) */
 /******************************************************************************************/
@@ -1398,6 +2464,11 @@ void qmp_begin_replay(const char *file_name, Error **errp) {
   gettimeofday(&replay_start_time, 0);
 }
 
+void qmp_begin_replay_at(const char *file_name, int64_t instr_count, Error **errp) {
+  rr_replay_start_instr = instr_count;
+  qmp_begin_replay(file_name, errp);
+}
+
 
 void qmp_end_record(Error **errp) {
   qmp_stop(NULL);
@@ -1440,6 +2511,14 @@ void hmp_begin_replay(Monitor *mon, const QDict *qdict)
   qmp_begin_replay(file_name, &err);
 }
 
+void hmp_begin_replay_at(Monitor *mon, const QDict *qdict)
+{
+  Error *err;
+  const char *file_name = qdict_get_try_str(qdict, "file_name");
+  int64_t instr_count = qdict_get_int(qdict, "instr_count");
+  qmp_begin_replay_at(file_name, instr_count, &err);
+}
+
 void hmp_end_record(Monitor *mon, const QDict *qdict)
 {
   Error *err;
@@ -1454,6 +2533,269 @@ void hmp_end_replay(Monitor *mon, const QDict *qdict)
 
 #endif // CONFIG_SOFTMMU
 
+/******************************************************************************************/
+/* REPLAY STATS */
+/******************************************************************************************/
+
+// -replay-stats: write a JSON summary of each replay here (NULL = off)
+const char *rr_stats_file_name = NULL;
+// -replay-telemetry: append a line of JSON with the progress of the replay
+// to this file every rr_telemetry_interval seconds (NULL = off)
+const char *rr_telemetry_file_name = NULL;
+unsigned rr_telemetry_interval = 10;
+
+bool rr_stats_enabled = false;
+RR_phase rr_stats_phase = RR_PHASE_OTHER;
+int64_t rr_stats_phase_start;
+int64_t rr_stats_ticks[RR_PHASE_LAST];
+
+static const char *rr_phase_names[RR_PHASE_LAST] = {
+    "other", "translate", "exec", "callbacks", "nondet"
+};
+
+static char *rr_stats_replay_name;
+static uint64_t rr_stats_start_instr;
+static int64_t rr_stats_start_ticks;
+static int64_t rr_stats_start_ns;
+
+static FILE *rr_telemetry_fp;
+static int64_t rr_telemetry_next_ns;
+
+// Phase and callback times are only kept if something is going to report
+// them, but the start of the replay is always noted for "info replay".
+static void rr_stats_begin(const char *name) {
+  g_free(rr_stats_replay_name);
+  rr_stats_replay_name = g_strdup(name);
+  rr_stats_start_instr = rr_prog_point.guest_instr_count;
+  memset(rr_stats_ticks, 0, sizeof(rr_stats_ticks));
+  panda_reset_cb_cost();
+  rr_stats_phase = RR_PHASE_OTHER;
+  rr_stats_start_ns = get_clock();
+  rr_stats_start_ticks = rr_stats_phase_start = cpu_get_real_ticks();
+  if (rr_telemetry_file_name) {
+    rr_telemetry_fp = fopen(rr_telemetry_file_name, "a");
+    if (!rr_telemetry_fp) {
+      fprintf(stderr, "couldn't open replay telemetry file %s: %s\n",
+              rr_telemetry_file_name, strerror(errno));
+    }
+    rr_telemetry_next_ns = rr_stats_start_ns + rr_telemetry_interval * 1000000000LL;
+  }
+  rr_stats_enabled = (rr_stats_file_name != NULL || rr_telemetry_fp != NULL);
+}
+
+// Phases and callbacks are timed with the host cycle counter, which is
+// cheap to read but isn't in seconds.  Scale it by how far the wall clock
+// has moved since the replay started.
+static double rr_stats_secs_per_tick(void) {
+  int64_t ticks = cpu_get_real_ticks() - rr_stats_start_ticks;
+  double secs = (get_clock() - rr_stats_start_ns) / 1e9;
+  return ticks > 0 ? secs / ticks : 0;
+}
+
+static ReplayInfo *rr_replay_info(void) {
+  ReplayInfo *info = g_malloc0(sizeof(*info));
+  int i;
+
+  if (!rr_in_replay() || rr_nondet_log == NULL) {
+    info->active = false;
+    return info;
+  }
+  uint64_t instrs = rr_prog_point.guest_instr_count - rr_stats_start_instr;
+  double secs = (get_clock() - rr_stats_start_ns) / 1e9;
+  info->active = true;
+  info->has_name = true;
+  info->name = g_strdup(rr_stats_replay_name);
+  info->has_instr_count = true;
+  info->instr_count = rr_prog_point.guest_instr_count;
+  info->has_pc = true;
+  info->pc = rr_prog_point.pc;
+  info->has_secondary = true;
+  info->secondary = rr_prog_point.secondary;
+  info->has_total_instr = true;
+  info->total_instr = rr_nondet_log->last_prog_point.guest_instr_count;
+  info->has_seconds = true;
+  info->seconds = secs;
+  info->has_instr_per_sec = true;
+  info->instr_per_sec = secs > 0 ? instrs / secs : 0;
+  info->has_max_queue_len = true;
+  info->max_queue_len = rr_max_num_queue_entries;
+
+  ReplayLogEntryInfoList **entry_tail = &info->log_entries;
+  for (i = 0; i < RR_LAST; i++) {
+    if (rr_number_of_log_entries[i] == 0) {
+      continue;
+    }
+    ReplayLogEntryInfoList *entry = g_malloc0(sizeof(*entry));
+    entry->value = g_malloc0(sizeof(*entry->value));
+    entry->value->kind = g_strdup(get_log_entry_kind_string((RR_log_entry_kind) i));
+    entry->value->count = rr_number_of_log_entries[i];
+    entry->value->bytes = rr_size_of_log_entries[i];
+    *entry_tail = entry;
+    entry_tail = &entry->next;
+  }
+  info->has_log_entries = (info->log_entries != NULL);
+
+  if (rr_stats_enabled) {
+    double secs_per_tick = rr_stats_secs_per_tick();
+    ReplayPluginInfoList **plugin_tail = &info->plugins;
+    const char *name;
+    uint64_t ticks, calls;
+    for (i = 0; (name = panda_plugin_cb_cost(i, &ticks, &calls)) != NULL; i++) {
+      ReplayPluginInfoList *plugin = g_malloc0(sizeof(*plugin));
+      plugin->value = g_malloc0(sizeof(*plugin->value));
+      plugin->value->name = g_strdup(name);
+      plugin->value->calls = calls;
+      plugin->value->seconds = ticks * secs_per_tick;
+      *plugin_tail = plugin;
+      plugin_tail = &plugin->next;
+    }
+    info->has_plugins = true;
+  }
+  return info;
+}
+
+ReplayInfo *qmp_query_replay(Error **errp) {
+  return rr_replay_info();
+}
+
+void hmp_info_replay(Monitor *mon) {
+  ReplayInfo *info = qmp_query_replay(NULL);
+  ReplayLogEntryInfoList *entry;
+  ReplayPluginInfoList *plugin;
+
+  if (!info->active) {
+    monitor_printf(mon, "no replay running\n");
+    qapi_free_ReplayInfo(info);
+    return;
+  }
+  monitor_printf(mon, "%s: %" PRId64 " of %" PRId64 " instrs (%.2f%%), pc 0x%" PRIx64 "\n",
+                 info->name, info->instr_count, info->total_instr,
+                 info->total_instr ? info->instr_count * 100.0 / info->total_instr : 0,
+                 info->pc);
+  monitor_printf(mon, "%.1f sec, %.0f instr/sec, max queue len %" PRId64 "\n",
+                 info->seconds, info->instr_per_sec, info->max_queue_len);
+  for (entry = info->log_entries; entry != NULL; entry = entry->next) {
+    monitor_printf(mon, "  %-24s %12" PRId64 " entries %14" PRId64 " bytes\n",
+                   entry->value->kind, entry->value->count, entry->value->bytes);
+  }
+  if (info->has_plugins) {
+    for (plugin = info->plugins; plugin != NULL; plugin = plugin->next) {
+      monitor_printf(mon, "  %-24s %12" PRId64 " calls %12.3f sec\n",
+                     plugin->value->name, plugin->value->calls,
+                     plugin->value->seconds);
+    }
+  }
+  else {
+    monitor_printf(mon, "callbacks aren't timed without -replay-stats or -replay-telemetry\n");
+  }
+  qapi_free_ReplayInfo(info);
+}
+
+static void rr_telemetry_write(void) {
+  ReplayInfo *info = rr_replay_info();
+  QmpOutputVisitor *mo = qmp_output_visitor_new();
+  QObject *obj;
+  QString *json;
+
+  visit_type_ReplayInfo(qmp_output_get_visitor(mo), &info, NULL, NULL);
+  obj = qmp_output_get_qobject(mo);
+  json = qobject_to_json(obj);
+  fprintf(rr_telemetry_fp, "%s\n", qstring_get_str(json));
+  fflush(rr_telemetry_fp);
+  QDECREF(json);
+  qobject_decref(obj);
+  qmp_output_visitor_cleanup(mo);
+  qapi_free_ReplayInfo(info);
+}
+
+// called as the nondet log is read, which is often enough
+static void rr_telemetry_poll(void) {
+  if (rr_telemetry_fp) {
+    int64_t now = get_clock();
+    if (now >= rr_telemetry_next_ns) {
+      rr_telemetry_write();
+      rr_telemetry_next_ns = now + rr_telemetry_interval * 1000000000LL;
+    }
+  }
+}
+
+static void rr_stats_json_string(FILE *fp, const char *str) {
+  fputc('"', fp);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(fp, "\\%c", *str);
+    }
+    else if ((unsigned char) *str < 0x20) {
+      fprintf(fp, "\\u%04x", *str);
+    }
+    else {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+static void rr_stats_end(const char *status) {
+  int i;
+  if (!rr_stats_enabled) {
+    return;
+  }
+  rr_stats_enter(RR_PHASE_OTHER);
+
+  if (rr_telemetry_fp) {
+    rr_telemetry_write();
+    fclose(rr_telemetry_fp);
+    rr_telemetry_fp = NULL;
+  }
+  if (rr_stats_file_name == NULL) {
+    rr_stats_enabled = false;
+    return;
+  }
+
+  double secs = (get_clock() - rr_stats_start_ns) / 1e9;
+  double secs_per_tick = rr_stats_secs_per_tick();
+  uint64_t instrs = rr_prog_point.guest_instr_count - rr_stats_start_instr;
+  struct rusage rusage;
+  getrusage(RUSAGE_SELF, &rusage);
+
+  FILE *fp = fopen(rr_stats_file_name, "w");
+  if (!fp) {
+    fprintf(stderr, "couldn't write replay stats to %s: %s\n",
+            rr_stats_file_name, strerror(errno));
+    rr_stats_enabled = false;
+    return;
+  }
+  fprintf(fp, "{\n  \"replay\": ");
+  rr_stats_json_string(fp, rr_stats_replay_name);
+  fprintf(fp, ",\n  \"status\": \"%s\",\n", status);
+  fprintf(fp, "  \"instructions\": %llu,\n", (unsigned long long) instrs);
+  fprintf(fp, "  \"seconds\": %.6f,\n", secs);
+  fprintf(fp, "  \"instr_per_sec\": %.1f,\n", secs > 0 ? instrs / secs : 0);
+  fprintf(fp, "  \"phase_seconds\": {");
+  for (i = 0; i < RR_PHASE_LAST; i++) {
+    fprintf(fp, "%s\n    \"%s\": %.6f", i ? "," : "", rr_phase_names[i],
+            rr_stats_ticks[i] * secs_per_tick);
+  }
+  fprintf(fp, "\n  },\n");
+  fprintf(fp, "  \"plugins\": [");
+  {
+    const char *name;
+    uint64_t ticks, calls;
+    for (i = 0; (name = panda_plugin_cb_cost(i, &ticks, &calls)) != NULL; i++) {
+      fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+      rr_stats_json_string(fp, name);
+      fprintf(fp, ", \"calls\": %llu, \"seconds\": %.6f}",
+              (unsigned long long) calls, ticks * secs_per_tick);
+    }
+  }
+  fprintf(fp, "\n  ],\n");
+  // ru_maxrss is in kilobytes on Linux
+  fprintf(fp, "  \"peak_rss_kb\": %ld\n}\n", rusage.ru_maxrss);
+  fclose(fp);
+  printf("replay stats written to %s\n", rr_stats_file_name);
+  rr_stats_enabled = false;
+}
+
 static time_t rr_start_time;
 
 //mz file_name_full should be full path to desired record/replay log file
@@ -1495,6 +2837,7 @@ int rr_do_begin_record(const char *file_name_full, void *cpu_state) {
   rr_reset_state(cpu_state);
   g_free(rr_path_base);
   g_free(rr_name_base);
+  rr_begin_state_hashes();
   // set global to turn on recording
   rr_mode = RR_RECORD;
   //cpu_set_log(CPU_LOG_TB_IN_ASM|CPU_LOG_RR);
@@ -1551,16 +2894,33 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
     fprintf (logfile,"Begin vm replay for file_name_full = %s\n", file_name_full);    
     fprintf (logfile,"path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
   }
-  // first retrieve snapshot
-  rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+  // first retrieve snapshot, or the nearest checkpoint if starting later on
+  RR_checkpoint ckpt;
+  int from_checkpoint = 0;
+  g_free(rr_checkpoint_prefix);
+  rr_checkpoint_prefix = g_strdup_printf("%s/%s", rr_path, rr_name);
+  if (rr_replay_start_instr > 0) {
+    from_checkpoint = rr_find_checkpoint(rr_replay_start_instr, &ckpt);
+    if (!from_checkpoint) {
+      printf ("no checkpoint at or before instr %llu, replaying from the start\n",
+              (unsigned long long) rr_replay_start_instr);
+    }
+    rr_replay_start_instr = 0;
+  }
+  if (from_checkpoint) {
+    rr_get_checkpoint_file_name(ckpt.prog_point.guest_instr_count, name_buf, sizeof(name_buf));
+  }
+  else {
+    rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+  }
   if (rr_debug_whisper()) {
     fprintf (logfile,"reading snapshot:\t%s\n", name_buf);
   }
   printf ("loading snapshot\n");
   //  vm_stop(0) RUN_STATE_RESTORE_VM);
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_BEFORE_REPLAY_LOADVM]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_list **pcb;
+    PANDA_CB_FOREACH(PANDA_CB_BEFORE_REPLAY_LOADVM, pcb, plist) {
         plist->entry.before_loadvm();
     }
   snapshot_ret = load_vmstate_rr(name_buf);
@@ -1584,6 +2944,17 @@ int rr_do_begin_replay(const char *file_name_full, void *cpu_state) {
   rr_reset_state(cpu_state);
   // set global to turn on replay
   rr_mode = RR_REPLAY;
+  if (from_checkpoint) {
+    // skip the part of the log that was consumed before the checkpoint
+    printf ("seeking nondet log to instr %llu\n",
+            (unsigned long long) ckpt.prog_point.guest_instr_count);
+    rr_seek_log_item(ckpt.item_number);
+    rr_prog_point = ckpt.prog_point;
+    rr_set_rr_guest_instr_count(cpu_state, ckpt.prog_point.guest_instr_count);
+  }
+  rr_begin_checkpoints();
+  rr_begin_state_hashes();
+  rr_stats_begin(file_name_full);
 
   //cpu_set_log(CPU_LOG_TB_IN_ASM|CPU_LOG_RR);
 
@@ -1611,6 +2982,15 @@ void rr_do_end_replay(int is_error) {
     time_t rr_end_time;
     time(&rr_end_time);
     printf("Time taken was: %ld seconds.\n", rr_end_time - rr_start_time);
+    if (is_error) {
+        rr_stats_end("error");
+    }
+    else if (rr_queue_head != NULL && rr_queue_head->header.kind == RR_LAST) {
+        rr_stats_end("complete");
+    }
+    else {
+        rr_stats_end("stopped");
+    }
     
     printf ("Stats:\n");
     for (i = 0; i < RR_LAST; i++) {
@@ -1663,6 +3043,7 @@ void rr_do_end_replay(int is_error) {
     log_all_cpu_states();
     // close logs
     rr_destroy_log();
+    rr_end_checkpoints();
     // turn off replay
     rr_mode = RR_OFF;
 
@@ -19,6 +19,34 @@ double rr_get_percentage(void);
 
 
 void rr_clear_rr_guest_instr_count(CPUState *cpu_state);
+void rr_set_rr_guest_instr_count(CPUState *cpu_state, uint64_t guest_instr_count);
+
+// true iff TBs being translated now should carry the replay chaining check.
+// Only the i386 and arm translators emit it (gen_rr_chain_start), so other
+// targets never chain in replay.
+static inline int rr_replay_chain_tbs(void) {
+#if defined(TARGET_I386) || defined(TARGET_X86_64) || defined(TARGET_ARM)
+  return rr_in_replay() && rr_replay_chaining && !use_icount;
+#else
+  return 0;
+#endif
+}
+
+// How many instructions TBs chained after tb may run before coming back to
+// cpu_exec(): up to the next replay event, checkpoint or end of replay.  tb
+// itself is about to run from cpu_exec(), so it always fits.
+static inline int32_t rr_get_chain_budget(TranslationBlock *tb) {
+  uint64_t now = rr_prog_point.guest_instr_count;
+  uint64_t budget = rr_num_instr_before_next_interrupt;
+  if (rr_checkpoint_interval != 0 && rr_next_checkpoint > now) {
+    budget = MIN(budget, rr_next_checkpoint - now);
+  }
+  if (rr_replay_end_instr != 0 && rr_replay_end_instr > now) {
+    budget = MIN(budget, rr_replay_end_instr - now);
+  }
+  budget = MAX(budget, tb->num_guest_insns);
+  return MIN(budget, INT32_MAX);
+}
 
 //mz structure for arguments to cpu_physical_memory_rw()
 typedef struct {
@@ -59,6 +87,20 @@ static inline void rr_reg_mem_call_record(target_phys_addr_t start_addr, ram_add
     rr_record_cpu_reg_io_mem_region((RR_callsite_id) rr_skipped_callsite_location, start_addr, size, phys_offset);
 }
 
+// hash of one guest RAM page that was written since the last state hash
+typedef struct {
+    uint64_t ram_addr;
+    uint64_t hash;
+} RR_page_hash;
+
+// A state hash, for finding where replay diverges from record.  On disk
+// it is followed by num_pages RR_page_hash, in ram_addr order.
+typedef struct {
+    uint64_t cpu_hash;
+    uint32_t num_pages;
+    RR_page_hash *pages;
+} RR_state_hash;
+
 //mz using uint8_t for kind and callsite_loc to control space - enums default to int.
 //mz NOTE: make sure RR_callsite_id has at most 255 members
 //mz NOTE: make sure RR_log_entry_kind has at most 255 members
@@ -102,12 +144,58 @@ typedef struct rr_log_entry_t {
         uint16_t exit_request;
         // if log_entry.kind == RR_SKIPPED_CALL
         RR_skipped_call_args call_args;
+        // if log_entry.kind == RR_DEBUG
+        RR_state_hash state_hash;
         // if log_entry.kind == RR_LAST
         // no variant fields
     } variant;
+    // replay only: block holding this entry's buffer, if it has one
+    struct RR_payload_block *payload_block;
     struct rr_log_entry_t *next;
 } RR_log_entry;
 
+// v2 nondet log format.  The entry stream is the same as in v1, but it is
+// split into independently zlib-compressed chunks, each of which starts on an
+// entry boundary, and a chunk index is appended at the end so that readers
+// can find the chunk containing a given instruction count.
+//
+//   file:   RR_log_v2_header, chunk 0, ..., chunk N-1, RR_log_chunk_info[N]
+//   chunk:  RR_log_chunk_header, compressed entries
+//
+// A v1 log starts with a bare RR_prog_point instead; the magic tells them apart.
+#define RR_LOG_V2_MAGIC "PANDARR2"
+#define RR_LOG_CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+    char magic[8];
+    RR_prog_point last_prog_point;
+    uint64_t index_offset;          // file offset of the chunk index
+    uint64_t num_chunks;
+} RR_log_v2_header;
+
+typedef struct {
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+} RR_log_chunk_header;
+
+// one entry of the chunk index
+typedef struct {
+    uint64_t offset;                // file offset of the RR_log_chunk_header
+    uint64_t first_instr;           // guest_instr_count of first entry in chunk
+    uint64_t last_instr;            // guest_instr_count of last entry in chunk
+    uint64_t first_item;            // item number of first entry in chunk
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+} RR_log_chunk_info;
+
+// A replay checkpoint.  The vm state at prog_point is saved in
+// <name>-rr-ckpt-<instr count>, and <name>-rr-ckpt.idx is an array of these.
+// item_number is the first log entry that had not been consumed there.
+typedef struct {
+    RR_prog_point prog_point;
+    uint64_t item_number;
+} RR_checkpoint;
+
 // a program-point indexed record/replay log
 typedef enum {RECORD, REPLAY} RR_log_type;
 typedef struct RR_log_t {
@@ -122,6 +210,11 @@ typedef struct RR_log_t {
   RR_log_entry current_item;
   uint8_t current_item_valid;
   unsigned long long item_number;
+
+  uint8_t version;             // on-disk format, 1 or 2
+  RR_log_chunk_info *chunks;   // v2 only: chunk index
+  uint64_t num_chunks;
+  uint64_t chunks_cap;
 } RR_log;
 
 RR_log_entry *rr_get_queue_head(void);
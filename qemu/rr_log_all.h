@@ -32,6 +32,7 @@
 #include <signal.h>
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <assert.h>
 
 typedef enum {RR_OFF, RR_RECORD, RR_REPLAY} RR_mode;
@@ -52,12 +53,38 @@ extern volatile int rr_end_replay_requested;
 extern char *rr_requested_name;
 extern char *rr_snapshot_name;
 
+// number of in-memory buffers for the asynchronous record log writer (0 = off)
+extern unsigned rr_async_num_bufs;
+// write the chunked, compressed (v2) log format when recording
+extern bool rr_record_compressed;
+// save a replay checkpoint every this many instructions (0 = off)
+extern uint64_t rr_checkpoint_interval;
+extern uint64_t rr_next_checkpoint;
+// start the next replay from the nearest checkpoint at or before this instr
+extern uint64_t rr_replay_start_instr;
+// end the replay at this instr (0 = run to the end of the log)
+extern uint64_t rr_replay_end_instr;
+// chain TBs during replay, bounded by the distance to the next replay event
+extern bool rr_replay_chaining;
+// set by the cpu loop when a checkpoint is due, cleared once it's written
+extern volatile sig_atomic_t rr_checkpoint_requested;
+// record a hash of CPU and RAM state every this many instructions (0 = off)
+extern uint64_t rr_hash_interval;
+extern uint64_t rr_next_hash;
+// write a JSON summary of each replay's speed to this file (NULL = off)
+extern const char *rr_stats_file_name;
+// append a line of JSON with the replay's progress to this file every
+// rr_telemetry_interval seconds (NULL = off)
+extern const char *rr_telemetry_file_name;
+extern unsigned rr_telemetry_interval;
+
 // used from monitor.c 
 int  rr_do_begin_record(const char *name, void *cpu_state);
 void rr_do_end_record(void);
 int  rr_do_begin_replay(const char *name, void *cpu_state);
 void rr_do_end_replay(int is_error);
 void rr_reset_state(void *cpu_state);
+void rr_do_checkpoint(void);
 
 //mz display indication of replay progress
 extern void replay_progress(void);
@@ -587,6 +614,18 @@ static inline uint8_t rr_on(void) {
   return (!rr_off());
 }
 
+// true iff replay has reached the next checkpoint
+static inline uint8_t rr_checkpoint_due(void) {
+  return (rr_checkpoint_interval != 0 &&
+          rr_prog_point.guest_instr_count >= rr_next_checkpoint);
+}
+
+// true iff record should log a state hash now
+static inline uint8_t rr_hash_due(void) {
+  return (rr_hash_interval != 0 &&
+          rr_prog_point.guest_instr_count >= rr_next_hash);
+}
+
 //mz flag indicating that TB cache flush has been requested
 extern uint8_t rr_please_flush_tb;
 // returns true if we are supposed to be flushing the tb whenever possible.
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <glib.h>
+#include <zlib.h>
 
 #define RR_LOG_STANDALONE
 #include "cpu.h"
@@ -27,7 +28,56 @@ volatile sig_atomic_t rr_use_live_exit_request = 0;
 //mz the log of non-deterministic events
 RR_log *rr_nondet_log = NULL;
 
+// v2 logs: decompressed contents of the current chunk
+static uint8_t *chunk_data = NULL;
+static size_t chunk_len = 0;
+static size_t chunk_pos = 0;
+static uint64_t next_chunk = 0;
+
+static void load_next_chunk(void) {
+    RR_log_chunk_info *info = &rr_nondet_log->chunks[next_chunk++];
+    uint8_t *zbuf = g_malloc(info->compressed_size);
+    uLongf len = info->uncompressed_size;
+    assert(fseeko(rr_nondet_log->fp, info->offset + sizeof(RR_log_chunk_header), SEEK_SET) == 0);
+    assert(fread(zbuf, 1, info->compressed_size, rr_nondet_log->fp) == info->compressed_size);
+    chunk_data = g_realloc(chunk_data, len);
+    assert(uncompress(chunk_data, &len, zbuf, info->compressed_size) == Z_OK);
+    chunk_len = len;
+    chunk_pos = 0;
+    g_free(zbuf);
+}
+
+// drop-in for fread that understands both log versions
+static size_t log_fread(void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    if (rr_nondet_log->version == 2) {
+        size_t want = size * nmemb;
+        if (chunk_pos == chunk_len) {
+            if (next_chunk >= rr_nondet_log->num_chunks) return 0;
+            load_next_chunk();
+        }
+        if (chunk_len - chunk_pos < want) return 0;
+        memcpy(ptr, chunk_data + chunk_pos, want);
+        chunk_pos += want;
+        return nmemb;
+    }
+    return fread(ptr, size, nmemb, fp);
+}
+
+// skip over a buffer we don't print
+static void log_skip(size_t n) {
+    if (rr_nondet_log->version == 2) {
+        assert(chunk_len - chunk_pos >= n);
+        chunk_pos += n;
+    }
+    else {
+        fseek(rr_nondet_log->fp, n, SEEK_CUR);
+    }
+}
+
 static inline uint8_t log_is_empty(void) {
+    if (rr_nondet_log->version == 2) {
+        return chunk_pos == chunk_len && next_chunk >= rr_nondet_log->num_chunks;
+    }
     if ((rr_nondet_log->type == REPLAY) &&
         (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
         return 1;
@@ -112,7 +162,9 @@ static void rr_spit_log_entry(RR_log_entry item) {
             printf("\tRR_LAST\n");
             break;
         case RR_DEBUG:
-            printf("\tRR_DEBUG\n");
+            printf("\tRR_DEBUG cpu_hash=%016llx, %u pages\n",
+                    (unsigned long long) item.variant.state_hash.cpu_hash,
+                    item.variant.state_hash.num_pages);
             break;
         default:
             printf("\tUNKNOWN RR log kind %d\n", item.header.kind);
@@ -165,7 +217,7 @@ static RR_log_entry *rr_read_item(void) {
     assert (rr_nondet_log->fp != NULL);
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
+    if (log_fread(&(item->header.prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) != 1) {
         //mz an error occurred
         if (feof(rr_nondet_log->fp)) {
             // replay is done - we've reached the end of file
@@ -179,69 +231,68 @@ static RR_log_entry *rr_read_item(void) {
         }
     }
     //mz this is more compact, as it doesn't include extra padding.
-    assert(fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
-    assert(fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
+    assert(log_fread(&(item->header.kind), sizeof(item->header.kind), 1, rr_nondet_log->fp) == 1);
+    assert(log_fread(&(item->header.callsite_loc), sizeof(item->header.callsite_loc), 1, rr_nondet_log->fp) == 1);
 
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_INPUT_2:
-            assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_INPUT_4:
-            assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_INPUT_8:
-            assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_EXIT_REQUEST:
-            assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                assert(fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
+                assert(log_fread(&(args->kind), sizeof(args->kind), 1, rr_nondet_log->fp) == 1);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        assert(log_fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
                         //mz buffer length in args->variant.cpu_mem_unmap.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_CPU_REG_MEM_REGION:
-                        assert(fread(&(args->variant.cpu_mem_reg_region_args), 
+                        assert(log_fread(&(args->variant.cpu_mem_reg_region_args), 
                               sizeof(args->variant.cpu_mem_reg_region_args), 1, rr_nondet_log->fp) == 1);
                         break;
                     case RR_CALL_HD_TRANSFER:
-                        assert(fread(&(args->variant.hd_transfer_args),
+                        assert(log_fread(&(args->variant.hd_transfer_args),
                               sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
                         break;
                     case RR_CALL_HANDLE_PACKET:
-                        assert(fread(&(args->variant.handle_packet_args),
+                        assert(log_fread(&(args->variant.handle_packet_args),
                               sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
+                        log_skip(args->variant.handle_packet_args.size);
                         break;
                     case RR_CALL_NET_TRANSFER:
-                        assert(fread(&(args->variant.net_transfer_args),
+                        assert(log_fread(&(args->variant.net_transfer_args),
                               sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
                         break;
                     default:
@@ -250,8 +301,13 @@ static RR_log_entry *rr_read_item(void) {
                 }
             }
             break;
-        case RR_LAST:
         case RR_DEBUG:
+            assert(log_fread(&(item->variant.state_hash),
+                  sizeof(item->variant.state_hash), 1, rr_nondet_log->fp) == 1);
+            log_skip(item->variant.state_hash.num_pages * sizeof(RR_page_hash));
+            item->variant.state_hash.pages = NULL;
+            break;
+        case RR_LAST:
             //mz nothing to read
             break;
         default:
@@ -284,7 +340,22 @@ void rr_create_replay_log (const char *filename) {
 	     rr_nondet_log->name, rr_nondet_log->size);
   }
   //mz read the last program point from the log header.
-  assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  RR_log_v2_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, rr_nondet_log->fp) == 1 &&
+      memcmp(hdr.magic, RR_LOG_V2_MAGIC, sizeof(hdr.magic)) == 0) {
+    rr_nondet_log->version = 2;
+    rr_nondet_log->last_prog_point = hdr.last_prog_point;
+    rr_nondet_log->num_chunks = hdr.num_chunks;
+    rr_nondet_log->chunks = g_new(RR_log_chunk_info, hdr.num_chunks);
+    assert(fseeko(rr_nondet_log->fp, hdr.index_offset, SEEK_SET) == 0);
+    assert(fread(rr_nondet_log->chunks, sizeof(RR_log_chunk_info),
+                 hdr.num_chunks, rr_nondet_log->fp) == hdr.num_chunks);
+  }
+  else {
+    rr_nondet_log->version = 1;
+    rewind(rr_nondet_log->fp);
+    assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  }
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,61 @@
+#ifndef __RR_STATS_H_
+#define __RR_STATS_H_
+
+/* Where replay time goes, for -replay-stats, -replay-telemetry and
+   "info replay".
+   Time is charged to whichever phase is current.  Code that starts a
+   phase calls rr_stats_enter() and hands the phase it returns back to
+   rr_stats_enter() when it is done, so phases nest.  When stats are off
+   this is a single test.  The same switch turns on per-plugin callback
+   timing (RR_STATS_CB).
+*/
+
+#include "qemu-timer.h"
+
+typedef enum {
+    RR_PHASE_OTHER,         // cpu loop, devices, interrupts, monitor
+    RR_PHASE_TRANSLATE,     // guest code -> TCG -> host code
+    RR_PHASE_EXEC,          // generated code and the helpers it calls
+    RR_PHASE_CALLBACKS,     // plugin callbacks
+    RR_PHASE_NONDET,        // reading the nondet log
+    RR_PHASE_LAST
+} RR_phase;
+
+#ifdef CONFIG_SOFTMMU
+extern bool rr_stats_enabled;
+extern RR_phase rr_stats_phase;
+extern int64_t rr_stats_phase_start;
+extern int64_t rr_stats_ticks[RR_PHASE_LAST];
+
+static inline RR_phase rr_stats_enter(RR_phase phase) {
+    RR_phase old = rr_stats_phase;
+    if (unlikely(rr_stats_enabled)) {
+        int64_t now = cpu_get_real_ticks();
+        rr_stats_ticks[old] += now - rr_stats_phase_start;
+        rr_stats_phase_start = now;
+        rr_stats_phase = phase;
+    }
+    return old;
+}
+
+// Make one plugin callback, charging its time to its panda_cb_list entry
+#define RR_STATS_CB(plist, call) do {                                   \
+        if (unlikely(rr_stats_enabled)) {                               \
+            int64_t rr_cb_start = cpu_get_real_ticks();                 \
+            call;                                                       \
+            (plist)->ticks += cpu_get_real_ticks() - rr_cb_start;       \
+            (plist)->calls++;                                           \
+        }                                                               \
+        else {                                                          \
+            call;                                                       \
+        }                                                               \
+    } while (0)
+#else
+static inline RR_phase rr_stats_enter(RR_phase phase) {
+    return RR_PHASE_OTHER;
+}
+
+#define RR_STATS_CB(plist, call) do { call; } while (0)
+#endif
+
+#endif
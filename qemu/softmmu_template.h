@@ -26,6 +26,7 @@
 
 #ifdef MMU_INSTR
 #include "panda_plugin.h"
+#include "rr_stats.h"
 #endif
 
 //mz 09.13.2009 env->tlb_table is read but not written in this file.
@@ -138,7 +139,7 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
@@ -178,16 +179,36 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
 
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory read
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_read(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &res);
+    if (panda_lazy_pc && !panda_update_pc) {
+        env->panda_guest_pc = panda_pc_from_host(env, GETPC());
     }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_read(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &res);
+    panda_mem_retaddr = GETPC();
+    // Watches alone also bring accesses here; the callback lists are only
+    // for plugins that asked for them with panda_enable_memcb().
+    if (panda_use_memcb) {
+        panda_cb_list *plist;
+        panda_cb_list **pcb;
+        RR_phase old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+        PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_READ, pcb, plist) {
+            RR_STATS_CB(plist, plist->entry.virt_mem_read(env,
+                env->panda_guest_pc, addr, DATA_SIZE, &res));
+        }
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_READ, pcb, plist) {
+            RR_STATS_CB(plist, plist->entry.phys_mem_read(env,
+                env->panda_guest_pc, cpu_get_phys_addr(env, addr), DATA_SIZE,
+                &res));
+        }
+        rr_stats_enter(old_phase);
+    }
+    if (unlikely(panda_use_memwatch)) {
+        panda_mem_watch_access(env, false, addr, DATA_SIZE, &res);
+    }
+    panda_mem_retaddr = NULL;
+    if (unlikely(panda_restart_pending)) {
+        panda_do_restart_insn(env, GETPC());
+    }
+    if (panda_use_memcb && panda_cb_tab[PANDA_CB_MEM_BATCH]) {
+        panda_mem_batch_add(env, false, addr, DATA_SIZE, res);
     }
 #endif
 
@@ -209,7 +230,7 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
@@ -330,23 +351,43 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
 
 #ifdef MMU_INSTR
     // PANDA instrumentation: memory write
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_write(env, env->panda_guest_pc, addr,
-            DATA_SIZE, &val);
+    if (panda_lazy_pc && !panda_update_pc) {
+        env->panda_guest_pc = panda_pc_from_host(env, GETPC());
     }
-    for(plist = panda_cbs[PANDA_CB_PHYS_MEM_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-        plist->entry.phys_mem_write(env, env->panda_guest_pc,
-            cpu_get_phys_addr(env, addr), DATA_SIZE, &val);
+    panda_mem_retaddr = GETPC();
+    // Watches alone also bring accesses here; the callback lists are only
+    // for plugins that asked for them with panda_enable_memcb().
+    if (panda_use_memcb) {
+        panda_cb_list *plist;
+        panda_cb_list **pcb;
+        RR_phase old_phase = rr_stats_enter(RR_PHASE_CALLBACKS);
+        PANDA_CB_FOREACH(PANDA_CB_VIRT_MEM_WRITE, pcb, plist) {
+            RR_STATS_CB(plist, plist->entry.virt_mem_write(env,
+                env->panda_guest_pc, addr, DATA_SIZE, &val));
+        }
+        PANDA_CB_FOREACH(PANDA_CB_PHYS_MEM_WRITE, pcb, plist) {
+            RR_STATS_CB(plist, plist->entry.phys_mem_write(env,
+                env->panda_guest_pc, cpu_get_phys_addr(env, addr), DATA_SIZE,
+                &val));
+        }
+        rr_stats_enter(old_phase);
+    }
+    if (unlikely(panda_use_memwatch)) {
+        panda_mem_watch_access(env, true, addr, DATA_SIZE, &val);
+    }
+    panda_mem_retaddr = NULL;
+    if (unlikely(panda_restart_pending)) {
+        panda_do_restart_insn(env, GETPC());
+    }
+    if (panda_use_memcb && panda_cb_tab[PANDA_CB_MEM_BATCH]) {
+        panda_mem_batch_add(env, true, addr, DATA_SIZE, val);
     }
 #endif
 
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_WATCH)) {
             //mz 10.20.2009  There's something in the lower 12 bits (and
             //TLB_INVALID_MASK is not it) - therefore, it must be IO
             /* IO access */
@@ -411,7 +452,7 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
  redo:
     tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
     if ((addr & TARGET_PAGE_MASK) == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-        if (tlb_addr & ~TARGET_PAGE_MASK) {
+        if (tlb_addr & ~(TARGET_PAGE_MASK | TLB_WATCH)) {
             /* IO access */
             if ((addr & (DATA_SIZE - 1)) != 0)
                 goto do_unaligned_access;
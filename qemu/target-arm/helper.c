@@ -614,8 +614,8 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
     if (op1 == 7){
         // PANDA instrumentation: guest hypercall
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL;
-                plist = panda_cb_list_next(plist)){
+        panda_cb_list **pcb;
+        PANDA_CB_FOREACH(PANDA_CB_GUEST_HYPERCALL, pcb, plist){
             plist->entry.guest_hypercall(env);
         }
     }
@@ -1383,8 +1383,8 @@ void HELPER(set_cp)(CPUState *env, uint32_t insn, uint32_t val)
     if (cp_num == 7){
         // PANDA instrumentation: guest hypercall
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL;
-                plist = panda_cb_list_next(plist)) {
+        panda_cb_list **pcb;
+        PANDA_CB_FOREACH(PANDA_CB_GUEST_HYPERCALL, pcb, plist) {
             plist->entry.guest_hypercall(env);
         }
     }
@@ -1440,6 +1440,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
     int crm;
 
     panda_cb_list *plist;
+    panda_cb_list **pcb;
     target_ulong oldval;
 
     op1 = (insn >> 21) & 7;
@@ -1506,14 +1507,14 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
 	    switch (op2) {
 	    case 0:
                 oldval = env->cp15.c2_base0;
-		for(plist = panda_cbs[PANDA_CB_VMI_PGD_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		PANDA_CB_FOREACH(PANDA_CB_VMI_PGD_CHANGED, pcb, plist) {
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base0 = val;
 		break;
 	    case 1:
                 oldval = env->cp15.c2_base1;
-		for(plist = panda_cbs[PANDA_CB_VMI_PGD_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+		PANDA_CB_FOREACH(PANDA_CB_VMI_PGD_CHANGED, pcb, plist) {
                     plist->entry.after_PGD_write(env, oldval, val);
 		}
 		env->cp15.c2_base1 = val;
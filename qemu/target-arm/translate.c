@@ -32,6 +32,7 @@
 #endif
 
 #include "panda_plugin.h"
+#include "rr_stats.h"
 
 #include "helper.h"
 #define GEN_HELPER 1
@@ -104,6 +105,7 @@ static TCGv_i64 cpu_F0d, cpu_F1d;
 #include "gen-icount.h"
 
 #include "panda_plugin.h"
+#include "panda_inline_gen.h"
 
 static const char *regnames[] =
     { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
@@ -9939,6 +9941,9 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 #endif
 
     gen_icount_start();
+#ifdef CONFIG_SOFTMMU
+    gen_rr_chain_start(rr_replay_chain_tbs());
+#endif
 
     tcg_clear_temp_count();
 
@@ -10052,17 +10057,17 @@ static inline void gen_intermediate_code_internal(CPUState *env,
             tcg_gen_debug_insn_start(dc->pc);
         }
 
-        // PANDA: ask if anyone wants execution notification
-        bool panda_exec_cb = false;
-        panda_cb_list *plist;
-        for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-            panda_exec_cb |= plist->entry.insn_translate(env, dc->pc);
-        }
+        // PANDA: ask if anyone wants execution notification.  When searching
+        // for a pc, get the same answers as the first time without asking again.
+        bool panda_exec_cb = panda_insn_translate(env, tb, dc->pc, search_pc);
 
         // PANDA: Insert the instrumentation
         if (unlikely(panda_exec_cb)) {
             gen_helper_panda_insn_exec(tcg_const_tl(dc->pc));
         }
+        if (unlikely(panda_inline_nops)) {
+            panda_gen_inline(dc->pc);
+        }
 
         if (dc->thumb) {
             disas_thumb_insn(env, dc);
@@ -10173,6 +10178,9 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 
 done_generating:
     gen_icount_end(tb, num_insns);
+#ifdef CONFIG_SOFTMMU
+    gen_rr_chain_end(tb);
+#endif
     *gen_opc_ptr = INDEX_op_end;
 
 #ifdef DEBUG_DISAS
@@ -519,10 +519,11 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
 {
     panda_cb_list *plist;
+    panda_cb_list **pcb;
     /* Do we want to exclude changes when paging is disabled?
     target_ulong oldval;
     oldval = env->cr[3]; */
-    for(plist = panda_cbs[PANDA_CB_VMI_PGD_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+    PANDA_CB_FOREACH(PANDA_CB_VMI_PGD_CHANGED, pcb, plist) {
         plist->entry.after_PGD_write(env, env->cr[3], new_cr3);
     }
     
@@ -98,6 +98,8 @@ static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 #include "gen-icount.h"
 
 #include "panda_plugin.h"
+#include "rr_stats.h"
+#include "panda_inline_gen.h"
 
 #ifdef TARGET_X86_64
 static int x86_64_hregs;
@@ -7933,6 +7935,9 @@ static void gen_intermediate_code_internal(CPUState *env,
 #endif
 
     gen_icount_start();
+#ifdef CONFIG_SOFTMMU
+    gen_rr_chain_start(rr_replay_chain_tbs());
+#endif
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -7973,9 +7978,11 @@ static void gen_intermediate_code_internal(CPUState *env,
                 tcg_gen_debug_insn_start(pc_ptr);
 
             //mz let's count this instruction
+            // Replay only needs eip for its program points, so with lazy
+            // precise pc the store can go.
             if (
 #ifdef CONFIG_SOFTMMU
-                rr_mode != RR_OFF ||
+                (rr_mode != RR_OFF && !panda_lazy_pc) ||
 #endif
                 panda_update_pc) {
                 gen_op_update_panda_pc(pc_ptr);
@@ -7986,17 +7993,17 @@ static void gen_intermediate_code_internal(CPUState *env,
             }
 #endif
 
-            // PANDA: ask if anyone wants execution notification
-            bool panda_exec_cb = false;
-            panda_cb_list *plist;
-            for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL; plist = panda_cb_list_next(plist)) {
-                panda_exec_cb |= plist->entry.insn_translate(env, pc_ptr);
-            }
+            // PANDA: ask if anyone wants execution notification.  When searching
+            // for a pc, get the same answers as the first time without asking again.
+            bool panda_exec_cb = panda_insn_translate(env, tb, pc_ptr, search_pc);
 
             // PANDA: Insert the instrumentation
             if (unlikely(panda_exec_cb)) {
                 gen_helper_panda_insn_exec(tcg_const_tl(pc_ptr));
             }
+            if (unlikely(panda_inline_nops)) {
+                panda_gen_inline(pc_ptr);
+            }
 
             
             //mz generate micro-ops for this instruction
@@ -8094,6 +8101,9 @@ static void gen_intermediate_code_internal(CPUState *env,
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_icount_end(tb, num_insns);
+#ifdef CONFIG_SOFTMMU
+    gen_rr_chain_end(tb);
+#endif
     *gen_opc_ptr = INDEX_op_end;
     /* we don't forget to fill the last values */
     if (search_pc) {
@@ -1100,7 +1100,7 @@ static inline void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
                     TCG_REG_R1, 0, addr_reg2, SHIFT_IMM_LSL(0));
     tcg_out_dat_imm(s, COND_AL, ARITH_MOV, TCG_REG_R2, 0, mem_index);
 # endif
-    if(panda_use_memcb)
+    if(panda_use_memcb || panda_use_memwatch)
         tcg_out_call(s, (tcg_target_long) qemu_ld_helpers_panda[s_bits]);
     else
         tcg_out_call(s, (tcg_target_long) qemu_ld_helpers[s_bits]);
@@ -1368,7 +1368,7 @@ static inline void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
         break;
     }
 # endif
-    if(panda_use_memcb)
+    if(panda_use_memcb || panda_use_memwatch)
         tcg_out_call(s, (tcg_target_long) qemu_st_helpers_panda[s_bits]);
     else
         tcg_out_call(s, (tcg_target_long) qemu_st_helpers[s_bits]);
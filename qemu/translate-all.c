@@ -145,6 +145,18 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
     return 0;
 }
 
+#if defined(CONFIG_LLVM)
+/* Whether host_pc is in the LLVM code of 'tb' rather than its TCG code.
+   With LLVM on, a block may still run its TCG code (see
+   PANDA_CB_BEFORE_BLOCK_EXEC_LLVM).  */
+static inline bool tb_llvm_pc(TranslationBlock *tb, unsigned long host_pc)
+{
+    return execute_llvm && tb->llvm_tc_ptr &&
+        host_pc >= (unsigned long)tb->llvm_tc_ptr &&
+        host_pc < (unsigned long)tb->llvm_tc_end;
+}
+#endif
+
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
 int cpu_restore_state(TranslationBlock *tb,
@@ -152,8 +164,8 @@ int cpu_restore_state(TranslationBlock *tb,
 {
     // PANDA instrumentation: CPU restore state
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+    panda_cb_list **pcb;
+    PANDA_CB_FOREACH(PANDA_CB_CPU_RESTORE_STATE, pcb, plist) {
         plist->entry.cb_cpu_restore_state(env, tb);
     }
  
@@ -179,7 +191,7 @@ int cpu_restore_state(TranslationBlock *tb,
     }
 
 #if defined(CONFIG_LLVM)
-    if(execute_llvm) {
+    if(tb_llvm_pc(tb, searched_pc)) {
         assert(tb->llvm_function != NULL);
         j = tcg_llvm_search_last_pc(tb, searched_pc);
     } else {
@@ -220,3 +232,42 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* Return the guest pc of the instruction that contains host address
+   'searched_pc' in 'tb', or -1 if it can't be found.  Unlike
+   cpu_restore_state(), the cpu state is left alone.  Used by PANDA to
+   recover a precise pc without storing it before every instruction.  */
+target_ulong cpu_get_guest_pc(TranslationBlock *tb,
+                              CPUState *env, unsigned long searched_pc)
+{
+    TCGContext *s = &tcg_ctx;
+    int j;
+    unsigned long tc_ptr;
+
+#if defined(CONFIG_LLVM)
+    if (tb_llvm_pc(tb, searched_pc)) {
+        return -1;
+    }
+#endif
+    tc_ptr = (unsigned long)tb->tc_ptr;
+    if (searched_pc < tc_ptr)
+        return -1;
+
+    tcg_func_start(s);
+    gen_intermediate_code_pc(env, tb);
+
+    s->tb_next_offset = tb->tb_next_offset;
+#ifdef USE_DIRECT_JUMP
+    s->tb_jmp_offset = tb->tb_jmp_offset;
+    s->tb_next = NULL;
+#else
+    s->tb_jmp_offset = NULL;
+    s->tb_next = tb->tb_next;
+#endif
+    j = tcg_gen_code_search_pc(s, (uint8_t *)tc_ptr, searched_pc - tc_ptr);
+    if (j < 0)
+        return -1;
+    while (gen_opc_instr_start[j] == 0)
+        j--;
+    return gen_opc_pc[j];
+}
@@ -1581,6 +1581,12 @@ static void main_loop(void)
             sigprocmask(SIG_SETMASK, &oldset, NULL);
         }
 
+        if (rr_checkpoint_requested && rr_in_replay()) {
+            sigprocmask(SIG_BLOCK, &blockset, &oldset);
+            rr_do_checkpoint();
+            sigprocmask(SIG_SETMASK, &oldset, NULL);
+        }
+
         //mz 05.2012 We have the global mutex here, so this should be OK.
         if (rr_end_record_requested && rr_in_record()) {
             rr_do_end_record();
@@ -3228,11 +3234,59 @@ int main(int argc, char **argv, char **envp)
                 record_name = optarg;
 	            break;
 
+            case QEMU_OPTION_record_async:
+                rr_async_num_bufs = strtoul(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_record_compress:
+                rr_record_compressed = true;
+                break;
+
+            case QEMU_OPTION_record_hash:
+                rr_hash_interval = strtoull(optarg, NULL, 0);
+                break;
+
             case QEMU_OPTION_replay:
                 display_type = DT_NONE;
                 replay_name = optarg;
                 break;
 
+            case QEMU_OPTION_replay_at:
+                rr_replay_start_instr = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_end:
+                rr_replay_end_instr = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_chain:
+                rr_replay_chaining = true;
+                break;
+
+            case QEMU_OPTION_replay_checkpoint:
+                rr_checkpoint_interval = strtoull(optarg, NULL, 0);
+                break;
+
+            case QEMU_OPTION_replay_stats:
+                rr_stats_file_name = optarg;
+                break;
+
+            case QEMU_OPTION_replay_telemetry:
+                {
+                    char *file_name = g_strdup(optarg);
+                    char *comma = strrchr(file_name, ',');
+                    if (comma) {
+                        *comma = '\0';
+                        rr_telemetry_interval = strtoul(comma + 1, NULL, 0);
+                        if (rr_telemetry_interval == 0) {
+                            fprintf(stderr, "-replay-telemetry: bad interval %s\n", comma + 1);
+                            exit(1);
+                        }
+                    }
+                    rr_telemetry_file_name = file_name;
+                }
+                break;
+
             case QEMU_OPTION_pandalog:
                 pandalog = 1;
                 pandalog_open(optarg, "w");
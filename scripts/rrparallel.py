@@ -0,0 +1,146 @@
+#!/usr/bin/env python
+#
+# Replay a recording in parallel by cutting it into slices at replay
+# checkpoints and running each slice in its own qemu process with the same
+# plugins.  The per-slice pandalogs are then stitched together in
+# instruction order.
+#
+# usage: rrparallel.py [-n slices] [-o out.plog] <rr_basename> <qemu> [qemu args...]
+#
+# e.g. rrparallel.py -n 16 -o strings.plog /replays/foo \
+#          qemu/i386-softmmu/qemu-system-i386 -m 1024 -panda 'memstrings'
+#
+# Only plugins that keep no state across the whole replay (memstrings,
+# tapindex, bigrams, asidstory, ...) give the same answer as a serial run.
+# Plugins that write their own output files into the current directory will
+# have the slices overwrite each other; only the pandalog is merged.
+
+from __future__ import print_function
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+
+RR_LOG_V2_MAGIC = b"PANDARR2"
+
+# RR_checkpoint: RR_prog_point (pc, secondary, guest_instr_count) + item_number
+CKPT_FMT = "<QQQQ"
+CKPT_SIZE = struct.calcsize(CKPT_FMT)
+
+def total_instructions(base):
+    # last_prog_point.guest_instr_count from the nondet log header; the v2
+    # header has an 8-byte magic in front of it
+    with open(base + '-rr-nondet.log', 'rb') as f:
+        hdr = f.read(32)
+    off = 24 if hdr[:8] == RR_LOG_V2_MAGIC else 16
+    return struct.unpack("<Q", hdr[off:off+8])[0]
+
+def read_checkpoints(base):
+    ckpts = set()
+    try:
+        with open(base + '-rr-ckpt.idx', 'rb') as f:
+            while True:
+                data = f.read(CKPT_SIZE)
+                if len(data) < CKPT_SIZE: break
+                ckpts.add(struct.unpack(CKPT_FMT, data)[2])
+    except EnvironmentError:
+        pass
+    return sorted(ckpts)
+
+# options that load plugins or log for them; each takes an argument
+PLUGIN_OPTS = ('-panda', '-panda-plugin', '-panda-arg', '-pandalog')
+
+def without_plugins(qemu_cmd):
+    cmd = []
+    skip = False
+    for arg in qemu_cmd:
+        if skip:
+            skip = False
+        elif arg in PLUGIN_OPTS:
+            skip = True
+        else:
+            cmd.append(arg)
+    return cmd
+
+def run_qemu(qemu_cmd, base, extra):
+    return subprocess.Popen(qemu_cmd + ['-replay', base] + extra)
+
+def pick_boundaries(ckpts, total, nslices):
+    # checkpoint closest to each ideal cut point, without repeats
+    bounds = []
+    if not ckpts:
+        return [0, 0]
+    for k in range(1, nslices):
+        ideal = total * k // nslices
+        best = min(ckpts, key=lambda c: abs(c - ideal))
+        if best > 0 and (not bounds or best > bounds[-1]):
+            bounds.append(best)
+    return [0] + bounds + [0]
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a recording in parallel slices.")
+    parser.add_argument('-n', '--slices', type=int, default=4)
+    parser.add_argument('-o', '--output', default=None,
+                        help="merged pandalog (default: <rr_basename>.plog)")
+    parser.add_argument('base')
+    parser.add_argument('qemu', nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+
+    if not args.qemu:
+        parser.error("need a qemu command line")
+    base = args.base
+    output = args.output or base + '.plog'
+    total = total_instructions(base)
+
+    # make sure there is a checkpoint near every cut; otherwise run one
+    # plain replay, without the plugins, to lay them down
+    interval = max(total // args.slices, 1)
+    ckpts = read_checkpoints(base)
+    if len(ckpts) < args.slices - 1:
+        print("Taking checkpoints every %d instructions..." % interval)
+        p = run_qemu(without_plugins(args.qemu), base,
+                     ['-replay-checkpoint', str(interval)])
+        if p.wait() != 0:
+            print("checkpointing replay failed", file=sys.stderr)
+            sys.exit(1)
+        ckpts = read_checkpoints(base)
+
+    bounds = pick_boundaries(ckpts, total, args.slices)
+    nslices = len(bounds) - 1
+    print("Replaying %d instructions in %d slices" % (total, nslices))
+
+    procs = []
+    plogs = []
+    for i in range(nslices):
+        start, end = bounds[i], bounds[i+1]
+        plog = "%s-slice%d.plog" % (base, i)
+        extra = ['-pandalog', plog]
+        if start: extra += ['-replay-at', str(start)]
+        if end: extra += ['-replay-end', str(end)]
+        print("  slice %d: [%d, %s)" % (i, start, end if end else total))
+        procs.append(run_qemu(args.qemu, base, extra))
+        plogs.append(plog)
+
+    failed = [i for i, p in enumerate(procs) if p.wait() != 0]
+    if failed:
+        print("slices %s failed; not merging" % failed, file=sys.stderr)
+        sys.exit(1)
+
+    # Each slice starts exactly at a checkpoint and ends at the next one, so
+    # the slices don't overlap and concatenating the logs in slice order gives
+    # instruction order.  A pandalog is a gzip stream, and gzread handles a
+    # concatenation of gzip members.  Entries written after the end of a
+    # slice's replay (instr = -1) stay at the end of that slice.
+    with open(output, 'wb') as outf:
+        for plog in plogs:
+            if not os.path.exists(plog): continue
+            with open(plog, 'rb') as f:
+                shutil.copyfileobj(f, outf)
+            os.remove(plog)
+    print("Merged pandalog written to", output)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# bench.bash regressiondir [output]
+#
+# Replays each recording in bench.defs under each plugin configuration
+# there, and collects the -replay-stats output of every run into one JSON
+# file (default ${outdir}/bench.json).  Each run reports instructions/sec,
+# the time spent translating, executing, in plugin callbacks and reading
+# the nondet log, and peak RSS.
+#
+usage="try again with bench.bash regressiondir [output]"
+
+if [ $# != 1 ] && [ $# != 2 ]
+then
+    echo $usage
+    exit 1
+fi
+
+regressiondir=$1
+
+source testing.defs
+source bench.defs
+
+output=${2:-${outdir}/bench.json}
+statsfile=${outdir}/bench-run.json
+
+echo "regressiondir=[$regressiondir]"
+echo "output=[$output]"
+
+rev=$(cd $pandadir && git rev-parse HEAD 2>/dev/null)
+
+{
+    echo "{"
+    echo "  \"panda\": \"$rev\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"runs\": ["
+} > $output
+
+first=1
+for line in "${bench_replays[@]}"
+do
+    set -- $line
+    name=$1
+    arch=$2
+    replay=${replaydir}/$3
+    shift 3
+    extra="$@"
+    for config in $bench_config_names
+    do
+        echo "=============="
+        echo "bench [$name] config [$config] BEGIN"
+        /bin/rm -f $statsfile
+        ${testingdir}/runqemu.bash $arch $replay -replay-stats $statsfile $extra ${bench_configs[$config]}
+        if [ $first -eq 0 ]
+        then
+            echo "    ," >> $output
+        fi
+        first=0
+        echo "    {\"replay\": \"$name\", \"arch\": \"$arch\", \"config\": \"$config\", \"stats\":" >> $output
+        if [ -s $statsfile ]
+        then
+            cat $statsfile >> $output
+        else
+            echo "*** bench [$name] config [$config] produced no stats"
+            echo "null" >> $output
+        fi
+        echo "    }" >> $output
+        echo "bench [$name] config [$config] END"
+    done
+done
+
+{
+    echo "  ]"
+    echo "}"
+} >> $output
+
+echo " "
+echo "results in $output"
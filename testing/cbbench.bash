@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# cbbench.bash regressiondir [output]
+#
+# Measures what each PANDA hook point costs.  Replays each recording in
+# bench.defs once per cbbench mode there, with only the cbbench plugin
+# loaded and only that one hook turned on.  Every mode is compared against
+# mode none (the plugin loaded, nothing on): the slowdown is the ratio of
+# run times, and the cost per event is the extra time divided by the
+# number of events the hook saw (blocks, instructions, memory accesses;
+# instructions for modes with no callback).  Each mode is run
+# $cbbench_repeats times and the fastest run is kept.  The table is
+# printed and written to output (default ${outdir}/cbbench.txt).
+#
+usage="try again with cbbench.bash regressiondir [output]"
+
+if [ $# != 1 ] && [ $# != 2 ]
+then
+    echo $usage
+    exit 1
+fi
+
+regressiondir=$1
+
+source testing.defs
+source bench.defs
+
+output=${2:-${outdir}/cbbench.txt}
+runlog=${outdir}/cbbench-run.log
+
+echo "regressiondir=[$regressiondir]"
+echo "output=[$output]"
+
+/bin/rm -f $output
+for line in "${bench_replays[@]}"
+do
+    set -- $line
+    name=$1
+    arch=$2
+    replay=${replaydir}/$3
+    shift 3
+    extra="$@"
+    results=""
+    for mode in $cbbench_modes
+    do
+        for i in $(seq $cbbench_repeats)
+        do
+            echo "=============="
+            echo "cbbench [$name] mode [$mode] run [$i] BEGIN"
+            ${testingdir}/runqemu.bash $arch $replay $extra -panda cbbench:mode=$mode > $runlog 2>&1
+            result=$(grep "^cbbench: mode=" $runlog)
+            if [ -z "$result" ]
+            then
+                echo "*** cbbench [$name] mode [$mode] produced no result"
+                tail -5 $runlog
+            fi
+            results="$results$result"$'\n'
+            echo "cbbench [$name] mode [$mode] run [$i] END"
+        done
+    done
+    # keep the fastest run of each mode, then compare with mode none
+    echo "$results" | awk -v name=$name '
+        /^cbbench: mode=/ {
+            for (i = 2; i <= NF; i++) {
+                split($i, kv, "=")
+                v[kv[1]] = kv[2]
+            }
+            m = v["mode"]
+            if (!(m in secs) || v["seconds"] < secs[m]) {
+                secs[m] = v["seconds"]
+                events[m] = v["events"]
+            }
+            if (!(m in seen)) {
+                seen[m] = 1
+                order[n++] = m
+            }
+        }
+        END {
+            printf "%s\n", name
+            printf "  %-12s %10s %8s %16s %10s\n", "mode", "seconds", "slowdown", "events", "ns/event"
+            base = secs["none"]
+            for (i = 0; i < n; i++) {
+                m = order[i]
+                if (base > 0 && m != "none") {
+                    printf "  %-12s %10.3f %7.2fx %16.0f %10.2f\n", m, secs[m], secs[m] / base, events[m], (secs[m] - base) * 1e9 / events[m]
+                }
+                else {
+                    printf "  %-12s %10.3f %8s %16.0f %10s\n", m, secs[m], "-", events[m], "-"
+                }
+            }
+        }' | tee -a $output
+done
+
+echo " "
+echo "results in $output"